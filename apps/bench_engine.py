@@ -0,0 +1,60 @@
+## Engine benchmark - tag updates/second through liblocalisation, one
+## update() call per tag against one update_batch() call per cycle. Every
+## cycle feeds each tag a recorded training print with noise added, and both
+## ways must give the same locations.
+##
+##   python bench_engine.py [--tags N] [--cycles N]
+
+import argparse
+import random
+
+import localisation
+from bench_util import SEED, noisy, percentile, timed
+
+
+def make_cycles(rssi, tags, cycles, seed=SEED):
+    rand = random.Random(seed)
+    return [[noisy(rand, rssi[rand.randrange(len(rssi))])
+             for _ in range(tags)] for _ in range(cycles)]
+
+
+def run(name, step, cycles, tags):
+    """Time each cycle, (results, summary line)"""
+    results, times = timed(step, cycles)
+    return results, "%-12s %12.0f %12.2f %12.2f" % (
+        name, len(cycles) * len(tags) / sum(times),
+        1e3 * percentile(times, 50), 1e3 * percentile(times, 99))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Engine benchmark")
+    parser.add_argument("--tags", type=int, default=1000)
+    parser.add_argument("--cycles", type=int, default=50)
+    args = parser.parse_args()
+
+    knn = localisation.load_knn()
+    stations = knn.anchors() or localisation.STATIONS
+    rssi, _ = localisation.load_training_set()
+    tags = list(range(1, args.tags + 1))
+    cycles = make_cycles(rssi, args.tags, args.cycles)
+
+    print("%d tags, %d cycles, kernel %s" % (args.tags, args.cycles,
+                                             localisation.knn_kernel()))
+    print("%-12s %12s %12s %12s" % ("api", "updates/s", "p50 ms/cyc",
+                                    "p99 ms/cyc"))
+
+    single = localisation.Engine(knn, stations, max_tags=args.tags)
+    expected, line = run("update", lambda rows: [
+        single.update(t, r) for t, r in zip(tags, rows)], cycles, tags)
+    print(line)
+
+    batch = localisation.Engine(knn, stations, max_tags=args.tags)
+    results, line = run("update_batch", lambda rows: batch.update_batch(
+        tags, rows), cycles, tags)
+    print(line)
+    if results != expected:
+        raise SystemExit("update_batch disagrees with update")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,236 @@
+## Ultrasonic fusion benchmark - replays a trace through the engine with and
+## without the ultrasonic ranges, and compares accuracy overall and while a
+## tag is in a ranger's beam, how many samples a tag takes to snap to within
+## SNAP_M of the truth after entering a beam, and the time per update.
+##
+## A trace is CSV, one mobile report per row:
+##   time, tag, x, y, rssi0 .. rssiN-1, us0 .. usM-1
+## with x, y the true location (blank if unknown), RSSI LOC_RSSI_NONE if not
+## heard and echo times in microseconds (blank if none). Without --trace,
+## tags walk the floor plan reporting held out training prints, and each
+## ranger reports the nearest tag in its beam with range noise, dropouts and
+## clutter. --save writes that trace out.
+##
+##   python bench_fusion.py [--trace PATH] [--save PATH] [--tags N]
+##                          [--steps N]
+
+import argparse
+import csv
+import math
+import random
+import time
+
+import localisation
+from bench_util import SEED, percentile
+
+## Error a tag must come within to count as snapped (m)
+SNAP_M = 0.5
+## Samples ignored at the start of each track
+WARMUP = 10
+## Walking speed (m per sample)
+SPEED = 0.2
+
+## Simulated rangers - beam half angle, range noise (m) and the chance of a
+## missed echo, or of an echo off something else when no tag is in the beam
+BEAM_HALF_ANGLE = math.radians(15)
+RANGE_NOISE = 0.05
+DROPOUT = 0.1
+CLUTTER = 0.05
+
+
+def in_beam(ranger, point):
+    """Range from the ranger to point if point is in its beam, else None"""
+    (ax, ay), (dx, dy), max_range = ranger
+    px, py = point[0] - ax, point[1] - ay
+    along = px * dx + py * dy
+    dist = math.hypot(px, py)
+    if along <= 0 or dist > max_range or \
+            math.acos(min(1.0, along / dist)) > BEAM_HALF_ANGLE:
+        return None
+    return dist
+
+
+def range_to_echo(range_m):
+    return int(round(range_m * 2e6 / localisation.SOUND_M_S))
+
+
+def simulate(rssi, labels, rangers, tags, steps, seed):
+    """Walks of held out prints, trace rows as read_trace() gives them"""
+    rand = random.Random(seed)
+    by_label = {}
+    for i, label in enumerate(labels):
+        by_label.setdefault(tuple(label), []).append(i)
+    points = list(by_label)
+    pos = {tag: list(rand.choice(points)) for tag in tags}
+    goal = {tag: rand.choice(points) for tag in tags}
+
+    rows = []
+    for step in range(steps):
+        for tag in tags:
+            p = pos[tag]
+            while math.hypot(goal[tag][0] - p[0], goal[tag][1] - p[1]) < SPEED:
+                goal[tag] = rand.choice(points)
+            d = math.hypot(goal[tag][0] - p[0], goal[tag][1] - p[1])
+            p[0] += SPEED * (goal[tag][0] - p[0]) / d
+            p[1] += SPEED * (goal[tag][1] - p[1]) / d
+
+        ## One reading per ranger per step, heard by every tag
+        echoes = []
+        for ranger in rangers:
+            seen = [r for r in (in_beam(ranger, pos[t]) for t in tags)
+                    if r is not None]
+            if seen and rand.random() >= DROPOUT:
+                echoes.append(range_to_echo(
+                    max(0.02, min(seen) + rand.gauss(0, RANGE_NOISE))))
+            elif not seen and rand.random() < CLUTTER:
+                echoes.append(range_to_echo(rand.uniform(0.3, ranger[2])))
+            else:
+                echoes.append(None)
+
+        for tag in tags:
+            p = pos[tag]
+            near = min(points, key=lambda q: (q[0] - p[0]) ** 2 +
+                       (q[1] - p[1]) ** 2)
+            rows.append((step, tag, (p[0], p[1]),
+                         rssi[rand.choice(by_label[near])], echoes))
+    return rows
+
+
+def read_trace(path, num_anchors, num_rangers):
+    """[(time, tag, truth or None, rssi, echoes)]"""
+    rows = []
+    with open(path, newline="") as f:
+        for record in csv.reader(f):
+            if not record or not record[0].strip() or \
+                    record[0].strip() == "time":
+                continue
+            values = [v.strip() for v in record]
+            truth = (float(values[2]), float(values[3])) if values[2] else None
+            rssi = [int(v) for v in values[4:4 + num_anchors]]
+            echoes = [int(v) if v else None for v in
+                      values[4 + num_anchors:4 + num_anchors + num_rangers]]
+            rows.append((float(values[0]), int(values[1]), truth, rssi,
+                         echoes))
+    return rows
+
+
+def write_trace(path, rows, num_anchors, num_rangers):
+    with open(path, "w", newline="") as f:
+        out = csv.writer(f)
+        out.writerow(["time", "tag", "x", "y"] +
+                     ["rssi%d" % i for i in range(num_anchors)] +
+                     ["us%d" % i for i in range(num_rangers)])
+        for t, tag, truth, rssi, echoes in rows:
+            x, y = ("%.3f" % truth[0], "%.3f" % truth[1]) if truth else ("", "")
+            out.writerow([t, tag, x, y] + list(rssi) +
+                         ["" if e is None else e for e in echoes])
+
+
+def replay(engine, rows, ranged):
+    """Locations of every row, fed in batches of rows with the same time,
+    and the time taken"""
+    results = []
+    elapsed = 0.0
+    start = 0
+    while start < len(rows):
+        end = start
+        while end < len(rows) and rows[end][0] == rows[start][0]:
+            end += 1
+        batch = rows[start:end]
+        ranges = [[localisation.echo_to_range(e) for e in row[4]]
+                  for row in batch] if ranged else None
+        begin = time.perf_counter()
+        results += engine.update_batch([row[1] for row in batch],
+                                       [row[3] for row in batch], ranges)
+        elapsed += time.perf_counter() - begin
+        start = end
+    return results, elapsed
+
+
+def score(rows, results, rangers):
+    """(mean error, mean error in a beam, p90 in a beam, snap samples,
+    fraction of beam visits snapped)"""
+    errors = []
+    beam_errors = []
+    seen = {}
+    visits = {}             ## tag -> samples since entering a beam, or None
+    snaps = []
+    missed = 0
+    for (_, tag, truth, _, _), result in zip(rows, results):
+        count = seen[tag] = seen.get(tag, 0) + 1
+        if truth is None or result is None or count <= WARMUP:
+            continue
+        error = math.hypot(result[0] - truth[0], result[1] - truth[1])
+        errors.append(error)
+        beam = any(in_beam(r, truth) is not None for r in rangers)
+        if not beam:
+            if visits.get(tag) is not None:
+                missed += 1
+            visits[tag] = None
+            continue
+        beam_errors.append(error)
+        if tag not in visits or visits[tag] is None:
+            visits[tag] = 0
+        if visits[tag] is not False:
+            visits[tag] += 1
+            if error < SNAP_M:
+                snaps.append(visits[tag])
+                visits[tag] = False      ## Snapped, wait for the next visit
+    missed += sum(1 for v in visits.values() if v not in (None, False))
+    beam_errors.sort()
+    mean = lambda v: sum(v) / len(v) if v else float("nan")
+    return (mean(errors), mean(beam_errors),
+            percentile(beam_errors, 90) if beam_errors else float("nan"),
+            mean(snaps),
+            len(snaps) / max(1, len(snaps) + missed))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Ultrasonic fusion benchmark")
+    parser.add_argument("--trace", help="recorded trace CSV")
+    parser.add_argument("--save", help="write the simulated trace here")
+    parser.add_argument("--tags", type=int, default=3)
+    parser.add_argument("--steps", type=int, default=2000)
+    args = parser.parse_args()
+
+    rssi, labels = localisation.load_training_set()
+    rangers = localisation.RANGERS
+    stations = localisation.STATIONS
+
+    ## Index and calibrate on half the prints, walk the other half
+    rand = random.Random(SEED)
+    order = list(range(len(rssi)))
+    rand.shuffle(order)
+    train = order[:len(order) // 2]
+    test = order[len(order) // 2:]
+    knn = localisation.Knn([rssi[i] for i in train], [labels[i] for i in train])
+    path_loss, _ = localisation.fit_path_loss([rssi[i] for i in train],
+                                              [labels[i] for i in train],
+                                              stations)
+
+    if args.trace:
+        rows = read_trace(args.trace, len(stations), len(rangers))
+    else:
+        rows = simulate([rssi[i] for i in test], [labels[i] for i in test],
+                        rangers, list(range(1, args.tags + 1)), args.steps,
+                        seed=SEED)
+        if args.save:
+            write_trace(args.save, rows, len(stations), len(rangers))
+
+    print("%d reports from %d tags, %d rangers" % (
+        len(rows), len({row[1] for row in rows}), len(rangers)))
+    print("%-12s %8s %8s %8s %8s %8s %10s" % (
+        "fusion", "err m", "beam m", "beam p90", "snap", "snapped",
+        "us/update"))
+    for name, ranged in (("rssi", False), ("rssi+us", True)):
+        engine = localisation.Engine(knn, stations, path_loss=path_loss,
+                                     rangers=rangers)
+        results, elapsed = replay(engine, rows, ranged)
+        error, beam, p90, snap, snapped = score(rows, results, rangers)
+        print("%-12s %8.2f %8.2f %8.2f %8.1f %7.0f%% %10.2f" % (
+            name, error, beam, p90, snap, 100 * snapped,
+            1e6 * elapsed / len(rows)))
+
+
+if __name__ == "__main__":
+    main()
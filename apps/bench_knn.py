@@ -0,0 +1,88 @@
+## KNN benchmark - queries/second and latency percentiles of each search in
+## liblocalisation, against the scikit-learn classifier the GUI used (when
+## scikit-learn is installed). Queries are training prints with noise added
+## and some anchors dropped, so every search must agree with the scalar one.
+##
+##   python bench_knn.py [--queries N] [--k K] [--l1]
+
+import argparse
+import random
+
+import localisation
+from bench_util import SEED, noisy, percentile, timed
+
+
+def make_queries(rssi, count, seed=SEED):
+    rand = random.Random(seed)
+    queries = []
+    for _ in range(count):
+        row = rssi[rand.randrange(len(rssi))]
+        query = noisy(rand, row)
+        for i in range(len(query)):
+            if rand.random() < 0.1:
+                query[i] = None
+        if all(q is None for q in query):
+            query[0] = row[0]
+        queries.append(query)
+    return queries
+
+
+def run(name, predict, queries):
+    """Time each query, (results, summary line)"""
+    results, times = timed(predict, queries)
+    return results, "%-16s %10.0f %10.1f %10.1f %10.1f" % (
+        name, len(times) / sum(times), 1e6 * percentile(times, 50),
+        1e6 * percentile(times, 99), 1e6 * times[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="KNN benchmark")
+    parser.add_argument("--queries", type=int, default=2000)
+    parser.add_argument("--k", type=int, default=5)
+    parser.add_argument("--l1", action="store_true",
+                        help="Manhattan distance (native searches only)")
+    args = parser.parse_args()
+
+    rssi, labels = localisation.load_training_set()
+    queries = make_queries(rssi, args.queries)
+    knn = localisation.Knn(rssi, labels)
+    metric = localisation.LOC_KNN_L1 if args.l1 else localisation.LOC_KNN_L2
+
+    print("%d prints x %d anchors, %d queries, k = %d, kernel %s" % (
+        len(rssi), len(rssi[0]), len(queries), args.k,
+        localisation.knn_kernel()))
+    print("%-16s %10s %10s %10s %10s" % ("search", "queries/s", "p50 us",
+                                         "p99 us", "max us"))
+
+    reference = None
+    for name, search in [("native scalar", localisation.LOC_KNN_SCALAR),
+                         ("native scan", localisation.LOC_KNN_SCAN),
+                         ("native tree", localisation.LOC_KNN_TREE)]:
+        knn.set_search(metric, search)
+        results, line = run(name, lambda q: knn.predict(q, args.k), queries)
+        if reference is None:
+            reference = results
+        mismatches = sum(a != b for a, b in zip(results, reference))
+        print(line + ("" if mismatches == 0 else
+                      "  (%d differ from scalar)" % mismatches))
+
+    try:
+        from sklearn.neighbors import KNeighborsClassifier
+    except ImportError:
+        print("scikit-learn not installed, skipping the baseline")
+        return
+    if args.l1:
+        return
+
+    ## The old GUI path - unheard anchors can't be left out, so give the
+    ## classifier full vectors
+    full = [[r if r is not None else localisation.LOC_RSSI_NONE for r in q]
+            for q in queries]
+    model = KNeighborsClassifier(n_neighbors=args.k)
+    model.fit(rssi, labels)
+    _, line = run("sklearn", lambda q: model.predict([q]), full)
+    print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,124 @@
+## Multilateration benchmark - solves/second, latency and accuracy of each
+## liblocalisation solver on the recorded training set, whose labels are the
+## true positions (metres, same frame as the stations). The GUI's original
+## scipy Nelder-Mead gps_solve is run as the baseline when scipy is
+## installed. With --calibrated each station's path loss model is fitted to
+## half of the rows and the solvers are run on the other half.
+##
+##   python bench_multilat.py [--rows N] [--anchors N] [--p0 DBM] [--n N]
+##                            [--calibrated]
+
+import argparse
+import math
+import random
+import time
+
+import localisation
+from bench_util import SEED, percentile, timed
+
+
+def gps_solve(distances_to_station, stations_coordinates):
+    """The GUI's original solver"""
+    import numpy as np
+    from scipy.optimize import minimize
+
+    def error(x, c, r):
+        return sum([(np.linalg.norm(x - c[i]) - r[i]) ** 2
+                    for i in range(len(c))])
+
+    l = len(stations_coordinates)
+    S = sum(distances_to_station)
+    W = [((l - 1) * S) / (S - w) for w in distances_to_station]
+    x0 = sum([W[i] * stations_coordinates[i] for i in range(l)])
+    return minimize(error, x0, args=(stations_coordinates,
+                                     distances_to_station),
+                    method='Nelder-Mead').x
+
+
+def make_problems(rssi, labels, count, anchors, path_loss, seed=SEED):
+    """(stations, distances, weights, truth) from the strongest anchors of
+    recorded rows, path_loss is each station's (p0, n)"""
+    rand = random.Random(seed)
+    problems = []
+    for _ in range(count):
+        i = rand.randrange(len(rssi))
+        heard = sorted(zip(rssi[i], localisation.STATIONS, path_loss),
+                       key=lambda t: t[0], reverse=True)[:anchors]
+        dist = [localisation.rssi_to_distance(r, *m) for r, _, m in heard]
+        problems.append(([s for _, s, _ in heard], dist,
+                         [1.0 / (d * d) for d in dist], labels[i]))
+    return problems
+
+
+def run(name, solve, problems):
+    results, times = timed(lambda p: solve(*p[:3]), problems)
+    errors = sorted(math.hypot(x - truth[0], y - truth[1])
+                    for (x, y), (_, _, _, truth) in zip(results, problems))
+    count = len(times)
+    print("%-22s %10.0f %8.1f %8.1f %8.2f %8.2f %8.2f" % (
+        name, count / sum(times), 1e6 * percentile(times, 50),
+        1e6 * percentile(times, 99), sum(errors) / count,
+        percentile(errors, 50), percentile(errors, 90)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Multilateration benchmark")
+    parser.add_argument("--rows", type=int, default=5000)
+    parser.add_argument("--anchors", type=int, default=6,
+                        help="strongest anchors used (the GUI used 6)")
+    parser.add_argument("--p0", type=float, default=-72.0)
+    parser.add_argument("--n", type=float, default=2.0)
+    parser.add_argument("--calibrated", action="store_true",
+                        help="fit each station's P0 and n instead")
+    args = parser.parse_args()
+
+    rssi, labels = localisation.load_training_set()
+    if args.calibrated:
+        path_loss, _ = localisation.fit_path_loss(rssi[::2], labels[::2])
+        rssi, labels = rssi[1::2], labels[1::2]
+        model = "per station path loss fitted to the other half"
+    else:
+        path_loss = [(args.p0, args.n)] * len(localisation.STATIONS)
+        model = "P0 %.0f dBm, n %.1f" % (args.p0, args.n)
+    problems = make_problems(rssi, labels, args.rows, args.anchors, path_loss)
+
+    print("%d recorded rows, %d strongest anchors, %s" % (
+        len(problems), args.anchors, model))
+    print("%-22s %10s %8s %8s %8s %8s %8s" % (
+        "solver", "solves/s", "p50 us", "p99 us", "mean m", "p50 m",
+        "p90 m"))
+
+    ## Cost of a ctypes call, included in every native time below
+    start = time.perf_counter()
+    for _ in range(10000):
+        localisation.rssi_to_distance(-60)
+    print("(ctypes call %.1f us)" % (100 * (time.perf_counter() - start)))
+
+    def native(method, weighted):
+        return lambda s, d, w: localisation.multilaterate(
+            s, d, w if weighted else None, method) or (float("nan"),) * 2
+
+    for name, method, weighted in [
+            ("native nelder-mead", localisation.LOC_MULTILAT_NELDER_MEAD,
+             False),
+            ("native linear", localisation.LOC_MULTILAT_LINEAR, False),
+            ("native linear weighted", localisation.LOC_MULTILAT_LINEAR,
+             True),
+            ("native gauss-newton", localisation.LOC_MULTILAT_GAUSS_NEWTON,
+             False),
+            ("native g-n weighted", localisation.LOC_MULTILAT_GAUSS_NEWTON,
+             True)]:
+        run(name, native(method, weighted), problems)
+
+    try:
+        import numpy as np
+        import scipy.optimize  # noqa: F401
+    except ImportError:
+        print("scipy not installed, skipping the baseline")
+        return
+    run("scipy nelder-mead", lambda s, d, w: gps_solve(d, list(np.array(s))),
+        problems[:max(1, len(problems) // 10)])
+
+
+if __name__ == "__main__":
+    main()
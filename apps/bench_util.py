@@ -0,0 +1,32 @@
+## Helpers shared by the benchmarks - seeded inputs, timing each call and
+## reading percentiles off the sorted times
+
+import time
+
+## Every benchmark draws its inputs from this seed, so runs compare
+SEED = 4011
+
+## RSSI noise added to recorded prints (dB, either way)
+NOISE_DB = 4
+
+
+def noisy(rand, row):
+    """A recorded print with uniform noise on every anchor"""
+    return [r + rand.randint(-NOISE_DB, NOISE_DB) for r in row]
+
+
+def timed(call, inputs):
+    """(results, sorted times in seconds) of call() on each input"""
+    results = []
+    times = []
+    for x in inputs:
+        start = time.perf_counter()
+        results.append(call(x))
+        times.append(time.perf_counter() - start)
+    times.sort()
+    return results, times
+
+
+def percentile(values, pct):
+    """pct percentile of sorted values, nearest rank below"""
+    return values[(pct * len(values)) // 100]
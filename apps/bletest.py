@@ -1,33 +1,41 @@
+## Prints a mobile node's reports as they arrive and the frames/second the
+## host achieves, scanning continuously or reading the base node's UART.
+##
+##   python bletest.py [--address ADDR] [--uart PORT [--source N]]
+
+import argparse
 import asyncio
-from bleak import BleakScanner
-from bleak.backends.device import BLEDevice
-from bleak.backends.scanner import AdvertisementData
 import logging
-import ctypes
+
+import ingest
 
 logging.basicConfig()
 
 
-def simple_callback(device: BLEDevice, advertisement_data: AdvertisementData):
-    if device.address == "E1:38:D4:CD:DE:AF":
-        rssi_list = []
-        us_list = []
-        adv_bytearray = list(advertisement_data.service_data.values())[0]
-        node_values = [ctypes.c_int8(adv_bytearray[i]).value for i in range(len(adv_bytearray))]
-        rssi_list.extend(node_values[3:15])
-        us_list.extend(node_values[15:17])
-        print("RSSI: ", rssi_list, ",  US: ", us_list)
+def simple_callback(tag, rssi_list, us_list, age_ms):
+    print("TAG: ", tag, ",  AGE: ", age_ms, ",  RSSI: ", rssi_list,
+          ",  US: ", us_list)
 
-async def run():
-    scanner = BleakScanner()
-    scanner.register_detection_callback(simple_callback)
 
+async def report(source):
     while True:
-        await scanner.start()
-        await asyncio.sleep(0.03)
-        await scanner.stop()
+        await asyncio.sleep(1)
+        print("%s %s" % (source.name, source.counter.summary()))
 
 
 if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Mobile node report test")
+    parser.add_argument("--address", default="E1:38:D4:CD:DE:AF")
+    parser.add_argument("--uart", help="base node serial port")
+    parser.add_argument("--source", type=int, default=0,
+                        help="the mobile's source number on the base node")
+    args = parser.parse_args()
+
     loop = asyncio.get_event_loop()
-    loop.run_until_complete(run())
+    if args.uart:
+        source = ingest.UartIngest(simple_callback, args.uart,
+                                   {args.source: 1})
+    else:
+        source = ingest.BleIngest(simple_callback, {args.address: 1})
+    source.start(loop)
+    loop.run_until_complete(report(source))
@@ -0,0 +1,59 @@
+## Fingerprint file converter - builds the KNN index from training data (a
+## training.py CSV or the workbook made from one) and saves it as a binary
+## fingerprint file the GUI maps at startup instead of parsing the workbook.
+## Each station's path loss model is fitted to the same data and stored with
+## the station table. File layout is documented in
+## liblocalisation/src/fingerprint.c
+##
+##   python fingerprint_db.py [INPUT] [-o OUTPUT] [--no-stations]
+
+import argparse
+import time
+
+import localisation
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fingerprint file converter")
+    parser.add_argument("input", nargs="?", default=localisation.TRAINING_SET,
+                        help="training.py CSV or xlsx (default %(default)s)")
+    parser.add_argument("-o", "--output", default=localisation.FINGERPRINTS)
+    parser.add_argument("--no-stations", action="store_true",
+                        help="don't store the static node locations")
+    args = parser.parse_args()
+
+    start = time.perf_counter()
+    rssi, labels = localisation.load_training_set(args.input)
+    parsed = time.perf_counter()
+    stations = None if args.no_stations else localisation.STATIONS
+    if stations and len(stations) != len(rssi[0]):
+        parser.error("%d stations but %d anchors per row, use --no-stations" %
+                     (len(stations), len(rssi[0])))
+    path_loss = None
+    unfitted = []
+    if stations:
+        path_loss, unfitted = localisation.fit_path_loss(rssi, labels,
+                                                         stations)
+    knn = localisation.Knn(rssi, labels)
+    knn.save(args.output, stations, path_loss)
+    saved = time.perf_counter()
+
+    ## Check it maps and answers the same as the index it came from
+    mapped = localisation.Knn.open(args.output)
+    opened = time.perf_counter()
+    for row in rssi[::max(1, len(rssi) // 100)]:
+        if mapped.predict(row) != knn.predict(row):
+            raise SystemExit("%s does not match the training set" % args.output)
+
+    print("%d rows x %d anchors, %d labels" % (len(rssi), len(rssi[0]),
+                                               len(set(labels))))
+    for i, (p0, n) in enumerate(path_loss or []):
+        print("station %2d (%5.2f, %5.2f): P0 %6.1f dBm, n %.2f%s" % (
+            i + 1, stations[i][0], stations[i][1], p0, n,
+            " (not fitted, uncalibrated)" if i in unfitted else ""))
+    print("parse %.2f s, build and save %.3f s, open %.1f ms -> %s" % (
+        parsed - start, saved - parsed, 1e3 * (opened - saved), args.output))
+
+
+if __name__ == "__main__":
+    main()
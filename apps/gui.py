@@ -17,232 +17,101 @@ from pyqtgraph.graphicsItems.ScatterPlotItem import Symbols
 import asyncio
 
 from scipy.sparse import coo
-from bleak import BleakScanner
-from bleak.backends.device import BLEDevice
-from bleak.backends.scanner import AdvertisementData
 import logging
-import ctypes
 from asyncqt import QEventLoop
-from openpyxl import load_workbook
-import scipy.optimize as opt
-from sklearn.neighbors import KNeighborsClassifier 
-from pykalman import KalmanFilter
-from scipy.optimize import minimize
 from datetime import datetime
 import tago
-
-mobile1_R = None
-mobile1_U = None
-mobile2_R = None
-mobile2_U = None
-mobile3_R = None
-mobile3_U = None
-
-## BT RSSI callback (async)
-def simple_callback(device: BLEDevice, advertisement_data: AdvertisementData):
-    ## Add mobile node devices here
-    if device.address == "E1:38:D4:CD:DE:AF" and advertisement_data.service_data:
-        global mobile1_R
-        global mobile1_U
-        rssi_list = []
-        us_list = []
-        adv_bytearray = list(advertisement_data.service_data.values())[0]
-        node_values = [ctypes.c_int8(adv_bytearray[i]).value for i in range(len(adv_bytearray))]
-        rssi_list.extend(node_values[2:15])
-        us_list.extend(node_values[15:17])
-        mobile1_R = rssi_list
-        mobile1_U = us_list
-    if device.address == "CF:95:D7:62:5F:4D" and advertisement_data.service_data:
-        global mobile2_R
-        global mobile2_U
-        rssi_list = []
-        us_list = []
-        adv_bytearray = list(advertisement_data.service_data.values())[0]
-        node_values = [ctypes.c_int8(adv_bytearray[i]).value for i in range(len(adv_bytearray))]
-        rssi_list.extend(node_values[2:15])
-        us_list.extend(node_values[15:17])
-        mobile2_R = rssi_list
-        mobile2_U = us_list
-    if device.address == "DC:6C:AA:64:DA:1A" and advertisement_data.service_data:
-        global mobile3_R
-        global mobile3_U
-        rssi_list = []
-        us_list = []
-        adv_bytearray = list(advertisement_data.service_data.values())[0]
-        node_values = [ctypes.c_int8(adv_bytearray[i]).value for i in range(len(adv_bytearray))]
-        rssi_list.extend(node_values[2:15])
-        us_list.extend(node_values[15:17])
-        mobile3_R = rssi_list
-        mobile3_U = us_list
-
-def get_trainingmodel():
-        X_train = []
-        Y_train = []
-        ## add training data here
-        wb = load_workbook(filename=r'C:\Users\desmo\csse4011\csse4011-project\apps\trainingset.xlsx')
-        sheet = wb.active
-
-        for r in sheet.iter_rows(min_row=1,max_row=37600,min_col=1,max_col=3,values_only=True):
-            temp = []
-            r_n = [int(s) for s in r[0].split('?')]
-            temp = [int(r[1].strip('|')), int(r[2].strip('|'))]
-            Y_train.append(temp)
-            X_train.append(r_n)
-        model = KNeighborsClassifier(n_neighbors=5)
-        model.fit(X_train,Y_train)
-        return model
-
-def Kalman(raw_data):
-        kf = KalmanFilter(initial_state_mean=[0,0], n_dim_obs=2)
-        measurements = np.asarray(raw_data)  # 2 observations
-        initial_state_mean = [measurements[0, 0],
-                            0,
-                            measurements[0, 1],
-                            0]
-        transition_matrix = [[1, 1, 0, 0],
-                            [0, 1, 0, 0],
-                            [0, 0, 1, 1],
-                            [0, 0, 0, 1]]
-        observation_matrix = [[1, 0, 0, 0],
-                            [0, 0, 1, 0]]
-
-        kf1 = KalmanFilter(transition_matrices = transition_matrix,
-                        observation_matrices = observation_matrix,
-                        initial_state_mean = initial_state_mean)
-        kf1 = kf1.em(measurements, n_iter=3)
-        (smoothed_state_means, smoothed_state_covariances) = kf1.smooth(measurements)
-        x = smoothed_state_means[:, 0]
-        y = smoothed_state_means[:, 2]
-        mean_x = (sum(x)) / len(x)
-        mean_y = (sum(y)) / len(y)
-        return [mean_x, mean_y]
-
-def rssi_dist_convert(rssi, ntype):
-        if (ntype == 1): ## board static beacon
-            dist = 10 ** ((-58 - rssi) / 30)  
-            return dist
-        elif (ntype == 0): ## ibeacon
-            dist = 10 ** ((-72 - rssi) / 20)
-            return dist 
-
-## Mulitilateration
-def gps_solve(distances_to_station, stations_coordinates):
-    def error(x, c, r):
-        return sum([(np.linalg.norm(x - c[i]) - r[i]) ** 2 for i in range(len(c))])
-
-    l = len(stations_coordinates)
-    S = sum(distances_to_station)
-    # compute weight vector for initial guess
-    W = [((l - 1) * S) / (S - w) for w in distances_to_station]
-    # get initial guess of point location
-    x0 = sum([W[i] * stations_coordinates[i] for i in range(l)])
-    # optimize distance from signal origin to border of spheres
-    return minimize(error, x0, args=(stations_coordinates, distances_to_station), method='Nelder-Mead').x
-
-## BT RSSI scanner thread
-class RSSI(QThread):
-    signal  = pyqtSignal('PyQt_PyObject')
-
-    def __init__(self, loop: asyncio.AbstractEventLoop, parent = None):
-        super(RSSI, self).__init__(parent)
-        self.loop = loop
-    
-    async def run(self):
-        scanner = BleakScanner()
-        scanner.register_detection_callback(simple_callback)     
-
-        while True:
-            await scanner.start()
-            await asyncio.sleep(0.1)
-            await scanner.stop()
-
-    def work(self):
-        asyncio.ensure_future(self.run(), loop=self.loop)
-
-## Data processing thread
+import localisation
+import pipeline
+import ingest
+import uploader
+
+## Mobile node address -> tag number (1 up, the plot colour order)
+MOBILE_NODES = {
+    "E1:38:D4:CD:DE:AF": 1,
+    "CF:95:D7:62:5F:4D": 2,
+    "DC:6C:AA:64:DA:1A": 3,
+}
+## Base node mobile source number (defaultMobiles in apps/project/base,
+## numbered from 0) -> tag number
+UART_SOURCES = {
+    0: 1,
+    1: 2,
+    2: 3,
+}
+
+## Plot and room label colour of each tag, in tag order (the plot uses
+## the first letter, pyqtgraph's colour code)
+TAG_COLOURS = ["red", "green", "blue"]
+
+
+def room_name(x, y):
+    """Room of a location on the floor plan"""
+    if 3 < x < 7 and 7 < y < 11:
+        return 'Room1'
+    if 12 < x < 18.4 and 7 < y < 11:
+        return 'Room2'
+    if y > 11:
+        return 'Corridor'
+    return 'Open space'
+
+
+## Rate the UI redraws at, however fast locations are solved
+UI_RATE_HZ = 20
+## Seconds between pipeline statistics in the status bar
+STATS_PERIOD = 1.0
+
+## Base node serial port to ingest from instead of scanning (--uart PORT)
+UART_PORT = None
+## Dashboard API to upload to instead of tago (--upload-url URL), e.g.
+## upload_stub.py
+UPLOAD_URL = None
+MY_DEVICE_TOKEN = '3503290b-05e5-433d-a864-e1b8e7bfbf11' ## Add tagoio dashboard api key here
+
+## Mobile reports from the scanner to the solver
+samples = pipeline.SampleQueue()
+
+## Mobile report callback, from either ingest
+def on_sample(tag, rssi_list, us_list, age_ms):
+    samples.put(pipeline.Sample(time.monotonic() - age_ms / 1000, tag,
+                                rssi_list[:13], us_list))
+
+## Data processing thread, solves whenever samples arrive
 class Worker(QThread):
-    signal = pyqtSignal('PyQt_PyObject')
 
-    def __init__(self):
+    def __init__(self, samples, upload):
         QThread.__init__(self)
+        self.samples = samples
+        self.upload = upload
+        self.stats = pipeline.StageStats()
+        ## tag -> (x, y), replaced rather than changed so readers need no lock
+        self.locations = {}
 
     def run(self):
-        model = get_trainingmodel()
+        ## Map the fingerprint file (built from trainingset.xlsx if needed)
+        knn = localisation.load_knn()
         ## Static nodes locations 
-        stations = list(np.array([[17.8,7.8], [2.4,7.8], [5.85,3.0], [11.95,0.1],[6.55,0.1],[12.75,3.0],[9.45,12.75],[14.2,10],[5.5,10],[12.55,9.2],[8.65,9.2],[15.05,4.8],[6.95,4.8]]))
-        time1 = datetime.now()
-        timestamp = datetime.timestamp(time1)
-        MY_DEVICE_TOKEN = '3503290b-05e5-433d-a864-e1b8e7bfbf11' ## Add tagoio dashboard api key here
-        my_device = tago.Device(MY_DEVICE_TOKEN)
-        temp1 = []
-        temp2 = []
-        temp3 = []
-        count = 0
+        stations = knn.anchors() or localisation.STATIONS
+        ## KNN + multilateration fixes and ultrasonic ranges fused by a
+        ## Kalman track per mobile
+        engine = localisation.Engine(knn, stations,
+                                     rangers=localisation.RANGERS)
         while True:
-            ## feed rssi to modal
-            m1  = mobile1_R
-            m2  = mobile2_R
-            m3  = mobile3_R
-            knn1 = model.predict([m1])
-            knn2 = model.predict([m2])
-            knn3 = model.predict([m3])
-            ## get distance from rssi value
-            min_list1 = sorted(zip(stations,m1), key=lambda t: t[1])[7:] ## get the best 6 rssi signal strength
-            dist1 = [rssi_dist_convert(i[1],0) for i in min_list1]
-            nodes1 = [i[0] for i in min_list1]
-            min_list2 = sorted(zip(stations,m2), key=lambda t: t[1])[7:]
-            dist2 = [rssi_dist_convert(i[1],0) for i in min_list2]
-            nodes2 = [i[0] for i in min_list2]
-            min_list3 = sorted(zip(stations,m3), key=lambda t: t[1])[7:]
-            dist3 = [rssi_dist_convert(i[1],0) for i in min_list3]
-            nodes3 = [i[0] for i in min_list3]
-            ## multilateration
-            multi1 = gps_solve(dist1, nodes1)
-            multi2 = gps_solve(dist2, nodes2)
-            multi3 = gps_solve(dist3, nodes3)
-            ## kalman filter
-            if count > 5: ## takes 10 readings of knn and multilateration coordinates and perform Kalman filter
-                loc1 = Kalman(temp1)
-                loc2 = Kalman(temp2)
-                loc3 = Kalman(temp3)
-                temp=[]
-                temp.append(loc1)
-                temp.append(loc2)
-                temp.append(loc3)
-                loc = [[int(i[0]) for i in temp],[int(i[1]) for i in temp]]
-                self.signal.emit(loc)
-                temp1 = []
-                temp2 = []
-                temp3 = []
-                count = 0
-            else:
-                temp1.append(knn1[0])
-                temp1.append(multi1)
-                temp2.append(knn2[0])
-                temp2.append(multi2)
-                temp3.append(knn3[0])
-                temp3.append(multi3)
-                count += 1
+            ## feed every sample queued since the last batch to the engine
+            batch = self.samples.get_all()
+            if batch:
+                results = engine.update_batch(
+                    [s.tag for s in batch], [s.rssi for s in batch],
+                    [[localisation.echo_to_range(u) for u in s.us or []]
+                     for s in batch])
+                locations = dict(self.locations)
+                for sample, result in zip(batch, results):
+                    if result is not None:
+                        locations[sample.tag] = result
+                self.locations = locations
+                self.upload.submit(locations)
+                self.stats.record(batch)
 
-            if (datetime.timestamp(datetime.now()) - timestamp > 60): ## upload mobiles nodes location every minute
-                ## uplaod loc to dashboard
-                data = [{
-                    'variable':'Mobile1',
-                    'value': loc1
-                },{
-                    'variable':'Mobile2',
-                    'value': loc2
-                },{
-                    'variable':'Mobile3',
-                    'value': loc3
-                }]
-                result = my_device.insert(data)
-                timestamp = datetime.timestamp(datetime.now())
-                if result['status']:
-                    print(result['result'])
-                else:
-                    print(result['message'])
-            time.sleep(0.1) 
 
 class Ui_MainWindow(object):
     def setupUi(self, MainWindow):
@@ -253,18 +122,14 @@ class Ui_MainWindow(object):
         self.graphicsView = PlotWidget(self.centralwidget)
         self.graphicsView.setGeometry(QtCore.QRect(10, 10, 551, 441))
         self.graphicsView.setObjectName("graphicsView")
-        self.label1 = QtWidgets.QLabel(self.centralwidget)
-        self.label1.setGeometry(QtCore.QRect(160, 460, 71, 16))
-        self.label1.setObjectName("label1")
-        self.label1.setStyleSheet("background-color:red")
-        self.label2 = QtWidgets.QLabel(self.centralwidget)
-        self.label2.setGeometry(QtCore.QRect(160, 480, 71, 13))
-        self.label2.setObjectName("label2")
-        self.label2.setStyleSheet("background-color:green")
-        self.label3 = QtWidgets.QLabel(self.centralwidget)
-        self.label3.setGeometry(QtCore.QRect(160, 500, 71, 13))
-        self.label3.setObjectName("label3")
-        self.label3.setStyleSheet("background-color:blue")
+        ## A room label per mobile, coloured like its point on the plot
+        self.labels = {}
+        for i, tag in enumerate(sorted(MOBILE_NODES.values())):
+            label = QtWidgets.QLabel(self.centralwidget)
+            label.setGeometry(QtCore.QRect(160, 460 + 20 * i, 71, 16))
+            label.setObjectName("label%d" % tag)
+            label.setStyleSheet("background-color:%s" % TAG_COLOURS[i % 3])
+            self.labels[tag] = label
         self.listWidget = QtWidgets.QListWidget(self.centralwidget)
         self.listWidget.setGeometry(QtCore.QRect(620, 10, 141, 441))
         self.listWidget.setObjectName("listWidget")
@@ -281,66 +146,74 @@ class Ui_MainWindow(object):
         QtCore.QMetaObject.connectSlotsByName(MainWindow)
         
         loop = asyncio.get_event_loop()
-        self.thread1 = RSSI(loop)
-        self.thread = Worker()
-        self.thread1.work()
+        if UART_PORT:
+            self.ingest = ingest.UartIngest(on_sample, UART_PORT,
+                                           UART_SOURCES)
+        else:
+            self.ingest = ingest.BleIngest(on_sample, MOBILE_NODES)
+        if UPLOAD_URL:
+            device = uploader.HttpDevice(UPLOAD_URL, MY_DEVICE_TOKEN)
+        else:
+            device = tago.Device(MY_DEVICE_TOKEN)
+        self.upload = uploader.Uploader(device)
+        self.thread = Worker(samples, self.upload)
+        self.ingest.start(loop)
+        self.upload.start()
         self.thread.start()
-        self.thread.signal.connect(self.gui_update)
+
+        ## Redraw at UI_RATE_HZ from the solver's latest locations
+        self.drawn = None
+        self.monitor = pipeline.Monitor(samples, self.thread.stats)
+        self.stats_time = time.monotonic()
+        self.timer = QtCore.QTimer(MainWindow)
+        self.timer.timeout.connect(self.render)
+        self.timer.start(int(1000 / UI_RATE_HZ))
 
     def retranslateUi(self, MainWindow):
         _translate = QtCore.QCoreApplication.translate
         MainWindow.setWindowTitle(_translate("MainWindow", "MainWindow"))
-        self.label1.setText(_translate("MainWindow", "TextLabel"))
-        self.label2.setText(_translate("MainWindow", "TextLabel"))
-        self.label3.setText(_translate("MainWindow", "TextLabel"))
+        for label in self.labels.values():
+            label.setText(_translate("MainWindow", "TextLabel"))
         
+    def render(self):
+        locations = self.thread.locations
+        if locations is not self.drawn and locations:
+            self.drawn = locations
+            num_tags = max(MOBILE_NODES.values())
+            loc = [[0] * num_tags, [0] * num_tags]
+            for tag, (x, y) in locations.items():
+                loc[0][tag - 1] = int(x)
+                loc[1][tag - 1] = int(y)
+            self.gui_update(loc)
+        if time.monotonic() - self.stats_time >= STATS_PERIOD:
+            self.stats_time = time.monotonic()
+            self.statusbar.showMessage("%s %s  %s  %s" % (
+                self.ingest.name, self.ingest.counter.summary(),
+                self.monitor.report(), self.upload.summary()))
+
     def gui_update(self, result):
         x_data = result[0]
         y_data = result[1]
         
         scatter = pg.ScatterPlotItem(x_data, y_data,
-            size=10, brush=[pg.mkBrush(c) for c in "rgb"])
+            size=10, brush=[pg.mkBrush(TAG_COLOURS[i % 3][0])
+                            for i in range(len(x_data))])
         self.graphicsView.clear()
         self.graphicsView.addItem(scatter)
         self.graphicsView.setXRange(0,18, padding=0)
         self.graphicsView.setYRange(0,12, padding=0)
-        # coordinates = [x_data,y_data]
-        coordinates = [[int(i[0]) for i in result],[int(i[1]) for i in result],[int(i[2]) for i in result]]
         ## Room display
-        count = 0
-        while count < 3:
-            if coordinates[count][0] > 3 and coordinates[count][0] < 7 and coordinates[count][1] > 7 and coordinates[count][1] < 11:
-                if count == 0:
-                    self.label1.setText('Room1')
-                elif count == 1:
-                    self.label2.setText('Room1')
-                elif count == 2:
-                    self.label3.setText('Room1')  
-            elif coordinates[count][0] > 12 and coordinates[count][0] < 18.4 and coordinates[count][1] > 7 and coordinates[count][1] < 11:
-                if count == 0:
-                    self.label1.setText('Room2')
-                elif count == 1:
-                    self.label2.setText('Room2')
-                elif count == 2:
-                    self.label3.setText('Room2')
-            elif coordinates[count][1] > 11:
-                if count == 0:
-                    self.label1.setText('Corridor')
-                elif count == 1:
-                    self.label2.setText('Corridor')
-                elif count == 2:
-                    self.label3.setText('Corridor')
-            else:
-                if count == 0:
-                    self.label1.setText('Open space')
-                elif count == 1:
-                    self.label2.setText('Open space')
-                elif count == 2:
-                    self.label3.setText('Open space')
-            count += 1     
-                    
+        for tag in sorted(self.labels):
+            if tag - 1 < len(x_data):
+                self.labels[tag].setText(room_name(x_data[tag - 1],
+                                                   y_data[tag - 1]))
+
 if __name__ == "__main__":
     import sys
+    if "--uart" in sys.argv:
+        UART_PORT = sys.argv[sys.argv.index("--uart") + 1]
+    if "--upload-url" in sys.argv:
+        UPLOAD_URL = sys.argv[sys.argv.index("--upload-url") + 1]
     app = QtWidgets.QApplication(sys.argv)
     loop = QEventLoop(app)
     MainWindow = QtWidgets.QMainWindow()
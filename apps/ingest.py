@@ -0,0 +1,136 @@
+## Mobile report ingest for the host - either continuous BLE scanning with
+## duplicate filtering off, or the base node's UART frame stream
+## (uart_frames.py). Both call on_sample(tag, rssi, us, age_ms) once for
+## every new mobile report and count the frames they see, so the achieved
+## frames/second can be measured.
+
+import asyncio
+import threading
+import time
+
+import payload
+import uart_frames
+
+
+class FrameCounter:
+    """Frames seen, and the frames/second between rate() calls"""
+
+    def __init__(self):
+        self.frames = 0         ## New mobile reports
+        self.repeats = 0        ## Re-advertised reports already seen
+        self.errors = 0         ## Frames that failed to decode
+        self._last = (time.monotonic(), 0)
+
+    def rate(self):
+        now = time.monotonic()
+        last_time, last_frames = self._last
+        self._last = (now, self.frames)
+        return (self.frames - last_frames) / max(now - last_time, 1e-9)
+
+    def summary(self):
+        return "%.0f frames/s (%d repeats, %d errors)" % (
+            self.rate(), self.repeats, self.errors)
+
+
+class BleIngest:
+    """Scans without stopping, so no advertisement is lost to a restart.
+    nodes maps mobile addresses to tag numbers. A mobile advertises each
+    report until the next one, so repeats of a tag's last sequence number
+    are counted but not passed on."""
+
+    name = "ble"
+
+    def __init__(self, on_sample, nodes):
+        self.on_sample = on_sample
+        self.nodes = nodes
+        self.counter = FrameCounter()
+        self._seq = {}
+        self._stop = None
+
+    def _detected(self, device, advertisement_data):
+        tag = self.nodes.get(device.address)
+        data = payload.find_payload(advertisement_data.service_data)
+        if tag is None or data is None:
+            return
+        try:
+            seq, rssi, us = payload.decode_mobile(data)
+            _, age = payload.decode_mobile_timing(data)
+        except ValueError:
+            self.counter.errors += 1
+            return
+        if self._seq.get(tag) == seq:
+            self.counter.repeats += 1
+            return
+        self._seq[tag] = seq
+        self.counter.frames += 1
+        self.on_sample(tag, rssi, us, age)
+
+    def _scanner(self):
+        from bleak import BleakScanner
+        ## DuplicateData in BlueZ's discovery filter reports every
+        ## advertisement, other backends already do. bleak 0.19 and later
+        ## take it as bluez=, older versions as filters=.
+        filters = {"DuplicateData": True}
+        return BleakScanner(detection_callback=self._detected,
+                            bluez={"filters": filters}, filters=filters)
+
+    async def run(self):
+        self._stop = asyncio.Event()
+        scanner = self._scanner()
+        await scanner.start()
+        try:
+            await self._stop.wait()
+        finally:
+            await scanner.stop()
+
+    def start(self, loop):
+        asyncio.ensure_future(self.run(), loop=loop)
+
+    def stop(self):
+        if self._stop is not None:
+            self._stop.set()
+
+
+class UartIngest:
+    """Reads the base node's binary UART output on its own thread. sources
+    maps the base's mobile source numbers to tag numbers, records from other
+    sources are not passed on."""
+
+    name = "uart"
+
+    def __init__(self, on_sample, port, sources, baud=115200):
+        self.on_sample = on_sample
+        self.port = port
+        self.sources = sources
+        self.baud = baud
+        self.counter = FrameCounter()
+        self._decoder = uart_frames.FrameDecoder()
+        self._running = False
+        self._thread = None
+
+    def feed(self, data):
+        """Decode raw bytes from the base node, passing on mobile records"""
+        for record in self._decoder.feed(data):
+            if record["type"] != "mobile":
+                continue
+            tag = self.sources.get(record["source"])
+            if tag is None:
+                continue
+            self.counter.frames += 1
+            self.on_sample(tag, record["rssi"], record["ultrasonic"],
+                           record["age_ms"])
+        self.counter.errors = self._decoder.errors
+
+    def _run(self):
+        import serial
+        with serial.Serial(self.port, self.baud, timeout=0.1) as port:
+            while self._running:
+                self.feed(port.read(max(1, port.in_waiting)))
+
+    def start(self, loop=None):
+        self._running = True
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._running = False
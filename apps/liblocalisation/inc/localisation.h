@@ -0,0 +1,170 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/inc/localisation.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Host side localisation engine - KNN fingerprinting,
+ *                  multilateration and ultrasonic ranges fused by Kalman
+ *                  tracking of many tags. All memory is allocated when an
+ *                  index or engine is created, never per call.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_knnCreate()          - Build a fingerprint index from a training set
+ * loc_knnDestroy()         - Free a fingerprint index
+ * loc_knnSetSearch()       - Choose the metric and search of an index
+ * loc_knnKernel()          - Instruction set of the SIMD distance kernel
+ * loc_knnPredict()         - Locate an RSSI vector from its nearest prints
+ * loc_knnSave()            - Save an index to a fingerprint file
+ * loc_knnOpen()            - Map a fingerprint file as an index
+ * loc_knnAnchors()         - Anchor locations stored with an index
+ * loc_knnPathLoss()        - Anchor path loss models stored with an index
+ * loc_rssiToDistance()     - Log distance path loss model
+ * loc_pathLossFit()        - Fit each anchor's path loss to a training set
+ * loc_multilaterate()      - Locate a point from distances to anchors
+ * loc_trackReset()         - Forget a track
+ * loc_trackPredict()       - Advance a track by one step
+ * loc_trackUpdate()        - Correct a track with an observation
+ * loc_configDefault()      - Default engine configuration
+ * loc_engineCreate()       - Create an engine for up to N tags
+ * loc_engineDestroy()      - Free an engine
+ * loc_engineSetRangers()   - Place the ultrasonic rangers on the floor plan
+ * loc_engineUpdate()       - Feed a tag's RSSI vector, get its location
+ * loc_engineUpdateRanged() - Feed a tag's RSSI vector and ultrasonic ranges
+ * loc_engineUpdateBatch()  - Feed many tags' RSSI vectors in one call
+ ******************************************************************************
+ */
+
+#ifndef LOCALISATION_H
+#define LOCALISATION_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOC_MAX_ANCHORS         16
+#define LOC_MAX_K               16
+#define LOC_MAX_RANGERS         4
+
+// RSSI of an anchor that was not heard (matches the payload codec)
+#define LOC_RSSI_NONE           -128
+
+// Fingerprint file format version, bumped on any layout change
+#define LOC_FILE_VERSION        2
+
+// Uncalibrated path loss model, for anchors without a fitted one
+#define LOC_PATHLOSS_P0         -72.0f
+#define LOC_PATHLOSS_N          2.0f
+
+// A point (or label) on the floor plan, metres
+typedef struct {
+    float   x;
+    float   y;
+} LocPoint;
+
+// Log distance path loss model of an anchor, RSSI = p0 - 10 n log10(d)
+typedef struct {
+    float   p0;                     // RSSI at 1 m (dBm)
+    float   pathLossN;              // Path loss exponent
+} LocPathLoss;
+
+// Fingerprint index, opaque
+typedef struct LocKnn LocKnn;
+
+// Distance between RSSI vectors
+typedef enum {
+    LOC_KNN_L2 = 0,                 // Euclidean (as scikit-learn)
+    LOC_KNN_L1 = 1,                 // Manhattan
+} LocKnnMetric;
+
+// How a query searches the index, all find the same neighbours
+typedef enum {
+    LOC_KNN_SCALAR = 0,             // Every print, one at a time
+    LOC_KNN_SCAN = 1,               // Every print, SIMD blocks
+    LOC_KNN_TREE = 2,               // Prune box tree nodes, SIMD blocks
+} LocKnnSearch;
+
+// Multilateration solver
+typedef enum {
+    LOC_MULTILAT_NELDER_MEAD = 0,   // Simplex search (as scipy)
+    LOC_MULTILAT_LINEAR = 1,        // Closed form least squares
+    LOC_MULTILAT_GAUSS_NEWTON = 2,  // Closed form, refined by Gauss-Newton
+} LocMultilatMethod;
+
+// Constant velocity track, the covariance (P00, P01, P11) is shared by both
+// axes. Positions in metres, velocities in metres per step.
+typedef struct {
+    LocPoint    pos;
+    LocPoint    vel;
+    float       cov[3];
+    uint8_t     valid;              // 0 until the first observation
+} LocTrack;
+
+// Ultrasonic ranger, ranges the nearest thing along its beam
+typedef struct {
+    LocPoint    pos;                // Sensor location
+    LocPoint    dir;                // Beam direction, unit vector
+    float       maxRange;           // Longest range trusted (m)
+} LocRanger;
+
+// Engine, opaque
+typedef struct LocEngine LocEngine;
+
+// Engine configuration
+typedef struct {
+    uint8_t     k;                  // Neighbours voting in KNN
+    uint8_t     multilatAnchors;    // Strongest anchors used to multilaterate
+    uint8_t     multilatMethod;     // LocMultilatMethod
+    uint8_t     multilatWeighted;   // Weight anchors by 1 / distance^2
+    float       p0;                 // RSSI at 1 m (dBm), uncalibrated
+    float       pathLossN;          // Path loss exponent, uncalibrated
+    float       kalmanQ;            // Process noise (m^2 per sample)
+    float       knnR;               // KNN observation noise (m^2)
+    float       multilatR;          // Multilateration observation noise (m^2)
+    float       rangerR;            // Ranger observation noise floor (m^2)
+    float       rangerSpread;       // Beam spread (m across per m of range)
+    float       rangerGate;         // Ranges further from the track than
+                                    // this many squared sigmas are ignored
+} LocConfig;
+
+// Function prototypes - more detailed top comments in source files
+LocKnn* loc_knnCreate(const int8_t*, const LocPoint*, uint32_t, uint8_t);
+void loc_knnDestroy(LocKnn*);
+int loc_knnSetSearch(LocKnn*, LocKnnMetric, LocKnnSearch);
+const char* loc_knnKernel(void);
+int loc_knnPredict(const LocKnn*, const int8_t*, uint8_t, LocPoint*);
+
+int loc_knnSave(const LocKnn*, const LocPoint*, const LocPathLoss*, uint8_t,
+        const char*);
+LocKnn* loc_knnOpen(const char*);
+uint8_t loc_knnAnchors(const LocKnn*, LocPoint*);
+uint8_t loc_knnPathLoss(const LocKnn*, LocPathLoss*);
+
+float loc_rssiToDistance(int8_t, float, float);
+int loc_pathLossFit(const int8_t*, const LocPoint*, uint32_t, const LocPoint*,
+        uint8_t, LocPathLoss*);
+int loc_multilaterate(const LocPoint*, const float*, const float*, uint8_t,
+        LocMultilatMethod, LocPoint*);
+
+void loc_trackReset(LocTrack*);
+void loc_trackPredict(LocTrack*, float);
+int loc_trackUpdate(LocTrack*, const LocPoint*, float);
+
+void loc_configDefault(LocConfig*);
+LocEngine* loc_engineCreate(const LocKnn*, const LocPoint*, const LocPathLoss*,
+        uint8_t, uint32_t, const LocConfig*);
+void loc_engineDestroy(LocEngine*);
+int loc_engineSetRangers(LocEngine*, const LocRanger*, uint8_t);
+int loc_engineUpdate(LocEngine*, uint32_t, const int8_t*, LocPoint*);
+int loc_engineUpdateRanged(LocEngine*, uint32_t, const int8_t*, const float*,
+        LocPoint*);
+int loc_engineUpdateBatch(LocEngine*, const uint32_t*, const int8_t*,
+        const float*, uint32_t, LocPoint*, int*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOCALISATION_H
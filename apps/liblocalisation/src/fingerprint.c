@@ -0,0 +1,452 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/fingerprint.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Fingerprint files - a built KNN index saved as is, so it
+ *                  can be memory mapped read only and queried in place. Every
+ *                  process opening the same file shares its pages.
+ *
+ *                  Layout (little endian, sections 64 byte aligned):
+ *                      header      FileHeader below
+ *                      anchors     numAnchors LocPoint (x, y float)
+ *                      pathLoss    numAnchors LocPathLoss (p0, n float) if
+ *                                  calibrated, else empty
+ *                      rssi        dims columns of stride int8 RSSI values
+ *                      index       rows uint32 training set row numbers
+ *                      labels      rows LocPoint
+ *                      nodes       numNodes 48 byte box tree nodes
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_knnSave()            - Save an index to a fingerprint file
+ * loc_knnOpen()            - Map a fingerprint file as an index
+ * loc_knnAnchors()         - Anchor locations stored with an index
+ * loc_knnPathLoss()        - Anchor path loss models stored with an index
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <localisation.h>
+
+#include "knn_kernel.h"
+#include "knn_index.h"
+
+#define FILE_MAGIC          "LOCF"
+#define FILE_ALIGN          64
+
+// File header, 64 bytes
+typedef struct {
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    headerSize;
+    uint32_t    rows;
+    uint32_t    stride;
+    uint32_t    numNodes;
+    uint8_t     dims;
+    uint8_t     numAnchors;
+    uint8_t     block;              // KNN_BLOCK the tree was built for
+    uint8_t     calibrated;         // Whether the pathLoss section is present
+    uint32_t    anchorsOffset;
+    uint32_t    rssiOffset;
+    uint32_t    indexOffset;
+    uint32_t    labelsOffset;
+    uint32_t    nodesOffset;
+    uint32_t    fileSize;
+    uint32_t    pathLossOffset;
+    uint8_t     reserved[12];
+} FileHeader;
+
+/**
+ * @brief   Whether this host is little endian, as files are
+ * @retval  1 if it is, else 0
+ */
+static uint8_t file_littleEndian(void) {
+
+    uint16_t probe = 1;
+
+    return *(uint8_t*)&probe == 1;
+}
+
+/**
+ * @brief   Round a file offset up to the section alignment
+ * @param   offset:     Offset
+ * @retval  Aligned offset
+ */
+static uint64_t file_align(uint64_t offset) {
+
+    return (offset + FILE_ALIGN - 1) & ~(uint64_t)(FILE_ALIGN - 1);
+}
+
+/**
+ * @brief   Write a section, padding the file up to its offset first
+ * @param   file:       File
+ * @param   offset:     Section offset
+ * @param   data:       Section data
+ * @param   size:       Section size
+ * @retval  0 if successful, -EIO if the write failed
+ */
+static int file_writeSection(FILE* file, uint32_t offset, const void* data,
+        size_t size) {
+
+    static const uint8_t zero[FILE_ALIGN] = {0};
+    long pos = ftell(file);
+
+    if (pos < 0 || (uint32_t)pos > offset ||
+            fwrite(zero, 1, offset - pos, file) != offset - (uint32_t)pos ||
+            fwrite(data, 1, size, file) != size) {
+
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief   Save an index to a fingerprint file
+ * @param   knn:        Index
+ * @param   anchors:    Anchor locations, in RSSI vector order (can be NULL)
+ * @param   pathLoss:   Path loss model of each anchor (can be NULL)
+ * @param   numAnchors: Number of anchors, 0 or the index's anchors per vector
+ * @param   path:       File to write
+ * @retval  0 if successful, -EINVAL for bad arguments, -EFBIG if the index is
+ *          too large for the format, -EIO if the file could not be written
+ */
+int loc_knnSave(const LocKnn* knn, const LocPoint* anchors,
+        const LocPathLoss* pathLoss, uint8_t numAnchors, const char* path) {
+
+    FileHeader header = {0};
+    uint64_t offset;
+
+    if (knn == NULL || path == NULL || (numAnchors != 0 &&
+            (anchors == NULL || numAnchors != knn->dims)) ||
+            (pathLoss != NULL && numAnchors == 0)) {
+
+        return -EINVAL;
+    }
+
+    if (!file_littleEndian()) {
+
+        return -EINVAL;
+    }
+
+    memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+    header.version = LOC_FILE_VERSION;
+    header.headerSize = sizeof(FileHeader);
+    header.rows = knn->rows;
+    header.stride = knn->stride;
+    header.numNodes = knn->numNodes;
+    header.dims = knn->dims;
+    header.numAnchors = numAnchors;
+    header.block = KNN_BLOCK;
+    header.calibrated = pathLoss != NULL;
+
+    offset = file_align(sizeof(FileHeader));
+    header.anchorsOffset = offset;
+    offset = file_align(offset + numAnchors * sizeof(LocPoint));
+    header.pathLossOffset = offset;
+    offset = file_align(offset +
+            header.calibrated * numAnchors * sizeof(LocPathLoss));
+    header.rssiOffset = offset;
+    offset = file_align(offset + (uint64_t)knn->stride * knn->dims);
+    header.indexOffset = offset;
+    offset = file_align(offset + (uint64_t)knn->rows * sizeof(uint32_t));
+    header.labelsOffset = offset;
+    offset = file_align(offset + (uint64_t)knn->rows * sizeof(LocPoint));
+    header.nodesOffset = offset;
+    offset += (uint64_t)knn->numNodes * sizeof(KnnNode);
+
+    if (offset > UINT32_MAX) {
+
+        return -EFBIG;
+    }
+    header.fileSize = offset;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+
+        return -EIO;
+    }
+
+    int err = 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            file_writeSection(file, header.anchorsOffset, anchors,
+            numAnchors * sizeof(LocPoint)) < 0 ||
+            file_writeSection(file, header.pathLossOffset, pathLoss,
+            header.calibrated * numAnchors * sizeof(LocPathLoss)) < 0 ||
+            file_writeSection(file, header.rssiOffset, knn->rssi,
+            (size_t)knn->stride * knn->dims) < 0 ||
+            file_writeSection(file, header.indexOffset, knn->index,
+            (size_t)knn->rows * sizeof(uint32_t)) < 0 ||
+            file_writeSection(file, header.labelsOffset, knn->labels,
+            (size_t)knn->rows * sizeof(LocPoint)) < 0 ||
+            file_writeSection(file, header.nodesOffset, knn->nodes,
+            (size_t)knn->numNodes * sizeof(KnnNode)) < 0) {
+
+        err = -EIO;
+    }
+
+    if (fclose(file) != 0) {
+
+        err = -EIO;
+    }
+
+    return err;
+}
+
+/**
+ * @brief   Map a whole file read only
+ * @param   path:   File
+ * @param   size:   Size of the file
+ * @retval  Mapping, or NULL if the file could not be mapped
+ */
+static void* file_map(const char* path, size_t* size) {
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER fileSize;
+    void* map = NULL;
+
+    if (file == INVALID_HANDLE_VALUE) {
+
+        return NULL;
+    }
+
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 &&
+            (uint64_t)fileSize.QuadPart <= SIZE_MAX) {
+
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0,
+                NULL);
+        if (mapping != NULL) {
+
+            map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)fileSize.QuadPart;
+    }
+
+    CloseHandle(file);
+    return map;
+#else
+    struct stat info;
+    void* map = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+
+        return NULL;
+    }
+
+    if (fstat(fd, &info) == 0 && info.st_size > 0 &&
+            (uint64_t)info.st_size <= SIZE_MAX) {
+
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        map = map == MAP_FAILED ? NULL : map;
+        *size = info.st_size;
+    }
+
+    close(fd);
+    return map;
+#endif
+}
+
+/**
+ * @brief   Unmap a fingerprint file
+ * @param   map:    Mapping
+ * @param   size:   Size of the mapping
+ */
+void knn_fileUnmap(void* map, size_t size) {
+
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(map);
+#else
+    munmap(map, size);
+#endif
+}
+
+/**
+ * @brief   Check a fingerprint file's header and tree fit the file
+ * @param   header:     Header
+ * @param   nodes:      Box tree nodes
+ * @param   size:       Size of the file
+ * @retval  1 if the file is usable, else 0
+ */
+static uint8_t file_valid(const FileHeader* header, const KnnNode* nodes,
+        size_t size) {
+
+    const uint64_t sections[][2] = {
+        {header->anchorsOffset, header->numAnchors * sizeof(LocPoint)},
+        {header->pathLossOffset,
+                header->calibrated * header->numAnchors * sizeof(LocPathLoss)},
+        {header->rssiOffset, (uint64_t)header->stride * header->dims},
+        {header->indexOffset, (uint64_t)header->rows * sizeof(uint32_t)},
+        {header->labelsOffset, (uint64_t)header->rows * sizeof(LocPoint)},
+        {header->nodesOffset, (uint64_t)header->numNodes * sizeof(KnnNode)},
+    };
+
+    if (header->headerSize != sizeof(FileHeader) ||
+            header->block != KNN_BLOCK || header->rows == 0 ||
+            header->dims == 0 || header->dims > LOC_MAX_ANCHORS ||
+            (header->numAnchors != 0 &&
+            header->numAnchors != header->dims) ||
+            header->calibrated > 1 ||
+            (header->calibrated && header->numAnchors == 0) ||
+            header->stride % KNN_BLOCK != 0 ||
+            header->stride < header->rows || header->numNodes == 0 ||
+            header->fileSize != size) {
+
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+
+        if (sections[i][0] % FILE_ALIGN != 0 ||
+                sections[i][0] + sections[i][1] > size) {
+
+            return 0;
+        }
+    }
+
+    // Searches trust the tree, so make sure it stays inside the prints
+    for (uint32_t n = 0; n < header->numNodes; n++) {
+
+        const KnnNode* node = &nodes[n];
+        if (node->start % KNN_BLOCK != 0 || node->start > header->rows ||
+                node->count == 0 || node->count > header->rows - node->start ||
+                (node->child[0] == KNN_NO_CHILD) !=
+                (node->child[1] == KNN_NO_CHILD) ||
+                (node->child[0] != KNN_NO_CHILD &&
+                (node->child[0] <= n || node->child[1] <= n ||
+                node->child[0] >= header->numNodes ||
+                node->child[1] >= header->numNodes))) {
+
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief   Map a fingerprint file as an index, read only. The file must not
+ *          change while it is open.
+ * @param   path:   File
+ * @retval  Index (free with loc_knnDestroy()), or NULL if the file could not
+ *          be mapped, is not a fingerprint file of this version, or was
+ *          saved by a build with a different block size
+ */
+LocKnn* loc_knnOpen(const char* path) {
+
+    size_t size = 0;
+
+    if (path == NULL || !file_littleEndian()) {
+
+        return NULL;
+    }
+
+    uint8_t* map = file_map(path, &size);
+    if (map == NULL) {
+
+        return NULL;
+    }
+
+    const FileHeader* header = (const FileHeader*)map;
+    if (size < sizeof(FileHeader) ||
+            memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != LOC_FILE_VERSION ||
+            header->nodesOffset > size ||
+            !file_valid(header, (const KnnNode*)&map[header->nodesOffset],
+            size)) {
+
+        knn_fileUnmap(map, size);
+        return NULL;
+    }
+
+    LocKnn* knn = calloc(1, sizeof(LocKnn));
+    if (knn == NULL) {
+
+        knn_fileUnmap(map, size);
+        return NULL;
+    }
+
+    knn->rows = header->rows;
+    knn->stride = header->stride;
+    knn->dims = header->dims;
+    knn->metric = LOC_KNN_L2;
+    knn->search = LOC_KNN_TREE;
+    knn->rssi = (const int8_t*)&map[header->rssiOffset];
+    knn->index = (const uint32_t*)&map[header->indexOffset];
+    knn->labels = (const LocPoint*)&map[header->labelsOffset];
+    knn->nodes = (const KnnNode*)&map[header->nodesOffset];
+    knn->numNodes = header->numNodes;
+    knn->numAnchors = header->numAnchors;
+    memcpy(knn->anchors, &map[header->anchorsOffset],
+            header->numAnchors * sizeof(LocPoint));
+    knn->calibrated = header->calibrated;
+    memcpy(knn->pathLoss, &map[header->pathLossOffset],
+            header->calibrated * header->numAnchors * sizeof(LocPathLoss));
+    knn->map = map;
+    knn->mapSize = size;
+
+    return knn;
+}
+
+/**
+ * @brief   Anchor locations stored with an index (from a fingerprint file)
+ * @param   knn:        Index
+ * @param   anchors:    Anchor locations, LOC_MAX_ANCHORS long (can be NULL)
+ * @retval  Number of anchors, 0 if they are not known
+ */
+uint8_t loc_knnAnchors(const LocKnn* knn, LocPoint* anchors) {
+
+    if (knn == NULL) {
+
+        return 0;
+    }
+
+    if (anchors != NULL) {
+
+        memcpy(anchors, knn->anchors, knn->numAnchors * sizeof(LocPoint));
+    }
+
+    return knn->numAnchors;
+}
+
+/**
+ * @brief   Anchor path loss models stored with an index (from a fingerprint
+ *          file)
+ * @param   knn:        Index
+ * @param   pathLoss:   Path loss models, LOC_MAX_ANCHORS long (can be NULL)
+ * @retval  Number of anchors, 0 if they are not calibrated
+ */
+uint8_t loc_knnPathLoss(const LocKnn* knn, LocPathLoss* pathLoss) {
+
+    if (knn == NULL || !knn->calibrated) {
+
+        return 0;
+    }
+
+    if (pathLoss != NULL) {
+
+        memcpy(pathLoss, knn->pathLoss,
+                knn->numAnchors * sizeof(LocPathLoss));
+    }
+
+    return knn->numAnchors;
+}
@@ -0,0 +1,114 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/kalman.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Recursive constant velocity Kalman tracking of a location.
+ *                  The x and y axes are independent 2 state (position,
+ *                  velocity) filters. Every observation updates both axes
+ *                  with the same noise, so they share one covariance and each
+ *                  step is O(1).
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_trackReset()         - Forget a track
+ * loc_trackPredict()       - Advance a track by one step
+ * loc_trackUpdate()        - Correct a track with an observation
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include <localisation.h>
+
+// Initial velocity variance, large as we know nothing about it yet
+#define KALMAN_V0           100.0f
+
+/**
+ * @brief   Forget a track, the next observation starts it again
+ * @param   track:      Track
+ */
+void loc_trackReset(LocTrack* track) {
+
+    track->pos.x = 0;
+    track->pos.y = 0;
+    track->vel.x = 0;
+    track->vel.y = 0;
+    track->cov[0] = 0;
+    track->cov[1] = 0;
+    track->cov[2] = 0;
+    track->valid = 0;
+}
+
+/**
+ * @brief   Advance a track by one step, F = [1 1; 0 1] with discrete white
+ *          noise acceleration. Does nothing to a track not yet started.
+ * @param   track:      Track
+ * @param   q:          Process noise (m^2 per step)
+ */
+void loc_trackPredict(LocTrack* track, float q) {
+
+    if (!track->valid) {
+
+        return;
+    }
+
+    float* p = track->cov;
+
+    track->pos.x += track->vel.x;
+    track->pos.y += track->vel.y;
+
+    p[0] += 2 * p[1] + p[2] + q / 4;
+    p[1] += p[2] + q / 2;
+    p[2] += q;
+}
+
+/**
+ * @brief   Correct a track with a location observation, H = [1 0]. The
+ *          first observation starts the track at rest.
+ * @param   track:      Track
+ * @param   obs:        Observed location
+ * @param   r:          Observation noise (m^2)
+ * @retval  0 if successful, -EINVAL for bad arguments
+ */
+int loc_trackUpdate(LocTrack* track, const LocPoint* obs, float r) {
+
+    if (track == NULL || obs == NULL || r <= 0) {
+
+        return -EINVAL;
+    }
+
+    float* p = track->cov;
+
+    if (!track->valid) {
+
+        track->pos = *obs;
+        track->vel.x = 0;
+        track->vel.y = 0;
+        p[0] = r;
+        p[1] = 0;
+        p[2] = KALMAN_V0;
+        track->valid = 1;
+
+        return 0;
+    }
+
+    float s = p[0] + r;
+    float k0 = p[0] / s;
+    float k1 = p[1] / s;
+    float dx = obs->x - track->pos.x;
+    float dy = obs->y - track->pos.y;
+
+    track->pos.x += k0 * dx;
+    track->pos.y += k0 * dy;
+    track->vel.x += k1 * dx;
+    track->vel.y += k1 * dy;
+
+    p[2] -= k1 * p[1];
+    p[1] *= 1 - k0;
+    p[0] *= 1 - k0;
+
+    return 0;
+}
@@ -0,0 +1,508 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/knn.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           KNN fingerprint index. Prints are int8 RSSI vectors stored
+ *                  as columns (one contiguous run per anchor) so a kernel can
+ *                  compare a block of rows per instruction. Rows are ordered
+ *                  by a box tree - each node splits its rows at the median of
+ *                  the widest anchor, and keeps the RSSI range of its rows so
+ *                  a query can skip nodes that cannot hold a better neighbour.
+ *                  Queries keep the k best as they go, so nothing is sorted
+ *                  or allocated per call.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_knnCreate()          - Build a fingerprint index from a training set
+ * loc_knnDestroy()         - Free a fingerprint index
+ * loc_knnSetSearch()       - Choose the metric and search of an index
+ * loc_knnKernel()          - Instruction set of the SIMD distance kernel
+ * loc_knnPredict()         - Locate an RSSI vector from its nearest prints
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <localisation.h>
+
+#include "knn_kernel.h"
+#include "knn_index.h"
+
+// Most rows in a tree leaf, a multiple of KNN_BLOCK
+#define KNN_LEAF_ROWS       64
+
+// Tree builder state
+typedef struct {
+    const int8_t*   rssi;               // Training set, row major
+    uint8_t         dims;
+    uint32_t*       index;              // Training set row of each row
+    KnnNode*        nodes;
+    uint32_t        numNodes;
+    uint32_t        maxNodes;
+    uint32_t*       scratch;
+} KnnBuild;
+
+// k best so far, nearest first, ties going to the earlier training row
+typedef struct {
+    uint8_t     k;
+    uint8_t     count;
+    int32_t     dist[LOC_MAX_K];
+    uint32_t    index[LOC_MAX_K];
+    uint32_t    row[LOC_MAX_K];
+} KnnBest;
+
+/**
+ * @brief   Build the box tree node for a range of rows, ordering them
+ * @param   build:      Builder state
+ * @param   start:      First row
+ * @param   count:      Number of rows
+ * @retval  Node index
+ */
+static uint32_t knn_buildNode(KnnBuild* build, uint32_t start,
+        uint32_t count) {
+
+    uint8_t dims = build->dims;
+    uint32_t* rows = &build->index[start];
+    uint32_t id = build->numNodes++;
+    KnnNode* node = &build->nodes[id];
+
+    node->start = start;
+    node->count = count;
+    node->child[0] = KNN_NO_CHILD;
+    node->child[1] = KNN_NO_CHILD;
+    memset(node->min, INT8_MAX, sizeof(node->min));
+    memset(node->max, INT8_MIN, sizeof(node->max));
+
+    for (uint32_t r = 0; r < count; r++) {
+
+        const int8_t* row = &build->rssi[(size_t)rows[r] * dims];
+        for (uint8_t d = 0; d < dims; d++) {
+
+            node->min[d] = row[d] < node->min[d] ? row[d] : node->min[d];
+            node->max[d] = row[d] > node->max[d] ? row[d] : node->max[d];
+        }
+    }
+
+    // Split the widest anchor, unless the node is small or the rows match
+    uint8_t split = 0;
+    for (uint8_t d = 1; d < dims; d++) {
+
+        if (node->max[d] - node->min[d] > node->max[split] - node->min[split]) {
+
+            split = d;
+        }
+    }
+
+    if (count <= KNN_LEAF_ROWS || node->max[split] == node->min[split] ||
+            build->numNodes + 2 > build->maxNodes) {
+
+        return id;
+    }
+
+    // Counting sort on the split anchor, stable so equal rows stay in order
+    uint32_t offset[UINT8_MAX + 2] = {0};
+    for (uint32_t r = 0; r < count; r++) {
+
+        offset[build->rssi[(size_t)rows[r] * dims + split] - INT8_MIN + 1]++;
+    }
+    for (uint16_t v = 1; v <= UINT8_MAX + 1; v++) {
+
+        offset[v] += offset[v - 1];
+    }
+    for (uint32_t r = 0; r < count; r++) {
+
+        uint8_t v = build->rssi[(size_t)rows[r] * dims + split] - INT8_MIN;
+        build->scratch[offset[v]++] = rows[r];
+    }
+    memcpy(rows, build->scratch, count * sizeof(uint32_t));
+
+    // Median, rounded so both children start on a kernel block
+    uint32_t half = ((count / 2) + KNN_BLOCK - 1) & ~(KNN_BLOCK - 1);
+
+    node->child[0] = knn_buildNode(build, start, half);
+    node->child[1] = knn_buildNode(build, start + half, count - half);
+
+    return id;
+}
+
+/**
+ * @brief   Build a fingerprint index from a training set (copied)
+ * @param   rssi:       RSSI vectors, rows x dims, row major
+ * @param   labels:     Location of each vector
+ * @param   rows:       Number of vectors
+ * @param   dims:       Anchors per vector
+ * @retval  Index, or NULL if the arguments are bad or memory ran out
+ */
+LocKnn* loc_knnCreate(const int8_t* rssi, const LocPoint* labels,
+        uint32_t rows, uint8_t dims) {
+
+    if (rssi == NULL || labels == NULL || rows == 0 || dims == 0 ||
+            dims > LOC_MAX_ANCHORS || rows > INT32_MAX - KNN_BLOCK) {
+
+        return NULL;
+    }
+
+    LocKnn* knn = calloc(1, sizeof(LocKnn));
+    if (knn == NULL) {
+
+        return NULL;
+    }
+
+    // Split nodes leave at least KNN_LEAF_ROWS / 2 - KNN_BLOCK rows a side
+    KnnBuild build = {
+        .rssi = rssi,
+        .dims = dims,
+        .maxNodes = 2 * (rows / (KNN_LEAF_ROWS / 2 - KNN_BLOCK) + 1),
+    };
+
+    uint32_t stride = (rows + KNN_BLOCK - 1) & ~(KNN_BLOCK - 1);
+    int8_t* columns = calloc((size_t)stride * dims, 1);
+    LocPoint* rowLabels = malloc((size_t)rows * sizeof(LocPoint));
+    build.index = malloc((size_t)rows * sizeof(uint32_t));
+    build.nodes = malloc((size_t)build.maxNodes * sizeof(KnnNode));
+    build.scratch = malloc((size_t)rows * sizeof(uint32_t));
+
+    knn->rows = rows;
+    knn->dims = dims;
+    knn->stride = stride;
+    knn->metric = LOC_KNN_L2;
+    knn->search = LOC_KNN_TREE;
+    knn->rssi = columns;
+    knn->index = build.index;
+    knn->labels = rowLabels;
+    knn->nodes = build.nodes;
+
+    if (columns == NULL || rowLabels == NULL || build.index == NULL ||
+            build.nodes == NULL || build.scratch == NULL) {
+
+        free(build.scratch);
+        loc_knnDestroy(knn);
+        return NULL;
+    }
+
+    for (uint32_t r = 0; r < rows; r++) {
+
+        build.index[r] = r;
+    }
+
+    knn_buildNode(&build, 0, rows);
+    knn->numNodes = build.numNodes;
+    free(build.scratch);
+
+    // Copy the prints into columns in tree order
+    for (uint32_t r = 0; r < rows; r++) {
+
+        const int8_t* row = &rssi[(size_t)build.index[r] * dims];
+        for (uint8_t d = 0; d < dims; d++) {
+
+            columns[(size_t)d * stride + r] = row[d];
+        }
+        rowLabels[r] = labels[build.index[r]];
+    }
+
+    return knn;
+}
+
+/**
+ * @brief   Free a fingerprint index, or unmap a fingerprint file
+ * @param   knn:    Index to free (can be NULL)
+ */
+void loc_knnDestroy(LocKnn* knn) {
+
+    if (knn == NULL) {
+
+        return;
+    }
+
+    if (knn->map != NULL) {
+
+        knn_fileUnmap(knn->map, knn->mapSize);
+    } else {
+
+        free((void*)knn->rssi);
+        free((void*)knn->index);
+        free((void*)knn->labels);
+        free((void*)knn->nodes);
+    }
+    free(knn);
+}
+
+/**
+ * @brief   Choose the metric and search of an index. All searches find the
+ *          same neighbours. Not safe while the index is being queried.
+ * @param   knn:        Index
+ * @param   metric:     Distance between RSSI vectors
+ * @param   search:     How queries search the index
+ * @retval  0 if successful, -EINVAL for bad arguments
+ */
+int loc_knnSetSearch(LocKnn* knn, LocKnnMetric metric, LocKnnSearch search) {
+
+    if (knn == NULL || (metric != LOC_KNN_L2 && metric != LOC_KNN_L1) ||
+            (search != LOC_KNN_SCALAR && search != LOC_KNN_SCAN &&
+            search != LOC_KNN_TREE)) {
+
+        return -EINVAL;
+    }
+
+    knn->metric = metric;
+    knn->search = search;
+
+    return 0;
+}
+
+/**
+ * @brief   Instruction set of the SIMD distance kernel, fixed at build time
+ * @retval  "avx2", "sse4.1", "neon" or "scalar"
+ */
+const char* loc_knnKernel(void) {
+
+    return knn_simdName();
+}
+
+/**
+ * @brief   Distance to beat to get into the k best
+ * @param   best:   k best so far
+ * @retval  Distance
+ */
+static int32_t knn_worst(const KnnBest* best) {
+
+    return best->count < best->k ? KNN_DIST_MAX : best->dist[best->k - 1];
+}
+
+/**
+ * @brief   Offer a row to the k best
+ * @param   best:   k best so far
+ * @param   dist:   Distance of the row
+ * @param   index:  Training set row
+ * @param   row:    Index row
+ */
+static void knn_offer(KnnBest* best, int32_t dist, uint32_t index,
+        uint32_t row) {
+
+    if (best->count == best->k && (dist > best->dist[best->k - 1] ||
+            (dist == best->dist[best->k - 1] &&
+            index > best->index[best->k - 1]))) {
+
+        return;
+    }
+
+    uint8_t pos = best->count < best->k ? best->count++ : best->k - 1;
+    while (pos > 0 && (best->dist[pos - 1] > dist ||
+            (best->dist[pos - 1] == dist && best->index[pos - 1] > index))) {
+
+        best->dist[pos] = best->dist[pos - 1];
+        best->index[pos] = best->index[pos - 1];
+        best->row[pos] = best->row[pos - 1];
+        pos--;
+    }
+    best->dist[pos] = dist;
+    best->index[pos] = index;
+    best->row[pos] = row;
+}
+
+/**
+ * @brief   Offer a range of rows to the k best
+ * @param   knn:    Index
+ * @param   query:  Query
+ * @param   kernel: Distance kernel
+ * @param   start:  First row, a multiple of KNN_BLOCK
+ * @param   count:  Number of rows
+ * @param   best:   k best so far
+ */
+static void knn_scan(const LocKnn* knn, const KnnQuery* query,
+        KnnKernel kernel, uint32_t start, uint32_t count, KnnBest* best) {
+
+    int32_t dist[KNN_BLOCK];
+    uint32_t end = start + count;
+
+    for (uint32_t base = start; base < end; base += KNN_BLOCK) {
+
+        int32_t worst = knn_worst(best);
+        if (!kernel(knn->rssi, knn->stride, query, base, knn->metric, worst,
+                dist)) {
+
+            continue;
+        }
+
+        uint32_t lanes = end - base < KNN_BLOCK ? end - base : KNN_BLOCK;
+        for (uint32_t i = 0; i < lanes; i++) {
+
+            if (dist[i] <= worst) {
+
+                knn_offer(best, dist[i], knn->index[base + i], base + i);
+                worst = knn_worst(best);
+            }
+        }
+    }
+}
+
+/**
+ * @brief   Least distance from a query to any row in a node
+ * @param   knn:    Index
+ * @param   query:  Query
+ * @param   node:   Node
+ * @retval  Lower bound on the distance
+ */
+static int32_t knn_bound(const LocKnn* knn, const KnnQuery* query,
+        const KnnNode* node) {
+
+    int32_t bound = 0;
+
+    for (uint8_t i = 0; i < query->numUsed; i++) {
+
+        int32_t q = query->value[i];
+        int32_t lo = node->min[query->used[i]];
+        int32_t hi = node->max[query->used[i]];
+        int32_t gap = q < lo ? lo - q : (q > hi ? q - hi : 0);
+
+        bound += knn->metric == LOC_KNN_L1 ? gap : gap * gap;
+    }
+
+    return bound;
+}
+
+/**
+ * @brief   Search a box tree node, nearer child first, skipping children
+ *          that cannot hold a better neighbour
+ * @param   knn:    Index
+ * @param   query:  Query
+ * @param   id:     Node
+ * @param   best:   k best so far
+ */
+static void knn_searchNode(const LocKnn* knn, const KnnQuery* query,
+        uint32_t id, KnnBest* best) {
+
+    const KnnNode* node = &knn->nodes[id];
+
+    if (node->child[0] == KNN_NO_CHILD) {
+
+        knn_scan(knn, query, knn_blockSimd, node->start, node->count, best);
+        return;
+    }
+
+    int32_t bound[2] = {
+        knn_bound(knn, query, &knn->nodes[node->child[0]]),
+        knn_bound(knn, query, &knn->nodes[node->child[1]]),
+    };
+    uint8_t first = bound[1] < bound[0];
+
+    for (uint8_t i = 0; i < 2; i++) {
+
+        uint8_t c = i ? !first : first;
+        if (bound[c] <= knn_worst(best)) {
+
+            knn_searchNode(knn, query, node->child[c], best);
+        }
+    }
+}
+
+/**
+ * @brief   Most common value among the neighbours' labels on one axis, ties
+ *          going to the smaller value (as scikit-learn's classifier does)
+ * @param   values:     Label values
+ * @param   k:          Number of values
+ * @retval  Winning value
+ */
+static float knn_vote(const float* values, uint8_t k) {
+
+    float best = 0;
+    uint8_t bestCount = 0;
+
+    for (uint8_t i = 0; i < k; i++) {
+
+        uint8_t count = 0;
+        for (uint8_t j = 0; j < k; j++) {
+
+            count += values[j] == values[i];
+        }
+
+        if (count > bestCount || (count == bestCount && values[i] < best)) {
+
+            best = values[i];
+            bestCount = count;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief   Locate an RSSI vector by a vote of its k nearest prints. Anchors
+ *          not heard in the query are left out of the distance.
+ * @param   knn:        Index
+ * @param   query:      RSSI vector (dims long, LOC_RSSI_NONE if not heard)
+ * @param   k:          Neighbours voting (at most LOC_MAX_K)
+ * @param   out:        Location
+ * @retval  0 if successful, -EINVAL for bad arguments, -ENODATA if no anchor
+ *          was heard
+ */
+int loc_knnPredict(const LocKnn* knn, const int8_t* query, uint8_t k,
+        LocPoint* out) {
+
+    KnnQuery q = {0};
+    KnnBest best = {0};
+
+    if (knn == NULL || query == NULL || out == NULL || k == 0 ||
+            k > LOC_MAX_K) {
+
+        return -EINVAL;
+    }
+
+    // Strongest anchors first, they separate prints soonest
+    for (uint8_t d = 0; d < knn->dims; d++) {
+
+        if (query[d] == LOC_RSSI_NONE) {
+
+            continue;
+        }
+
+        uint8_t pos = q.numUsed++;
+        while (pos > 0 && q.value[pos - 1] < query[d]) {
+
+            q.used[pos] = q.used[pos - 1];
+            q.value[pos] = q.value[pos - 1];
+            pos--;
+        }
+        q.used[pos] = d;
+        q.value[pos] = query[d];
+    }
+
+    if (q.numUsed == 0) {
+
+        return -ENODATA;
+    }
+
+    best.k = k > knn->rows ? knn->rows : k;
+
+    switch (knn->search) {
+
+        case LOC_KNN_SCALAR:
+            knn_scan(knn, &q, knn_blockScalar, 0, knn->rows, &best);
+            break;
+
+        case LOC_KNN_SCAN:
+            knn_scan(knn, &q, knn_blockSimd, 0, knn->rows, &best);
+            break;
+
+        default:
+            knn_searchNode(knn, &q, 0, &best);
+            break;
+    }
+
+    float xs[LOC_MAX_K];
+    float ys[LOC_MAX_K];
+    for (uint8_t i = 0; i < best.count; i++) {
+
+        xs[i] = knn->labels[best.row[i]].x;
+        ys[i] = knn->labels[best.row[i]].y;
+    }
+
+    out->x = knn_vote(xs, best.count);
+    out->y = knn_vote(ys, best.count);
+
+    return 0;
+}
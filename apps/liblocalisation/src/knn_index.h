@@ -0,0 +1,54 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/knn_index.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           KNN index layout (internal to the library), shared by the
+ *                  index and the fingerprint file that stores it
+ ******************************************************************************
+ */
+
+#ifndef KNN_INDEX_H
+#define KNN_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <localisation.h>
+
+// Child of a leaf
+#define KNN_NO_CHILD        0
+
+// Box tree node, rows [start, start + count) of the index. Stored as is in
+// fingerprint files, so the layout is fixed (48 bytes, no padding).
+typedef struct {
+    uint32_t    start;
+    uint32_t    count;
+    uint32_t    child[2];               // KNN_NO_CHILD for a leaf
+    int8_t      min[LOC_MAX_ANCHORS];
+    int8_t      max[LOC_MAX_ANCHORS];
+} KnnNode;
+
+struct LocKnn {
+    uint32_t        rows;
+    uint32_t        stride;             // Rows per column, padded
+    uint8_t         dims;
+    LocKnnMetric    metric;
+    LocKnnSearch    search;
+    const int8_t*   rssi;               // dims columns of stride rows
+    const uint32_t* index;              // Training set row of each row
+    const LocPoint* labels;             // Label of each row
+    const KnnNode*  nodes;              // Root first
+    uint32_t        numNodes;
+    uint8_t         numAnchors;         // 0 if the anchors are unknown
+    LocPoint        anchors[LOC_MAX_ANCHORS];
+    uint8_t         calibrated;         // Whether pathLoss is known
+    LocPathLoss     pathLoss[LOC_MAX_ANCHORS];
+    void*           map;                // File mapping, NULL if allocated
+    size_t          mapSize;
+};
+
+// Function prototypes - more detailed top comments in source files
+void knn_fileUnmap(void*, size_t);
+
+#endif // KNN_INDEX_H
@@ -0,0 +1,299 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/knn_kernel.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           KNN distance kernels over column (SoA) int8 prints. Each
+ *                  call handles KNN_BLOCK consecutive rows, one column at a
+ *                  time, and gives up early once every row is further than
+ *                  the current k-th best. The SIMD kernel is AVX2, SSE4.1 or
+ *                  NEON, whichever the compiler targets, else scalar.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * knn_blockScalar()        - Distances of a block of rows, one at a time
+ * knn_blockSimd()          - Distances of a block of rows, vectorised
+ * knn_simdName()           - Instruction set used by knn_blockSimd()
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+
+#include "knn_kernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define KNN_SIMD_NAME           "avx2"
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define KNN_SIMD_NAME           "sse4.1"
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KNN_SIMD_NAME           "neon"
+#else
+#define KNN_SIMD_NAME           "scalar"
+#endif
+
+/**
+ * @brief   Distances of a block of rows, one row at a time
+ * @param   rssi:       Columns of prints
+ * @param   stride:     Rows per column (including padding)
+ * @param   query:      Query
+ * @param   base:       First row of the block
+ * @param   metric:     L1 or L2 (squared)
+ * @param   worst:      Current k-th best distance
+ * @param   dist:       Distance of each row in the block
+ * @retval  0 if every row was further than worst, else 1
+ */
+uint8_t knn_blockScalar(const int8_t* rssi, uint32_t stride,
+        const KnnQuery* query, uint32_t base, LocKnnMetric metric,
+        int32_t worst, int32_t* dist) {
+
+    uint8_t any = 0;
+
+    for (uint8_t r = 0; r < KNN_BLOCK; r++) {
+
+        int32_t sum = 0;
+
+        for (uint8_t i = 0; i < query->numUsed && sum <= worst; i++) {
+
+            int32_t diff = (int32_t)rssi[query->used[i] * stride + base + r] -
+                    query->value[i];
+            sum += metric == LOC_KNN_L1 ? (diff < 0 ? -diff : diff) :
+                    diff * diff;
+        }
+
+        dist[r] = sum;
+        any |= sum <= worst;
+    }
+
+    return any;
+}
+
+#if defined(__AVX2__)
+
+/**
+ * @brief   Distances of a block of rows, 16 rows per AVX2 register. Squares
+ *          fit 16 bits unsigned, and are widened to 32 bit sums in the order
+ *          unpack leaves them (rows 0-3 and 8-11, then 4-7 and 12-15).
+ * @param   rssi:       Columns of prints
+ * @param   stride:     Rows per column (including padding)
+ * @param   query:      Query
+ * @param   base:       First row of the block
+ * @param   metric:     L1 or L2 (squared)
+ * @param   worst:      Current k-th best distance
+ * @param   dist:       Distance of each row in the block
+ * @retval  0 if every row was further than worst, else 1
+ */
+uint8_t knn_blockSimd(const int8_t* rssi, uint32_t stride,
+        const KnnQuery* query, uint32_t base, LocKnnMetric metric,
+        int32_t worst, int32_t* dist) {
+
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero;
+    __m256i hi = zero;
+    __m256i limit = _mm256_set1_epi32(worst);
+
+    for (uint8_t i = 0; i < query->numUsed; i++) {
+
+        const int8_t* col = &rssi[query->used[i] * stride + base];
+        __m256i v = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)col));
+        __m256i d = _mm256_sub_epi16(v, _mm256_set1_epi16(query->value[i]));
+        __m256i e = metric == LOC_KNN_L1 ? _mm256_abs_epi16(d) :
+                _mm256_mullo_epi16(d, d);
+
+        lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(e, zero));
+        hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(e, zero));
+
+        if ((i % KNN_CHECK_DIMS) == KNN_CHECK_DIMS - 1 &&
+                _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(
+                _mm256_cmpgt_epi32(lo, limit),
+                _mm256_cmpgt_epi32(hi, limit)))) == 0xFF) {
+
+            return 0;
+        }
+    }
+
+    _mm256_storeu_si256((__m256i*)dist, _mm256_permute2x128_si256(lo, hi,
+            0x20));
+    _mm256_storeu_si256((__m256i*)&dist[8], _mm256_permute2x128_si256(lo, hi,
+            0x31));
+
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(
+            _mm256_cmpgt_epi32(lo, limit),
+            _mm256_cmpgt_epi32(hi, limit)))) != 0xFF;
+}
+
+#elif defined(__SSE4_1__)
+
+/**
+ * @brief   Whether every lane of four SSE registers is further than limit
+ * @param   acc:    Rows 0 to 15
+ * @param   limit:  Current k-th best distance in every lane
+ * @retval  1 if all rows are further, else 0
+ */
+static uint8_t knn_sseAllOver(const __m128i* acc, __m128i limit) {
+
+    __m128i over = _mm_and_si128(
+            _mm_and_si128(_mm_cmpgt_epi32(acc[0], limit),
+            _mm_cmpgt_epi32(acc[1], limit)),
+            _mm_and_si128(_mm_cmpgt_epi32(acc[2], limit),
+            _mm_cmpgt_epi32(acc[3], limit)));
+
+    return _mm_movemask_ps(_mm_castsi128_ps(over)) == 0xF;
+}
+
+/**
+ * @brief   Distances of a block of rows, 8 rows per SSE register. Squares
+ *          fit 16 bits unsigned, and are widened to 32 bit sums.
+ * @param   rssi:       Columns of prints
+ * @param   stride:     Rows per column (including padding)
+ * @param   query:      Query
+ * @param   base:       First row of the block
+ * @param   metric:     L1 or L2 (squared)
+ * @param   worst:      Current k-th best distance
+ * @param   dist:       Distance of each row in the block
+ * @retval  0 if every row was further than worst, else 1
+ */
+uint8_t knn_blockSimd(const int8_t* rssi, uint32_t stride,
+        const KnnQuery* query, uint32_t base, LocKnnMetric metric,
+        int32_t worst, int32_t* dist) {
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc[4] = {zero, zero, zero, zero};
+    __m128i limit = _mm_set1_epi32(worst);
+
+    for (uint8_t i = 0; i < query->numUsed; i++) {
+
+        const int8_t* col = &rssi[query->used[i] * stride + base];
+        __m128i v = _mm_loadu_si128((const __m128i*)col);
+        __m128i q = _mm_set1_epi16(query->value[i]);
+
+        for (uint8_t h = 0; h < 2; h++) {
+
+            __m128i d = _mm_sub_epi16(_mm_cvtepi8_epi16(h ?
+                    _mm_srli_si128(v, 8) : v), q);
+            __m128i e = metric == LOC_KNN_L1 ? _mm_abs_epi16(d) :
+                    _mm_mullo_epi16(d, d);
+
+            acc[2 * h] = _mm_add_epi32(acc[2 * h], _mm_unpacklo_epi16(e, zero));
+            acc[2 * h + 1] = _mm_add_epi32(acc[2 * h + 1],
+                    _mm_unpackhi_epi16(e, zero));
+        }
+
+        if ((i % KNN_CHECK_DIMS) == KNN_CHECK_DIMS - 1 &&
+                knn_sseAllOver(acc, limit)) {
+
+            return 0;
+        }
+    }
+
+    for (uint8_t j = 0; j < 4; j++) {
+
+        _mm_storeu_si128((__m128i*)&dist[4 * j], acc[j]);
+    }
+
+    return !knn_sseAllOver(acc, limit);
+}
+
+#elif defined(__ARM_NEON)
+
+/**
+ * @brief   Whether every lane of four NEON registers is further than limit
+ * @param   acc:    Rows 0 to 15
+ * @param   limit:  Current k-th best distance in every lane
+ * @retval  1 if all rows are further, else 0
+ */
+static uint8_t knn_neonAllOver(const int32x4_t* acc, int32x4_t limit) {
+
+    uint32x4_t over = vandq_u32(
+            vandq_u32(vcgtq_s32(acc[0], limit), vcgtq_s32(acc[1], limit)),
+            vandq_u32(vcgtq_s32(acc[2], limit), vcgtq_s32(acc[3], limit)));
+    uint32x2_t half = vand_u32(vget_low_u32(over), vget_high_u32(over));
+
+    return (vget_lane_u32(half, 0) & vget_lane_u32(half, 1)) == UINT32_MAX;
+}
+
+/**
+ * @brief   Distances of a block of rows, 16 rows per NEON load
+ * @param   rssi:       Columns of prints
+ * @param   stride:     Rows per column (including padding)
+ * @param   query:      Query
+ * @param   base:       First row of the block
+ * @param   metric:     L1 or L2 (squared)
+ * @param   worst:      Current k-th best distance
+ * @param   dist:       Distance of each row in the block
+ * @retval  0 if every row was further than worst, else 1
+ */
+uint8_t knn_blockSimd(const int8_t* rssi, uint32_t stride,
+        const KnnQuery* query, uint32_t base, LocKnnMetric metric,
+        int32_t worst, int32_t* dist) {
+
+    int32x4_t acc[4] = {vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0),
+            vdupq_n_s32(0)};
+    int32x4_t limit = vdupq_n_s32(worst);
+
+    for (uint8_t i = 0; i < query->numUsed; i++) {
+
+        int8x16_t v = vld1q_s8(&rssi[query->used[i] * stride + base]);
+        int8x8_t q = vdup_n_s8(query->value[i]);
+
+        for (uint8_t h = 0; h < 2; h++) {
+
+            int8x8_t part = h ? vget_high_s8(v) : vget_low_s8(v);
+
+            if (metric == LOC_KNN_L1) {
+
+                uint16x8_t d = vabdl_s8(part, q);
+                acc[2 * h] = vreinterpretq_s32_u32(vaddw_u16(
+                        vreinterpretq_u32_s32(acc[2 * h]), vget_low_u16(d)));
+                acc[2 * h + 1] = vreinterpretq_s32_u32(vaddw_u16(
+                        vreinterpretq_u32_s32(acc[2 * h + 1]),
+                        vget_high_u16(d)));
+            } else {
+
+                int16x8_t d = vsubl_s8(part, q);
+                acc[2 * h] = vmlal_s16(acc[2 * h], vget_low_s16(d),
+                        vget_low_s16(d));
+                acc[2 * h + 1] = vmlal_s16(acc[2 * h + 1], vget_high_s16(d),
+                        vget_high_s16(d));
+            }
+        }
+
+        if ((i % KNN_CHECK_DIMS) == KNN_CHECK_DIMS - 1 &&
+                knn_neonAllOver(acc, limit)) {
+
+            return 0;
+        }
+    }
+
+    for (uint8_t j = 0; j < 4; j++) {
+
+        vst1q_s32(&dist[4 * j], acc[j]);
+    }
+
+    return !knn_neonAllOver(acc, limit);
+}
+
+#else
+
+/**
+ * @brief   No SIMD available, the scalar kernel
+ */
+uint8_t knn_blockSimd(const int8_t* rssi, uint32_t stride,
+        const KnnQuery* query, uint32_t base, LocKnnMetric metric,
+        int32_t worst, int32_t* dist) {
+
+    return knn_blockScalar(rssi, stride, query, base, metric, worst, dist);
+}
+
+#endif
+
+/**
+ * @brief   Instruction set used by knn_blockSimd()
+ * @retval  "avx2", "sse4.1", "neon" or "scalar"
+ */
+const char* knn_simdName(void) {
+
+    return KNN_SIMD_NAME;
+}
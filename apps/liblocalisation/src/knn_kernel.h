@@ -0,0 +1,45 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/knn_kernel.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           KNN distance kernels (internal to the library)
+ ******************************************************************************
+ */
+
+#ifndef KNN_KERNEL_H
+#define KNN_KERNEL_H
+
+#include <stdint.h>
+
+#include <localisation.h>
+
+// Rows per kernel call, columns are padded to a multiple of this
+#define KNN_BLOCK               16
+
+// Dimensions between early termination checks
+#define KNN_CHECK_DIMS          4
+
+// Distance of a row that is not a candidate yet
+#define KNN_DIST_MAX            INT32_MAX
+
+// Query, reduced to the dimensions that were heard
+typedef struct {
+    uint8_t     numUsed;
+    uint8_t     used[LOC_MAX_ANCHORS];      // Column of each used dimension
+    int8_t      value[LOC_MAX_ANCHORS];     // Query RSSI in that column
+} KnnQuery;
+
+// Kernel - distances of KNN_BLOCK rows from base, 0 if they were all
+// further than worst part way through (dist is then incomplete)
+typedef uint8_t (*KnnKernel)(const int8_t*, uint32_t, const KnnQuery*,
+        uint32_t, LocKnnMetric, int32_t, int32_t*);
+
+// Function prototypes - more detailed top comments in source files
+uint8_t knn_blockScalar(const int8_t*, uint32_t, const KnnQuery*, uint32_t,
+        LocKnnMetric, int32_t, int32_t*);
+uint8_t knn_blockSimd(const int8_t*, uint32_t, const KnnQuery*, uint32_t,
+        LocKnnMetric, int32_t, int32_t*);
+const char* knn_simdName(void);
+
+#endif // KNN_KERNEL_H
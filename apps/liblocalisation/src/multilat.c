@@ -0,0 +1,405 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/multilat.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Multilateration - find the point whose distances to the
+ *                  anchors best match the distances estimated from RSSI.
+ *                  Solved either closed form, by subtracting the (weighted)
+ *                  mean range equation to leave a 2x2 linear least squares
+ *                  system, optionally refined by Gauss-Newton on the true
+ *                  range errors, or by the original Nelder-Mead search.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_rssiToDistance()     - Log distance path loss model
+ * loc_multilaterate()      - Locate a point from distances to anchors
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <errno.h>
+
+#include <localisation.h>
+
+// Nelder-Mead parameters (scipy's defaults for 2 dimensions)
+#define NM_MAX_ITER         400
+#define NM_XATOL            1e-4f
+#define NM_FATOL            1e-4f
+#define NM_NONZDELT         0.05f
+#define NM_ZDELT            0.00025f
+
+// Gauss-Newton parameters
+#define GN_MAX_ITER         20
+#define GN_MAX_HALVINGS     8
+#define GN_STEP_TOL         1e-4f
+
+// Relative determinant below which the anchors are taken as collinear
+#define MULTILAT_MIN_DET    1e-6f
+
+/**
+ * @brief   Log distance path loss model
+ * @param   rssi:       Received signal strength (dBm)
+ * @param   p0:         RSSI at 1 m (dBm)
+ * @param   n:          Path loss exponent
+ * @retval  Distance (m)
+ */
+float loc_rssiToDistance(int8_t rssi, float p0, float n) {
+
+    return powf(10.0f, (p0 - rssi) / (10.0f * n));
+}
+
+/**
+ * @brief   Weighted sum of squared range errors of a point
+ * @param   p:          Point
+ * @param   anchors:    Anchor locations
+ * @param   dist:       Estimated distance to each anchor
+ * @param   weight:     Weight of each anchor (NULL for equal weights)
+ * @param   n:          Number of anchors
+ * @retval  Error
+ */
+static float multilat_error(LocPoint p, const LocPoint* anchors,
+        const float* dist, const float* weight, uint8_t n) {
+
+    float error = 0;
+
+    for (uint8_t i = 0; i < n; i++) {
+
+        float e = hypotf(p.x - anchors[i].x, p.y - anchors[i].y) - dist[i];
+        error += (weight != NULL ? weight[i] : 1.0f) * e * e;
+    }
+
+    return error;
+}
+
+/**
+ * @brief   Solve the 2x2 symmetric system [a b; b c] x = v
+ * @param   a:      Top left
+ * @param   b:      Off diagonal
+ * @param   c:      Bottom right
+ * @param   v:      Right hand side
+ * @param   out:    Solution
+ * @retval  0 if successful, -EDOM if the system is (near) singular
+ */
+static int multilat_solve2(float a, float b, float c, LocPoint v,
+        LocPoint* out) {
+
+    float det = a * c - b * b;
+
+    if (!(fabsf(det) > MULTILAT_MIN_DET * (a + c) * (a + c))) {
+
+        return -EDOM;
+    }
+
+    out->x = (c * v.x - b * v.y) / det;
+    out->y = (a * v.y - b * v.x) / det;
+
+    return 0;
+}
+
+/**
+ * @brief   Closed form least squares location. Each range equation is
+ *          |p|^2 - 2 a.p + |a|^2 = d^2, and subtracting their weighted mean
+ *          cancels |p|^2, leaving (a - mean a).p = linear in the data.
+ * @param   anchors:    Anchor locations
+ * @param   dist:       Estimated distance to each anchor
+ * @param   weight:     Weight of each anchor (NULL for equal weights)
+ * @param   n:          Number of anchors
+ * @param   out:        Location
+ * @retval  0 if successful, -EDOM if the anchors are collinear
+ */
+static int multilat_linear(const LocPoint* anchors, const float* dist,
+        const float* weight, uint8_t n, LocPoint* out) {
+
+    float total = 0;
+    LocPoint mean = {0, 0};
+    float meanK = 0;
+    float meanD2 = 0;
+
+    for (uint8_t i = 0; i < n; i++) {
+
+        float w = weight != NULL ? weight[i] : 1.0f;
+        total += w;
+        mean.x += w * anchors[i].x;
+        mean.y += w * anchors[i].y;
+        meanK += w * (anchors[i].x * anchors[i].x +
+                anchors[i].y * anchors[i].y);
+        meanD2 += w * dist[i] * dist[i];
+    }
+
+    if (!(total > 0)) {
+
+        return -EDOM;
+    }
+
+    mean.x /= total;
+    mean.y /= total;
+    meanK /= total;
+    meanD2 /= total;
+
+    // Normal equations of the centred system
+    float a = 0;
+    float b = 0;
+    float c = 0;
+    LocPoint v = {0, 0};
+
+    for (uint8_t i = 0; i < n; i++) {
+
+        float w = weight != NULL ? weight[i] : 1.0f;
+        float ax = anchors[i].x - mean.x;
+        float ay = anchors[i].y - mean.y;
+        float k = anchors[i].x * anchors[i].x + anchors[i].y * anchors[i].y;
+        float rhs = 0.5f * ((k - meanK) - (dist[i] * dist[i] - meanD2));
+
+        a += w * ax * ax;
+        b += w * ax * ay;
+        c += w * ay * ay;
+        v.x += w * ax * rhs;
+        v.y += w * ay * rhs;
+    }
+
+    return multilat_solve2(a, b, c, v, out);
+}
+
+/**
+ * @brief   Gauss-Newton refinement of a location on the (weighted) range
+ *          errors, halving steps that do not reduce the error
+ * @param   anchors:    Anchor locations
+ * @param   dist:       Estimated distance to each anchor
+ * @param   weight:     Weight of each anchor (NULL for equal weights)
+ * @param   n:          Number of anchors
+ * @param   p:          Starting point, refined in place
+ */
+static void multilat_refine(const LocPoint* anchors, const float* dist,
+        const float* weight, uint8_t n, LocPoint* p) {
+
+    float error = multilat_error(*p, anchors, dist, weight, n);
+
+    for (uint8_t iter = 0; iter < GN_MAX_ITER; iter++) {
+
+        float a = 0;
+        float b = 0;
+        float c = 0;
+        LocPoint v = {0, 0};
+        LocPoint step;
+
+        for (uint8_t i = 0; i < n; i++) {
+
+            float dx = p->x - anchors[i].x;
+            float dy = p->y - anchors[i].y;
+            float range = hypotf(dx, dy);
+            if (range < GN_STEP_TOL) {
+
+                continue;
+            }
+
+            float w = weight != NULL ? weight[i] : 1.0f;
+            float jx = dx / range;
+            float jy = dy / range;
+            float r = range - dist[i];
+
+            a += w * jx * jx;
+            b += w * jx * jy;
+            c += w * jy * jy;
+            v.x -= w * jx * r;
+            v.y -= w * jy * r;
+        }
+
+        if (multilat_solve2(a, b, c, v, &step) < 0) {
+
+            return;
+        }
+
+        // Take the step, or the largest half of it that helps
+        uint8_t halvings = 0;
+        LocPoint next = {p->x + step.x, p->y + step.y};
+        float nextError = multilat_error(next, anchors, dist, weight, n);
+
+        while (nextError > error && halvings++ < GN_MAX_HALVINGS) {
+
+            step.x /= 2;
+            step.y /= 2;
+            next.x = p->x + step.x;
+            next.y = p->y + step.y;
+            nextError = multilat_error(next, anchors, dist, weight, n);
+        }
+
+        if (nextError > error) {
+
+            return;
+        }
+
+        *p = next;
+        error = nextError;
+
+        if (hypotf(step.x, step.y) < GN_STEP_TOL) {
+
+            return;
+        }
+    }
+}
+
+/**
+ * @brief   Nelder-Mead search of the range errors, from the anchors'
+ *          centroid weighted towards the nearest ones
+ * @param   anchors:    Anchor locations
+ * @param   dist:       Estimated distance to each anchor
+ * @param   weight:     Weight of each anchor (NULL for equal weights)
+ * @param   n:          Number of anchors
+ * @param   out:        Location
+ */
+static void multilat_nelderMead(const LocPoint* anchors, const float* dist,
+        const float* weight, uint8_t n, LocPoint* out) {
+
+    // Initial guess - anchors weighted by (n - 1) S / (S - d)
+    float sum = 0;
+    for (uint8_t i = 0; i < n; i++) {
+
+        sum += dist[i];
+    }
+
+    LocPoint x0 = {0, 0};
+    float weights = 0;
+    for (uint8_t i = 0; i < n; i++) {
+
+        float w = sum > dist[i] ? ((n - 1) * sum) / (sum - dist[i]) : 1.0f;
+        x0.x += w * anchors[i].x;
+        x0.y += w * anchors[i].y;
+        weights += w;
+    }
+    x0.x /= weights;
+    x0.y /= weights;
+
+    // Simplex of 3 points, kept sorted best first
+    LocPoint s[3] = {x0, x0, x0};
+    float f[3];
+    s[1].x = x0.x != 0 ? x0.x * (1 + NM_NONZDELT) : NM_ZDELT;
+    s[2].y = x0.y != 0 ? x0.y * (1 + NM_NONZDELT) : NM_ZDELT;
+    for (uint8_t i = 0; i < 3; i++) {
+
+        f[i] = multilat_error(s[i], anchors, dist, weight, n);
+    }
+
+    for (uint16_t iter = 0; iter < NM_MAX_ITER; iter++) {
+
+        // Sort best to worst
+        for (uint8_t i = 1; i < 3; i++) {
+
+            for (uint8_t j = i; j > 0 && f[j] < f[j - 1]; j--) {
+
+                LocPoint tp = s[j];
+                float tf = f[j];
+                s[j] = s[j - 1];
+                f[j] = f[j - 1];
+                s[j - 1] = tp;
+                f[j - 1] = tf;
+            }
+        }
+
+        float spread = fmaxf(fmaxf(fabsf(s[1].x - s[0].x),
+                fabsf(s[2].x - s[0].x)), fmaxf(fabsf(s[1].y - s[0].y),
+                fabsf(s[2].y - s[0].y)));
+        if (spread <= NM_XATOL && fmaxf(fabsf(f[1] - f[0]),
+                fabsf(f[2] - f[0])) <= NM_FATOL) {
+
+            break;
+        }
+
+        LocPoint c = {(s[0].x + s[1].x) / 2, (s[0].y + s[1].y) / 2};
+        LocPoint r = {2 * c.x - s[2].x, 2 * c.y - s[2].y};
+        float fr = multilat_error(r, anchors, dist, weight, n);
+
+        if (fr < f[0]) {
+
+            // Expand
+            LocPoint e = {3 * c.x - 2 * s[2].x, 3 * c.y - 2 * s[2].y};
+            float fe = multilat_error(e, anchors, dist, weight, n);
+            s[2] = fe < fr ? e : r;
+            f[2] = fe < fr ? fe : fr;
+            continue;
+        }
+
+        if (fr < f[1]) {
+
+            s[2] = r;
+            f[2] = fr;
+            continue;
+        }
+
+        // Contract, outside or inside the simplex
+        LocPoint k;
+        if (fr < f[2]) {
+
+            k.x = 1.5f * c.x - 0.5f * s[2].x;
+            k.y = 1.5f * c.y - 0.5f * s[2].y;
+        } else {
+
+            k.x = 0.5f * c.x + 0.5f * s[2].x;
+            k.y = 0.5f * c.y + 0.5f * s[2].y;
+        }
+        float fk = multilat_error(k, anchors, dist, weight, n);
+
+        if (fk < fminf(fr, f[2])) {
+
+            s[2] = k;
+            f[2] = fk;
+            continue;
+        }
+
+        // Shrink towards the best point
+        for (uint8_t i = 1; i < 3; i++) {
+
+            s[i].x = s[0].x + 0.5f * (s[i].x - s[0].x);
+            s[i].y = s[0].y + 0.5f * (s[i].y - s[0].y);
+            f[i] = multilat_error(s[i], anchors, dist, weight, n);
+        }
+    }
+
+    *out = f[0] <= f[1] && f[0] <= f[2] ? s[0] : (f[1] <= f[2] ? s[1] : s[2]);
+}
+
+/**
+ * @brief   Locate a point from distances to anchors, minimising the
+ *          (weighted) summed squared range error
+ * @param   anchors:    Anchor locations
+ * @param   dist:       Estimated distance to each anchor
+ * @param   weight:     Confidence in each distance, e.g. 1 / d^2 as range
+ *                      error grows with distance (NULL for equal weights)
+ * @param   n:          Number of anchors (at least 3)
+ * @param   method:     Solver
+ * @param   out:        Location
+ * @retval  0 if successful, -EINVAL for bad arguments, -EDOM if a closed form
+ *          solve found the anchors collinear
+ */
+int loc_multilaterate(const LocPoint* anchors, const float* dist,
+        const float* weight, uint8_t n, LocMultilatMethod method,
+        LocPoint* out) {
+
+    if (anchors == NULL || dist == NULL || out == NULL || n < 3) {
+
+        return -EINVAL;
+    }
+
+    switch (method) {
+
+        case LOC_MULTILAT_NELDER_MEAD:
+            multilat_nelderMead(anchors, dist, weight, n, out);
+            return 0;
+
+        case LOC_MULTILAT_LINEAR:
+            return multilat_linear(anchors, dist, weight, n, out);
+
+        case LOC_MULTILAT_GAUSS_NEWTON:
+            if (multilat_linear(anchors, dist, weight, n, out) < 0) {
+
+                return -EDOM;
+            }
+            multilat_refine(anchors, dist, weight, n, out);
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
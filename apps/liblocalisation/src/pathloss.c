@@ -0,0 +1,107 @@
+/**
+ ******************************************************************************
+ * @file            apps/liblocalisation/src/pathloss.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Per anchor path loss calibration. Each anchor's log
+ *                  distance model, RSSI = P0 - 10 n log10(d), is fitted by
+ *                  least squares to the RSSI it gave at the labelled
+ *                  locations of a training set. Anchors that cannot be
+ *                  fitted keep the uncalibrated model.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * loc_pathLossFit()        - Fit each anchor's path loss to a training set
+ ******************************************************************************
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+
+#include <localisation.h>
+
+// Labels closer than this to an anchor are taken as this far (m), as the
+// model has no meaning inside the near field
+#define PATHLOSS_MIN_DIST   0.5
+
+// Relative spread of log distances below which an anchor cannot be fitted
+#define PATHLOSS_MIN_SPREAD 1e-6
+
+/**
+ * @brief   Fit each anchor's path loss model to a training set
+ * @param   rssi:       RSSI vectors, rows x numAnchors, row major
+ *                      (LOC_RSSI_NONE if not heard)
+ * @param   labels:     Location of each vector
+ * @param   rows:       Number of vectors
+ * @param   anchors:    Anchor locations, in RSSI vector order
+ * @param   numAnchors: Number of anchors
+ * @param   out:        Model of each anchor
+ * @retval  Mask of the anchors left on LOC_PATHLOSS_P0/LOC_PATHLOSS_N 
+ *          (bit a for anchor a) because they were heard from too few 
+ *          distances to fit, or the fit does not decay with distance.
+ *          0 if every anchor was fitted, -EINVAL for bad arguments.
+ */
+int loc_pathLossFit(const int8_t* rssi, const LocPoint* labels, uint32_t rows,
+        const LocPoint* anchors, uint8_t numAnchors, LocPathLoss* out) {
+
+    if (rssi == NULL || labels == NULL || anchors == NULL || out == NULL ||
+            rows == 0 || numAnchors == 0 || numAnchors > LOC_MAX_ANCHORS) {
+
+        return -EINVAL;
+    }
+
+    int unfitted = 0;
+
+    for (uint8_t a = 0; a < numAnchors; a++) {
+
+        // Regress RSSI on x = -10 log10(d), slope n and intercept P0
+        double count = 0;
+        double sx = 0;
+        double sy = 0;
+        double sxx = 0;
+        double sxy = 0;
+
+        for (uint32_t i = 0; i < rows; i++) {
+
+            int8_t y = rssi[(size_t)i * numAnchors + a];
+            if (y == LOC_RSSI_NONE) {
+
+                continue;
+            }
+
+            double d = hypot(labels[i].x - anchors[a].x,
+                    labels[i].y - anchors[a].y);
+            double x = -10.0 * log10(d > PATHLOSS_MIN_DIST ? d :
+                    PATHLOSS_MIN_DIST);
+
+            count++;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+
+        // One anchor that can't be fitted doesn't spoil the others
+        double spread = count * sxx - sx * sx;
+        double n = 0;
+        if (count >= 2 && spread > PATHLOSS_MIN_SPREAD * count * sxx) {
+
+            n = (count * sxy - sx * sy) / spread;
+        }
+
+        if (n <= 0) {
+
+            out[a].p0 = LOC_PATHLOSS_P0;
+            out[a].pathLossN = LOC_PATHLOSS_N;
+            unfitted |= 1 << a;
+            continue;
+        }
+
+        out[a].p0 = (sy - n * sx) / count;
+        out[a].pathLossN = n;
+    }
+
+    return unfitted;
+}
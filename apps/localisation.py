@@ -0,0 +1,462 @@
+## Python binding for the native localisation engine (apps/liblocalisation)
+## Build the library first:
+##   cmake -S liblocalisation -B liblocalisation/build
+##   cmake --build liblocalisation/build
+
+import ctypes
+import errno
+import os
+
+LOC_MAX_ANCHORS = 16
+LOC_MAX_RANGERS = 4
+LOC_RSSI_NONE = -128
+
+## KNN metrics and searches (LocKnnMetric, LocKnnSearch)
+LOC_KNN_L2 = 0
+LOC_KNN_L1 = 1
+LOC_KNN_SCALAR = 0
+LOC_KNN_SCAN = 1
+LOC_KNN_TREE = 2
+
+## Multilateration solvers (LocMultilatMethod)
+LOC_MULTILAT_NELDER_MEAD = 0
+LOC_MULTILAT_LINEAR = 1
+LOC_MULTILAT_GAUSS_NEWTON = 2
+
+_HERE = os.path.dirname(os.path.abspath(__file__))
+
+## Where to look for the library, LOCALISATION_LIB overrides
+_LIB_PATHS = [
+    os.path.join(_HERE, "liblocalisation", "build", "liblocalisation.so"),
+]
+
+## Default training set and the fingerprint file built from it, next to
+## this file (see fingerprint_db.py)
+TRAINING_SET = os.path.join(_HERE, "trainingset.xlsx")
+FINGERPRINTS = os.path.join(_HERE, "trainingset.locf")
+
+## Static node locations, in RSSI vector order
+STATIONS = [[17.8, 7.8], [2.4, 7.8], [5.85, 3.0], [11.95, 0.1], [6.55, 0.1],
+            [12.75, 3.0], [9.45, 12.75], [14.2, 10], [5.5, 10], [12.55, 9.2],
+            [8.65, 9.2], [15.05, 4.8], [6.95, 4.8]]
+
+## Ultrasonic rangers, in the mobile payload's ultrasonic order - the
+## sensors on static nodes 0 and 1, facing across the floor from the side
+## walls. (location, beam direction, longest range trusted in metres)
+RANGERS = [(STATIONS[0], (-1.0, 0.0), 4.0),
+           (STATIONS[1], (1.0, 0.0), 4.0)]
+
+## Speed of sound (m/s) for turning echo times into ranges
+SOUND_M_S = 343.0
+
+
+class LocPoint(ctypes.Structure):
+    _fields_ = [("x", ctypes.c_float), ("y", ctypes.c_float)]
+
+
+class LocPathLoss(ctypes.Structure):
+    _fields_ = [("p0", ctypes.c_float), ("pathLossN", ctypes.c_float)]
+
+
+class LocRanger(ctypes.Structure):
+    _fields_ = [("pos", LocPoint), ("dir", LocPoint),
+                ("maxRange", ctypes.c_float)]
+
+
+class LocConfig(ctypes.Structure):
+    _fields_ = [("k", ctypes.c_uint8),
+                ("multilatAnchors", ctypes.c_uint8),
+                ("multilatMethod", ctypes.c_uint8),
+                ("multilatWeighted", ctypes.c_uint8),
+                ("p0", ctypes.c_float),
+                ("pathLossN", ctypes.c_float),
+                ("kalmanQ", ctypes.c_float),
+                ("knnR", ctypes.c_float),
+                ("multilatR", ctypes.c_float),
+                ("rangerR", ctypes.c_float),
+                ("rangerSpread", ctypes.c_float),
+                ("rangerGate", ctypes.c_float)]
+
+
+def _load():
+    path = os.environ.get("LOCALISATION_LIB")
+    if path is None:
+        path = next((p for p in _LIB_PATHS if os.path.exists(p)), None)
+    if path is None:
+        raise OSError("liblocalisation.so not found, build apps/liblocalisation "
+                      "or set LOCALISATION_LIB")
+    lib = ctypes.CDLL(path)
+
+    int8_p = ctypes.POINTER(ctypes.c_int8)
+    point_p = ctypes.POINTER(LocPoint)
+    path_loss_p = ctypes.POINTER(LocPathLoss)
+    float_p = ctypes.POINTER(ctypes.c_float)
+
+    lib.loc_knnCreate.restype = ctypes.c_void_p
+    lib.loc_knnCreate.argtypes = [int8_p, point_p, ctypes.c_uint32,
+                                  ctypes.c_uint8]
+    lib.loc_knnDestroy.argtypes = [ctypes.c_void_p]
+    lib.loc_knnSetSearch.argtypes = [ctypes.c_void_p, ctypes.c_int,
+                                     ctypes.c_int]
+    lib.loc_knnKernel.restype = ctypes.c_char_p
+    lib.loc_knnKernel.argtypes = []
+    lib.loc_knnSave.argtypes = [ctypes.c_void_p, point_p, path_loss_p,
+                                ctypes.c_uint8, ctypes.c_char_p]
+    lib.loc_knnOpen.restype = ctypes.c_void_p
+    lib.loc_knnOpen.argtypes = [ctypes.c_char_p]
+    lib.loc_knnAnchors.restype = ctypes.c_uint8
+    lib.loc_knnAnchors.argtypes = [ctypes.c_void_p, point_p]
+    lib.loc_knnPathLoss.restype = ctypes.c_uint8
+    lib.loc_knnPathLoss.argtypes = [ctypes.c_void_p, path_loss_p]
+    lib.loc_knnPredict.argtypes = [ctypes.c_void_p, int8_p, ctypes.c_uint8,
+                                   point_p]
+    lib.loc_rssiToDistance.restype = ctypes.c_float
+    lib.loc_rssiToDistance.argtypes = [ctypes.c_int8, ctypes.c_float,
+                                       ctypes.c_float]
+    lib.loc_pathLossFit.argtypes = [int8_p, point_p, ctypes.c_uint32, point_p,
+                                    ctypes.c_uint8, path_loss_p]
+    lib.loc_multilaterate.argtypes = [point_p, ctypes.POINTER(ctypes.c_float),
+                                      ctypes.POINTER(ctypes.c_float),
+                                      ctypes.c_uint8, ctypes.c_int, point_p]
+    lib.loc_configDefault.argtypes = [ctypes.POINTER(LocConfig)]
+    lib.loc_engineCreate.restype = ctypes.c_void_p
+    lib.loc_engineCreate.argtypes = [ctypes.c_void_p, point_p, path_loss_p,
+                                     ctypes.c_uint8, ctypes.c_uint32,
+                                     ctypes.POINTER(LocConfig)]
+    lib.loc_engineDestroy.argtypes = [ctypes.c_void_p]
+    lib.loc_engineSetRangers.argtypes = [ctypes.c_void_p,
+                                         ctypes.POINTER(LocRanger),
+                                         ctypes.c_uint8]
+    lib.loc_engineUpdate.argtypes = [ctypes.c_void_p, ctypes.c_uint32, int8_p,
+                                     point_p]
+    lib.loc_engineUpdateRanged.argtypes = [ctypes.c_void_p, ctypes.c_uint32,
+                                           int8_p, float_p, point_p]
+    lib.loc_engineUpdateBatch.argtypes = [ctypes.c_void_p,
+                                          ctypes.POINTER(ctypes.c_uint32),
+                                          int8_p, float_p, ctypes.c_uint32,
+                                          point_p,
+                                          ctypes.POINTER(ctypes.c_int)]
+    return lib
+
+
+_lib = None
+
+
+def lib():
+    global _lib
+    if _lib is None:
+        _lib = _load()
+    return _lib
+
+
+def default_config():
+    config = LocConfig()
+    lib().loc_configDefault(ctypes.byref(config))
+    return config
+
+
+def knn_kernel():
+    """Instruction set of the KNN distance kernel - avx2, sse4.1, neon or
+    scalar"""
+    return lib().loc_knnKernel().decode()
+
+
+def rssi_to_distance(rssi, p0=-72.0, n=2.0):
+    """Log distance path loss model, metres"""
+    return lib().loc_rssiToDistance(rssi, p0, n)
+
+
+def multilaterate(stations, dist, weights=None,
+                  method=LOC_MULTILAT_GAUSS_NEWTON):
+    """(x, y) whose distances to the stations best match dist, None if
+    the stations are collinear"""
+    anchors = (LocPoint * len(stations))(
+        *[LocPoint(x, y) for x, y in stations])
+    out = LocPoint()
+    err = lib().loc_multilaterate(
+        anchors, (ctypes.c_float * len(dist))(*dist),
+        (ctypes.c_float * len(weights))(*weights) if weights else None,
+        len(stations), method, ctypes.byref(out))
+    if err == -errno.EDOM:
+        return None
+    if err < 0:
+        raise ValueError("multilaterate failed (%d)" % err)
+    return out.x, out.y
+
+
+def echo_to_range(echo_us, sound=SOUND_M_S):
+    """Range (m) of an ultrasonic echo time (us), None for no echo"""
+    if echo_us is None:
+        return None
+    return echo_us * sound / 2e6
+
+
+def _range_array(ranges, width):
+    """Ranges padded or cut to width, no reading as 0"""
+    ranges = list(ranges or [])[:width]
+    ranges += [None] * (width - len(ranges))
+    return (ctypes.c_float * width)(*[r or 0.0 for r in ranges])
+
+
+def _rssi_array(rssi):
+    """int8 RSSIs, with None and the decoders' -128 both LOC_RSSI_NONE"""
+    return (ctypes.c_int8 * len(rssi))(
+        *[LOC_RSSI_NONE if r is None or r <= LOC_RSSI_NONE
+          else min(127, int(r)) for r in rssi])
+
+
+def _path_loss_array(path_loss):
+    return (LocPathLoss * len(path_loss))(
+        *[LocPathLoss(p0, n) for p0, n in path_loss])
+
+
+def fit_path_loss(rssi, labels, stations=STATIONS):
+    """Per station path loss model [(p0, n), ...] fitted to a training set,
+    so rssi_to_distance(r, *model[i]) is the distance to station i, and the
+    indices of the stations that could not be fitted (left on the
+    uncalibrated model)"""
+    if not rssi or len(rssi) != len(labels):
+        raise ValueError("need one label per RSSI vector")
+    flat = [v for row in rssi for v in row[:len(stations)]]
+    points = (LocPoint * len(labels))(*[LocPoint(x, y) for x, y in labels])
+    anchors = (LocPoint * len(stations))(
+        *[LocPoint(x, y) for x, y in stations])
+    out = (LocPathLoss * len(stations))()
+    err = lib().loc_pathLossFit(_rssi_array(flat), points, len(labels),
+                                anchors, len(stations), out)
+    if err < 0:
+        raise ValueError("could not fit the path loss (%d)" % err)
+    return ([(m.p0, m.pathLossN) for m in out],
+            [i for i in range(len(stations)) if err & (1 << i)])
+
+
+def _label(x, y):
+    return int(str(x).strip('|')), int(str(y).strip('|'))
+
+
+def load_training_set(path=TRAINING_SET):
+    """(rssi vectors, labels) from training data - a training.py CSV (the
+    '?' joined RSSIs then "x,y" quoted with '|') or the workbook made from
+    one (RSSIs in column A, the coordinates split over B and C)"""
+    rows = []
+    if path.lower().endswith(".csv"):
+        import csv
+        with open(path, newline='') as f:
+            for r in csv.reader(f, delimiter=',', quotechar='|'):
+                if len(r) == 2:
+                    r = [r[0]] + r[1].split(',')
+                rows.append(r)
+    else:
+        from openpyxl import load_workbook
+        sheet = load_workbook(filename=path, read_only=True).active
+        rows = sheet.iter_rows(min_col=1, max_col=3, values_only=True)
+
+    rssi = []
+    labels = []
+    for r in rows:
+        if not r or r[0] is None:
+            continue
+        if len(r) < 3:
+            raise ValueError("row %d has no coordinates" % (len(rssi) + 1))
+        rssi.append([int(s) for s in str(r[0]).split('?')])
+        labels.append(_label(r[1], r[2]))
+        if len(rssi[-1]) != len(rssi[0]):
+            raise ValueError("row %d has %d anchors, not %d" % (
+                len(rssi), len(rssi[-1]), len(rssi[0])))
+    return rssi, labels
+
+
+class Knn:
+    """Fingerprint index over a training set, built in memory or mapped from
+    a fingerprint file"""
+
+    def __init__(self, rssi, labels):
+        if not rssi or len(rssi) != len(labels):
+            raise ValueError("need one label per RSSI vector")
+        flat = [v for row in rssi for v in row]
+        points = (LocPoint * len(labels))(*[LocPoint(x, y) for x, y in labels])
+        self._knn = lib().loc_knnCreate(_rssi_array(flat), points, len(labels),
+                                        len(rssi[0]))
+        if not self._knn:
+            raise ValueError("bad training set")
+
+    @classmethod
+    def open(cls, path=FINGERPRINTS):
+        """Map a fingerprint file read only"""
+        knn = cls.__new__(cls)
+        knn._knn = lib().loc_knnOpen(os.fsencode(path))
+        if not knn._knn:
+            raise OSError("%s is not a usable fingerprint file" % path)
+        return knn
+
+    def save(self, path=FINGERPRINTS, stations=None, path_loss=None):
+        """Save as a fingerprint file, with the station locations and their
+        path loss models if given"""
+        anchors = None
+        if stations:
+            anchors = (LocPoint * len(stations))(
+                *[LocPoint(x, y) for x, y in stations])
+        err = lib().loc_knnSave(self._knn, anchors,
+                                _path_loss_array(path_loss) if path_loss
+                                else None,
+                                len(stations) if stations else 0,
+                                os.fsencode(path))
+        if err < 0:
+            raise OSError(-err, "could not save %s" % path)
+
+    def anchors(self):
+        """Station locations saved with the index, [] if not known"""
+        points = (LocPoint * LOC_MAX_ANCHORS)()
+        count = lib().loc_knnAnchors(self._knn, points)
+        return [[points[i].x, points[i].y] for i in range(count)]
+
+    def path_loss(self):
+        """Station path loss models saved with the index, [] if not
+        calibrated"""
+        models = (LocPathLoss * LOC_MAX_ANCHORS)()
+        count = lib().loc_knnPathLoss(self._knn, models)
+        return [(models[i].p0, models[i].pathLossN) for i in range(count)]
+
+    def set_search(self, metric=LOC_KNN_L2, search=LOC_KNN_TREE):
+        """Choose the distance and how queries search the prints, every
+        search finds the same neighbours"""
+        if lib().loc_knnSetSearch(self._knn, metric, search) < 0:
+            raise ValueError("bad metric or search")
+
+    def predict(self, rssi, k=5):
+        out = LocPoint()
+        err = lib().loc_knnPredict(self._knn, _rssi_array(rssi), k,
+                                   ctypes.byref(out))
+        if err < 0:
+            raise ValueError("knn predict failed (%d)" % err)
+        return out.x, out.y
+
+    def __del__(self):
+        if getattr(self, "_knn", None):
+            lib().loc_knnDestroy(self._knn)
+            self._knn = None
+
+
+def load_knn(path=FINGERPRINTS, source=TRAINING_SET, stations=STATIONS):
+    """Fingerprint index for the GUI - maps the fingerprint file, building it
+    (and calibrating the stations) from the training set first if it is
+    missing or older"""
+    if os.path.exists(path) and (not os.path.exists(source) or
+                                 os.path.getmtime(path) >=
+                                 os.path.getmtime(source)):
+        try:
+            return Knn.open(path)
+        except OSError:
+            ## Another version or build, rebuild it
+            pass
+    rssi, labels = load_training_set(source)
+    knn = Knn(rssi, labels)
+    try:
+        knn.save(path, stations, fit_path_loss(rssi, labels, stations)[0])
+        return Knn.open(path)
+    except (OSError, ValueError) as e:
+        print("could not save %s: %s" % (path, e))
+    return knn
+
+
+class Engine:
+    """Tracks up to max_tags tags - update() returns the tag's tracked
+    location, or None if nothing was heard. Multilateration uses the path
+    loss models saved with the index unless others are given. rangers are
+    the ultrasonic sensors as RANGERS, whose ranges (m, None for no echo)
+    can be passed with each RSSI vector."""
+
+    def __init__(self, knn, stations, max_tags=4096, config=None,
+                 path_loss=None, rangers=None):
+        self._knn = knn     ## Keep the index alive as long as the engine
+        self.num_anchors = len(stations)
+        anchors = (LocPoint * len(stations))(
+            *[LocPoint(x, y) for x, y in stations])
+        if path_loss is None:
+            path_loss = knn.path_loss()
+        if path_loss and len(path_loss) != len(stations):
+            raise ValueError("need one path loss model per station")
+        self._engine = lib().loc_engineCreate(
+            knn._knn, anchors,
+            _path_loss_array(path_loss) if path_loss else None,
+            len(stations), max_tags,
+            ctypes.byref(config) if config is not None else None)
+        if not self._engine:
+            raise ValueError("bad engine configuration")
+        self.num_rangers = len(rangers or [])
+        if self.num_rangers:
+            ret = lib().loc_engineSetRangers(
+                self._engine, (LocRanger * self.num_rangers)(
+                    *[LocRanger(LocPoint(*pos), LocPoint(*direction),
+                                max_range)
+                      for pos, direction, max_range in rangers]),
+                self.num_rangers)
+            if ret < 0:
+                raise ValueError("bad rangers (%d)" % ret)
+        self._out = LocPoint()
+
+    def update(self, tag, rssi, ranges=None):
+        if rssi is None or len(rssi) < self.num_anchors:
+            return None
+        ret = lib().loc_engineUpdateRanged(
+            self._engine, tag, _rssi_array(rssi[:self.num_anchors]),
+            _range_array(ranges, self.num_rangers)
+            if ranges and self.num_rangers else None,
+            ctypes.byref(self._out))
+        if ret < 0 and ret != -errno.ENODATA:  ## Nothing heard
+            raise RuntimeError("engine update failed (%d)" % ret)
+        return (self._out.x, self._out.y) if ret == 1 else None
+
+    def update_batch(self, tags, rssi, ranges=None):
+        """update() of every tag in one native call, rssi is one vector per
+        tag and ranges (if given) one list of ranges per tag - returns a
+        location (or None) per tag"""
+        rows = [i for i, r in enumerate(rssi)
+                if r is not None and len(r) >= self.num_anchors]
+        count = len(rows)
+        results = [None] * len(tags)
+        if not count:
+            return results
+        out = (LocPoint * count)()
+        status = (ctypes.c_int * count)()
+        ret = lib().loc_engineUpdateBatch(
+            self._engine, (ctypes.c_uint32 * count)(*[tags[i] for i in rows]),
+            _rssi_array([v for i in rows for v in rssi[i][:self.num_anchors]]),
+            self._batch_ranges(ranges, rows), count, out, status)
+        if ret < 0:
+            raise RuntimeError("engine update failed (%d)" % ret)
+        for j, i in enumerate(rows):
+            if status[j] == 1:
+                results[i] = (out[j].x, out[j].y)
+            elif status[j] != -errno.ENODATA:
+                raise RuntimeError("engine update failed (%d)" % status[j])
+        return results
+
+    def _batch_ranges(self, ranges, rows):
+        if not ranges or not self.num_rangers:
+            return None
+        width = self.num_rangers
+        array = (ctypes.c_float * (len(rows) * width))()
+        for j, i in enumerate(rows):
+            array[j * width:(j + 1) * width] = list(
+                _range_array(ranges[i], width))
+        return array
+
+    def __del__(self):
+        if getattr(self, "_engine", None):
+            lib().loc_engineDestroy(self._engine)
+            self._engine = None
+
+
+if __name__ == "__main__":
+    ## Binding checks against the built library
+    stations = STATIONS[:4]
+    prints = [[-60, -70, -80, -90], [-90, -80, -70, -60],
+              [-70, -60, -90, -80], [-80, -90, -60, -70]]
+    engine = Engine(Knn(prints, [[1, 1], [9, 9], [1, 9], [9, 1]]), stations)
+    unheard = [LOC_RSSI_NONE] * len(stations)
+    assert engine.update(1, unheard) is None
+    assert engine.update(1, [None] * len(stations)) is None
+    assert engine.update_batch([2], [unheard]) == [None]
+    assert engine.update(3, prints[0]) is not None
+    print("ok")
@@ -0,0 +1,199 @@
+## Advertising payload codec - host side mirror of myoslib/src/os_payload.c
+## Wire format is documented in myoslib/inc/os_payload.h
+
+PAYLOAD_VERSION = 2
+
+PAYLOAD_KIND_STATIC = 1
+PAYLOAD_KIND_MOBILE = 2
+
+PAYLOAD_MAX_ANCHORS = 16
+PAYLOAD_MAX_ULTRASONIC = 2
+PAYLOAD_MAX_DELTA_BITS = 7
+
+## Values meaning "no reading"
+PAYLOAD_RSSI_NONE = -128
+PAYLOAD_US_NONE = 0xFFFF
+
+PAYLOAD_STATIC_LEN = 7
+PAYLOAD_MOBILE_HEADER_LEN = 10
+
+## Mobile payload hop statistics flag (byte 3), and jitter ceiling
+PAYLOAD_HOP_PRESENT = 0x40
+PAYLOAD_HOP_JITTER_MAX = 0xFF
+
+## Resolution of the mobile payload age field
+PAYLOAD_AGE_UNIT_MS = 4
+PAYLOAD_AGE_MAX = 0xFF
+
+## Eddystone service UUID our service data is sent under (as bleak reports it)
+PAYLOAD_UUID = "0000feaa-0000-1000-8000-00805f9b34fb"
+
+
+def _int8(b):
+    return b - 256 if b > 127 else b
+
+
+def payload_kind(buf):
+    """Kind of a payload, or None if it is not a version we understand"""
+    if len(buf) < 2 or (buf[0] >> 4) != PAYLOAD_VERSION:
+        return None
+    return buf[0] & 0x0F
+
+
+def find_payload(service_data):
+    """Our payload from a bleak service_data dict, or None"""
+    return service_data.get(PAYLOAD_UUID) if service_data else None
+
+
+def encode_static(seq, node_id, ultrasonic=PAYLOAD_US_NONE, uptime=0):
+    us = PAYLOAD_US_NONE if ultrasonic is None else ultrasonic
+    uptime &= 0xFFFF
+    return bytes([(PAYLOAD_VERSION << 4) | PAYLOAD_KIND_STATIC, seq & 0xFF,
+                  node_id, us & 0xFF, us >> 8, uptime & 0xFF, uptime >> 8])
+
+
+def decode_static(buf):
+    """(seq, node_id, ultrasonic, uptime) with ultrasonic None if not
+    present"""
+    if payload_kind(buf) != PAYLOAD_KIND_STATIC or len(buf) < PAYLOAD_STATIC_LEN:
+        raise ValueError("not a static node payload")
+    us = buf[3] | (buf[4] << 8)
+    return (buf[1], buf[2], None if us == PAYLOAD_US_NONE else us,
+            buf[5] | (buf[6] << 8))
+
+
+def encode_mobile(seq, rssi, ultrasonic=(), uptime=0, age=0, size=24,
+                  hop=None):
+    """Same algorithm as os_payloadEncodeMobile - anchors not heard are
+    PAYLOAD_RSSI_NONE, missing ultrasonic readings None. hop is a
+    (lost, jitter ms) pair per ultrasonic reading, left out if it doesn't
+    fit"""
+    if len(rssi) > PAYLOAD_MAX_ANCHORS:
+        raise ValueError("too many anchors")
+    ultrasonic = list(ultrasonic) + [None] * PAYLOAD_MAX_ULTRASONIC
+    heard = [i for i, r in enumerate(rssi) if r != PAYLOAD_RSSI_NONE]
+    us = [(i, u) for i, u in enumerate(ultrasonic[:PAYLOAD_MAX_ULTRASONIC])
+          if u is not None and u != PAYLOAD_US_NONE]
+
+    space = size - PAYLOAD_MOBILE_HEADER_LEN - 2 * len(us)
+    if space < 0:
+        raise ValueError("buffer too small")
+
+    width = 0
+    floor = 0
+    if heard:
+        lo = min(rssi[i] for i in heard)
+        hi = max(rssi[i] for i in heard)
+        while width < PAYLOAD_MAX_DELTA_BITS and (hi - lo) >= (1 << width):
+            width += 1
+        width = min(width, (space * 8) // len(heard))
+        floor = max(lo, hi - ((1 << width) - 1))
+
+    ## Never narrow the offsets to make room for the hop statistics
+    has_hop = (hop is not None and us and
+               (len(heard) * width + 7) // 8 + 2 * len(us) <= space)
+
+    heard_mask = sum(1 << i for i in heard)
+    us_mask = sum(1 << i for i, _ in us)
+    flags = us_mask << 4 | (PAYLOAD_HOP_PRESENT if has_hop else 0)
+    out = bytearray([(PAYLOAD_VERSION << 4) | PAYLOAD_KIND_MOBILE, seq & 0xFF,
+                     len(rssi), width | flags,
+                     heard_mask & 0xFF, heard_mask >> 8, floor & 0xFF,
+                     uptime & 0xFF, (uptime >> 8) & 0xFF,
+                     min(age, PAYLOAD_AGE_MAX)])
+
+    ## Pack offsets LSB first
+    bits = 0
+    num_bits = 0
+    for i in heard:
+        bits |= max(rssi[i] - floor, 0) << num_bits
+        num_bits += width
+        while num_bits >= 8:
+            out.append(bits & 0xFF)
+            bits >>= 8
+            num_bits -= 8
+    if num_bits > 0:
+        out.append(bits & 0xFF)
+
+    for _, u in us:
+        out += bytes([u & 0xFF, u >> 8])
+    if has_hop:
+        for i, _ in us:
+            lost, jitter = hop[i]
+            out += bytes([lost & 0xFF, min(jitter, PAYLOAD_HOP_JITTER_MAX)])
+    return bytes(out)
+
+
+def decode_mobile(buf):
+    """(seq, rssi list, ultrasonic list) - anchors not heard are
+    PAYLOAD_RSSI_NONE and missing ultrasonic readings are None. Use
+    decode_mobile_timing() for the uptime and age fields, and
+    decode_mobile_hop() for the hop statistics"""
+    if (payload_kind(buf) != PAYLOAD_KIND_MOBILE or
+            len(buf) < PAYLOAD_MOBILE_HEADER_LEN or
+            buf[2] > PAYLOAD_MAX_ANCHORS):
+        raise ValueError("not a mobile node payload")
+
+    width = buf[3] & 0x07
+    us_mask = (buf[3] >> 4) & 0x03
+    heard = buf[4] | (buf[5] << 8)
+    floor = _int8(buf[6])
+    pos = PAYLOAD_MOBILE_HEADER_LEN
+    bits = 0
+    num_bits = 0
+
+    rssi = []
+    for i in range(buf[2]):
+        if not heard & (1 << i):
+            rssi.append(PAYLOAD_RSSI_NONE)
+            continue
+        while num_bits < width:
+            if pos >= len(buf):
+                raise ValueError("truncated mobile node payload")
+            bits |= buf[pos] << num_bits
+            pos += 1
+            num_bits += 8
+        rssi.append(floor + (bits & ((1 << width) - 1)))
+        bits >>= width
+        num_bits -= width
+
+    ultrasonic = []
+    for i in range(PAYLOAD_MAX_ULTRASONIC):
+        if us_mask & (1 << i):
+            if pos + 2 > len(buf):
+                raise ValueError("truncated mobile node payload")
+            ultrasonic.append(buf[pos] | (buf[pos + 1] << 8))
+            pos += 2
+        else:
+            ultrasonic.append(None)
+    return buf[1], rssi, ultrasonic
+
+
+def decode_mobile_timing(buf):
+    """(uptime ms, age ms) of a mobile node payload"""
+    if payload_kind(buf) != PAYLOAD_KIND_MOBILE or len(buf) < PAYLOAD_MOBILE_HEADER_LEN:
+        raise ValueError("not a mobile node payload")
+    return buf[7] | (buf[8] << 8), buf[9] * PAYLOAD_AGE_UNIT_MS
+
+
+def decode_mobile_hop(buf):
+    """(lost, jitter ms) of the static to mobile hop per ultrasonic reading
+    (None where no reading), or None if the payload has no hop statistics"""
+    decode_mobile(buf)
+    if not buf[3] & PAYLOAD_HOP_PRESENT:
+        return None
+    width = buf[3] & 0x07
+    us_mask = (buf[3] >> 4) & 0x03
+    heard = bin(buf[4] | (buf[5] << 8)).count("1")
+    pos = (PAYLOAD_MOBILE_HEADER_LEN + (heard * width + 7) // 8 +
+           2 * bin(us_mask).count("1"))
+    hop = []
+    for i in range(PAYLOAD_MAX_ULTRASONIC):
+        if us_mask & (1 << i):
+            if pos + 2 > len(buf):
+                raise ValueError("truncated mobile node payload")
+            hop.append((buf[pos], buf[pos + 1]))
+            pos += 2
+        else:
+            hop.append(None)
+    return hop
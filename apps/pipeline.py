@@ -0,0 +1,105 @@
+## Host pipeline between the BLE scanner, the solver and the UI. The scanner
+## pushes timestamped samples into a bounded queue without blocking, the
+## solver wakes when samples arrive and publishes locations, and the UI reads
+## the latest locations at its own rate. Counters on each stage show where
+## samples are being dropped or delayed.
+
+import collections
+import threading
+import time
+
+## One mobile report - time is time.monotonic() when the RSSI was measured
+Sample = collections.namedtuple("Sample", ["time", "tag", "rssi", "us"])
+
+
+class SampleQueue:
+    """Bounded queue for one producer and one consumer. put() never blocks
+    and takes no lock (deque appends and pops are atomic), a full queue drops
+    its oldest sample. The only lock is the event that wakes the consumer."""
+
+    def __init__(self, size=256):
+        self.size = size
+        self._samples = collections.deque(maxlen=size)
+        self._ready = threading.Event()
+        self.pushed = 0
+        self.dropped = 0
+        self.high_water = 0
+
+    def put(self, sample):
+        ## A get_all() between the check and the append can make this count
+        ## one drop that didn't happen, good enough for statistics
+        depth = len(self._samples)
+        if depth == self.size:
+            self.dropped += 1
+        else:
+            depth += 1
+        self._samples.append(sample)
+        self.pushed += 1
+        self.high_water = max(self.high_water, depth)
+        self._ready.set()
+
+    def get_all(self, timeout=None):
+        """Wait up to timeout seconds for samples, then take every queued
+        one, oldest first ([] on timeout)"""
+        if not self._ready.wait(timeout):
+            return []
+        self._ready.clear()
+        samples = []
+        while True:
+            try:
+                samples.append(self._samples.popleft())
+            except IndexError:
+                return samples
+
+    def __len__(self):
+        return len(self._samples)
+
+
+class StageStats:
+    """Samples and batches a stage handled, and the age of samples when it
+    finished them"""
+
+    def __init__(self):
+        self.samples = 0
+        self.batches = 0
+        self.latency_sum = 0.0
+        self.latency_max = 0.0
+
+    def record(self, samples, now=None):
+        now = time.monotonic() if now is None else now
+        for sample in samples:
+            latency = now - sample.time
+            self.latency_sum += latency
+            self.latency_max = max(self.latency_max, latency)
+        self.samples += len(samples)
+        self.batches += 1
+
+
+class Monitor:
+    """Rates and backpressure over the interval between report() calls"""
+
+    def __init__(self, queue, stats):
+        self._queue = queue
+        self._stats = stats
+        self._last = (time.monotonic(), 0, 0, 0, 0, 0.0)
+
+    def report(self):
+        now = time.monotonic()
+        queue = self._queue
+        stats = self._stats
+        last_time, pushed, dropped, solved, batches, latency = self._last
+        elapsed = max(now - last_time, 1e-9)
+        count = stats.samples - solved
+        text = ("in %.0f/s  solved %.0f/s in %d batches  dropped %d  "
+                "queue %d/%d (max %d)  latency %.0f ms (max %.0f ms)" % (
+                    (queue.pushed - pushed) / elapsed,
+                    count / elapsed, stats.batches - batches,
+                    queue.dropped - dropped, len(queue), queue.size,
+                    queue.high_water,
+                    1e3 * (stats.latency_sum - latency) / count if count
+                    else 0.0, 1e3 * stats.latency_max))
+        self._last = (now, queue.pushed, queue.dropped, stats.samples,
+                      stats.batches, stats.latency_sum)
+        queue.high_water = len(queue)
+        stats.latency_max = 0.0
+        return text
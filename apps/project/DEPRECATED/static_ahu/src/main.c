@@ -27,6 +27,8 @@
 #include "hal_packet.h"
 #include <usb/usb_device.h>
 #include <os_bluetooth.h>
+#include <os_advertise.h>
+#include <os_payload.h>
 
 // Bluetooth scan response data
 static const struct bt_data staticResponseData[] = {
@@ -37,6 +39,9 @@ void main(void) {
     
 	const struct device *usb;
     int btErr;
+    StaticPayload staticPayload = {.seq = 0, .nodeId = 0, 
+            .ultrasonic = PAYLOAD_US_NONE};
+    uint8_t payload[ADV_SERVICE_DATA_MAX];
 
     // Initialise USB UART for debugging
     usb = device_get_binding(CONFIG_UART_CONSOLE_ON_DEV_NAME);
@@ -59,26 +64,28 @@ void main(void) {
 
     k_msleep(5000);
 
+    // Start advertising once, from here on only the payload is changed
+    btErr = os_payloadEncodeStatic(&staticPayload, payload, sizeof(payload));
+    btErr = os_advertiseStart(BT_LE_FASTER_ADV, payload, btErr, 
+            staticResponseData, ARRAY_SIZE(staticResponseData));
+
 #ifdef ULTRASONIC_NODE
     hal_hci_master_init();    
-    k_msleep(100);  
 #endif  // ULTRASONIC_NODE
 
 	while(1) {
 #ifdef ULTRASONIC_NODE
-        // transmit request , data dont care
-        hal_parse_spi(6,0,1);
-
-        // wait for spi response
-        k_msleep(30); 
-        
+        uint8_t request[SPI_BUFFER];
         uint8_t unparsed_msg[SPI_BUFFER];
-        struct UsPacket u_sensor;
-        
-        // Receive from HCI
-        hal_hci_receive(); 
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        u_sensor = hal_unparse_spi(unparsed_msg);
+        struct UsPacket u_sensor = { 0 };
+
+        // Request a reading, data dont care, and wait only as long as the
+        // slave takes to answer
+        hal_build_spi(request, 6, 0, 1);
+        if (hal_hci_request_sync(request, unparsed_msg,
+                K_MSEC(HCI_TIMEOUT_MS)) == 0) {
+            u_sensor = hal_unparse_spi(unparsed_msg);
+        }
 
         // Check for SPI preamble and response type, then transfer sensor pulse 
         // time over BT
@@ -87,6 +94,13 @@ void main(void) {
                 u_sensor.data[1];
 
             printk("Test: %d\r\n", test);
+
+            if (test != staticPayload.ultrasonic) {
+
+                staticPayload.seq++;
+                staticPayload.ultrasonic = test;
+                staticPayload.uptime = k_uptime_get_32() & 0xFFFF;
+            }
         }
         
 
@@ -94,29 +108,9 @@ void main(void) {
         k_msleep(30);
 #endif  // ULTRASONIC_NODE
         // Now do bluetooth transmission
-        btErr = bt_le_adv_stop();
-
-        const struct bt_data tempAd[] = {
-                BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | 
-                            BT_LE_AD_NO_BREDR)),
-                BT_DATA_BYTES(BT_DATA_UUID16_ALL, 0xAA, 0xFE),                  
-                BT_DATA_BYTES(BT_DATA_SVC_DATA16,                               
-                        0xAA, 0xFE,     // Eddystone UUID                       
-                        0x00,           // Eddystone UID frame type             
-                        0x00,           // Calibrated Tx power at 0m            
-#ifdef ULTRASONIC_NODE
-                        u_sensor.data[0], u_sensor.data[1], 
-#else
-                        0x00, 0x00,
-#endif //ULTRASONIC_NODE
-                        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                        0x00, 0x00, 0x00, 0x00, 0x00, 0x00,                     
-                        0x00, 0x00) 
-
-        };
-
-        btErr = bt_le_adv_start(BT_LE_FASTER_ADV, tempAd, ARRAY_SIZE(tempAd), 
-                staticResponseData, ARRAY_SIZE(staticResponseData));
+        btErr = os_payloadEncodeStatic(&staticPayload, payload, 
+                sizeof(payload));
+        btErr = os_advertiseUpdate(payload, btErr);
         printk("SENT  \n");
     }
 }
@@ -18,7 +18,6 @@
 #include <drivers/gpio.h>
 #include <stddef.h>
 #include <string.h>
-#include <stdio.h>
 #include <sys/printk.h>
 #include <sys/util.h>
 #include <kernel.h>
@@ -28,136 +27,307 @@
 #include <bluetooth/hci.h>
 
 #include <os_bluetooth.h>
+#include <os_payload.h>
+#include <os_telemetry.h>
+#include <os_uartframe.h>
+#include <os_whitelist.h>
+#include <os_scan.h>
+#include <errno.h>
+
+// USB UART the binary frames are sent over, nothing else may write to it
+#define UART_FRAME_DEV_NAME     "CDC_ACM_0"
+
+// How often link statistics are sent over UART
+#define TELEMETRY_REPORT_MS     5000
+
+#define UART_THREAD_STACK_SIZE  1024
+#define UART_THREAD_PRIORITY    7
+
+// Thread framing queued records out over UART, below the BT RX thread
+K_THREAD_DEFINE(os_TaskUartTx, UART_THREAD_STACK_SIZE, os_uartFrameTx, 
+        NULL, NULL, NULL, UART_THREAD_PRIORITY, 0, 0);
+
+// Thread decoding whitelist commands from the host
+K_THREAD_DEFINE(os_TaskUartRx, UART_THREAD_STACK_SIZE, os_uartFrameRx, 
+        NULL, NULL, NULL, UART_THREAD_PRIORITY, 0, 0);
+
+// Mobile nodes forwarded from boot, more are added at runtime over UART
+static const struct {
+    bt_addr_le_t    address;
+    uint16_t        source;
+} defaultMobiles[] = {
+    {{BT_ADDR_LE_RANDOM, {{0xAF, 0xDE, 0xCD, 0xD4, 0x38, 0xE1}}}, 0},
+    //{{BT_ADDR_LE_RANDOM, {{0x4D, 0x5F, 0x62, 0xD7, 0x95, 0xCF}}}, 1},
+    {{BT_ADDR_LE_RANDOM, {{0x1A, 0xDA, 0x64, 0xAA, 0x6C, 0xDC}}}, 2},
+};
+
+// Scan parameters, options change with whether the controller filters and
+// interval and window are set by the scan scheduler
+static struct bt_le_scan_param scanParams = {
+    .type       = BT_HCI_LE_SCAN_PASSIVE,
+    .options    = BT_LE_SCAN_OPT_NONE,
+    .interval   = SCAN_WINDOW,
+    .window     = SCAN_WINDOW,
+};
+
+// Whitelisted frames heard, drives the scan scheduler
+static atomic_t scanFrames;
+
+static void staticCallback(const bt_addr_le_t*, int8_t, uint8_t, 
+        struct net_buf_simple*);
 
-#define FILTER_MOBILE
-//#define FILTER_STATIC2
-#define FILTER_DONGLE
+/**
+ * @brief   Write a 16 bit value little endian
+ * @param   p:      Where to write
+ * @param   value:  Value to write
+ * @retval  Position after the value
+ */
+static uint8_t* putLe16(uint8_t* p, uint16_t value) {
 
+    *p++ = value & 0xFF;
+    *p++ = value >> 8;
+    return p;
+}
 
-// Bluetooth address of mobile node
-bt_addr_t mobileAddrMobile  = {.val = {0xAF, 0xDE, 0xCD, 0xD4, 0x38, 0xE1}};
-bt_addr_t mobileAddrStatic2 = {.val = {0x4D, 0x5F, 0x62, 0xD7, 0x95, 0xCF}};
-bt_addr_t mobileAddrDongle  = {.val = {0x1A, 0xDA, 0x64, 0xAA, 0x6C, 0xDC}};
+/**
+ * @brief   Write a 32 bit value little endian
+ * @param   p:      Where to write
+ * @param   value:  Value to write
+ * @retval  Position after the value
+ */
+static uint8_t* putLe32(uint8_t* p, uint32_t value) {
 
-//bt_addr_t mobileAddrSecondary = {.val = {0xB7, 0x14, 0x80, 0xB8, 0xB9, 0xEF}};
+    p = putLe16(p, value & 0xFFFF);
+    return putLe16(p, value >> 16);
+}
 
 /**
- * @brief   Callback for bluetooth scan
- * @param   addr:       Bluetooth address of scan result
- * @param   rssi:       RSSI strength of response
- * @param   adv_type:   Type of data sent
- * @param   vif:        Data buffer
+ * @brief   Decode a mobile node payload, account for it in the link 
+ *          statistics, and queue it to be sent over UART if it is new. 
+ *          Record: source (2), seq, uptime, age, N, N RSSIs, ultrasonic 
+ *          readings, hop statistics present, then lost and jitter of the
+ *          static to mobile hop per ultrasonic reading
+ * @param   buf:        Advertising data buffer
+ * @param   source:     Index of the mobile node the payload came from
  */
-static void staticCallback(const bt_addr_le_t* addr, int8_t rssi, 
-        uint8_t adv_type, struct net_buf_simple* buf) {
+static void mobileReport(struct net_buf_simple* buf, uint16_t source) {
 
-#ifdef FILTER_MOBILE
-    if (addressesEqual(addr->a, mobileAddrMobile)) {
+    const uint8_t* data;
+    uint8_t len;
+    MobilePayload payload;
+    uint8_t record[8 + PAYLOAD_MAX_ANCHORS + 4 * PAYLOAD_MAX_ULTRASONIC];
+    uint8_t* p = record;
 
-        // We have a message from our mobile node...
-        int8_t payload[PAYLOAD_SIZE];
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+    if (os_payloadFind(buf->data, buf->len, &data, &len) != 0 || 
+            os_payloadDecodeMobile(data, len, &payload) != 0) {
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET];
-        }
+        return;
+    }
 
-        // Make a message with the packet information, then send it over UART
-        char message[80];
-        sprintf(message, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", 
-                payload[0],   payload[1],   payload[2],   payload[3], 
-                payload[4],   payload[5],   payload[6],   payload[7],
-                payload[8],   payload[9],   payload[10],  payload[11],
-                payload[12],  payload[13],  payload[14],  0x00);
-        printf("%s", message);
+    // Mobile nodes repeat a payload until it changes, only send it once
+    if (!os_telemetryRecord(source, payload.seq, payload.uptime, payload.age,
+            k_uptime_get_32())) {
+
+        return;
     }
-#endif
-#ifdef FILTER_STATIC2
-    if (addressesEqual(addr->a, mobileAddrStatic2)) {
 
-        // We have a message from our mobile node...
-        int8_t payload[PAYLOAD_SIZE];
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+    p = putLe16(p, source);
+    *p++ = payload.seq;
+    p = putLe16(p, payload.uptime);
+    *p++ = payload.age;
+    *p++ = payload.numAnchors;
+    memcpy(p, payload.rssi, payload.numAnchors);
+    p += payload.numAnchors;
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET];
-        }
+        p = putLe16(p, payload.ultrasonic[i]);
+    }
+    *p++ = payload.hasHop;
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
 
-        // Make a message with the packet information, then send it over UART
-        char message[80];
-        sprintf(message, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", 
-                payload[0],   payload[1],   payload[2],   payload[3], 
-                payload[4],   payload[5],   payload[6],   payload[7],
-                payload[8],   payload[9],   payload[10],  payload[11],
-                payload[12],  payload[13],  payload[14],  0x01);
-        printf("%s", message);
+        *p++ = payload.hopLost[i];
+        *p++ = payload.hopJitter[i];
     }
-#endif
-#ifdef FILTER_DONGLE
-    if (addressesEqual(addr->a, mobileAddrDongle)) {
 
-        // We have a message from our mobile node...
-        int8_t payload[PAYLOAD_SIZE];
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+    os_uartFrameSend(UART_FRAME_MOBILE, record, p - record);
+}
+
+/**
+ * @brief   Queue the link statistics of every heard source, and our own UART
+ *          output counters, to be sent over UART. Stats record: source (2),
+ *          received, lost, jitter (ms << 4), age of information bins
+ */
+static void telemetryReport(void) {
+
+    TelemetrySource stats;
+    uint8_t record[2 + 4 * (3 + TELEMETRY_HIST_BINS)];
+
+    for (uint16_t i = 0; i < TELEMETRY_MAX_SOURCES; i++) {
+
+        os_telemetryGet(i, &stats);
+        if (!stats.seen) {
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET];
+            continue;
         }
 
-        // Make a message with the packet information, then send it over UART
-        char message[80];
-        sprintf(message, "%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", 
-                payload[0],   payload[1],   payload[2],   payload[3], 
-                payload[4],   payload[5],   payload[6],   payload[7],
-                payload[8],   payload[9],   payload[10],  payload[11],
-                payload[12],  payload[13],  payload[14],  0x02);
-        printf("%s", message);
+        uint8_t* p = record;
+        p = putLe16(p, i);
+        p = putLe32(p, stats.received);
+        p = putLe32(p, stats.lost);
+        p = putLe32(p, stats.jitter);
+        for (uint8_t j = 0; j < TELEMETRY_HIST_BINS; j++) {
+
+            p = putLe32(p, stats.aoi[j]);
+        }
+
+        os_uartFrameSendWait(UART_FRAME_STATS, record, p - record);
     }
-#endif
 
-/*
-    if (addressesEqual(addr->a, mobileAddrSecondary)) {
+    uint8_t* p = record;
+    p = putLe32(p, atomic_get(&os_uartFrameStats.sent));
+    p = putLe32(p, atomic_get(&os_uartFrameStats.dropped));
+    os_uartFrameSendWait(UART_FRAME_UART, record, p - record);
+}
 
-        // We have a message from the other mobile node...
-        uint8_t payload[PAYLOAD_SIZE];
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+/**
+ * @brief   Let the controller filter advertisers when the whole whitelist 
+ *          fits in its accept list (only while scanning is stopped)
+ * @param   params:     Scan parameters to set the options of
+ */
+static void scanFilter(struct bt_le_scan_param* params) {
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET - 4];
-        }
+    int hw = os_whitelistHwSync();
+    params->options = hw > 0 ? BT_LE_SCAN_OPT_FILTER_WHITELIST : 
+            BT_LE_SCAN_OPT_NONE;
+}
 
-        int8_t rssiList[] = {payload[8], payload[9], payload[10], payload[11],
-                             payload[4], payload[5], payload[6],  payload[7]};
+/**
+ * @brief   Queue the scan scheduler counters to be sent over UART. Record:
+ *          level, frames/s, frames, scan on ms, energy mJ, level changes
+ */
+static void scanReport(void) {
+
+    ScanStats scan;
+    uint8_t record[19];
+    uint8_t* p = record;
+
+    os_scanGetStats(&scan);
+    *p++ = scan.level;
+    p = putLe16(p, scan.framesPerSec);
+    p = putLe32(p, scan.frames);
+    p = putLe32(p, scan.scanOnMs);
+    p = putLe32(p, os_scanEnergyMj());
+    p = putLe32(p, scan.levelChanges);
+    os_uartFrameSendWait(UART_FRAME_SCAN, record, p - record);
+}
+
+/**
+ * @brief   Handle a command frame from the host (RX thread context). Every
+ *          command is answered with an ack record: command, status, count.
+ * @param   type:       Command type (UART_CMD_*)
+ * @param   payload:    Command payload
+ * @param   len:        Payload length
+ */
+static void commandHandler(uint8_t type, const uint8_t* payload, uint8_t len) {
+
+    bt_addr_le_t address;
+    uint16_t source;
+    int err = 0;
+
+    switch (type) {
+
+        case UART_CMD_WHITELIST_ADD:
+            if (len < 9) {
+
+                err = -EINVAL;
+                break;
+            }
+            address.type = payload[0];
+            memcpy(address.a.val, &payload[1], sizeof(address.a.val));
+            err = os_whitelistAdd(&address, payload[7] | (payload[8] << 8));
+            break;
+
+        case UART_CMD_WHITELIST_REMOVE:
+            if (len < 6) {
+
+                err = -EINVAL;
+                break;
+            }
+            memcpy(address.a.val, payload, sizeof(address.a.val));
+            err = os_whitelistRemove(&address.a);
+            break;
+
+        case UART_CMD_WHITELIST_CLEAR:
+            os_whitelistClear();
+            break;
+
+        case UART_CMD_WHITELIST_LIST:
+            for (uint16_t n = 0; os_whitelistGet(n, &address, &source) == 0;
+                    n++) {
+
+                uint8_t record[9];
+                record[0] = address.type;
+                memcpy(&record[1], address.a.val, sizeof(address.a.val));
+                putLe16(&record[7], source);
+                os_uartFrameSendWait(UART_FRAME_WHITELIST, record, 
+                        sizeof(record));
+            }
+            break;
+
+        default:
+            err = -ENOTSUP;
+            break;
+    }
+
+    // The controller list only needs redoing if the list changed
+    if (err == 0 && type != UART_CMD_WHITELIST_LIST) {
+
+        err = os_scanRestart(scanFilter);
+    }
+
+    uint8_t ack[4] = {type, (uint8_t)(int8_t)err};
+    putLe16(&ack[2], os_whitelistCount());
+    os_uartFrameSendWait(UART_FRAME_ACK, ack, sizeof(ack));
+}
+
+/**
+ * @brief   Callback for bluetooth scan
+ * @param   addr:       Bluetooth address of scan result
+ * @param   rssi:       RSSI strength of response
+ * @param   adv_type:   Type of data sent
+ * @param   vif:        Data buffer
+ */
+static void staticCallback(const bt_addr_le_t* addr, int8_t rssi, 
+        uint8_t adv_type, struct net_buf_simple* buf) {
 
-        char message[80];
-        sprintf(message, "%i,%i,%i,%i,%i,%i,%i,%i,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
-                rssiList[4],  rssiList[5],  rssiList[6],  rssiList[7], 
-                rssiList[0],  rssiList[1],  rssiList[2],  rssiList[3],
-                payload[12],  payload[13],  payload[14],  payload[15],
-                payload[8],   payload[9],   payload[10],  payload[11],
-                1);
-        printf("%s", message);
+    // Only whitelisted mobile nodes are forwarded
+    int source = os_whitelistLookup(&addr->a);
+    if (source < 0) {
 
+        return;
     }
-*/
 
+    atomic_inc(&scanFrames);
+    mobileReport(buf, source);
 }
 
 void main(void) {
 
-    // Set up parameters for scan
-	struct bt_le_scan_param scanParams = {
-		.type       = BT_HCI_LE_SCAN_PASSIVE,
-		.options    = BT_LE_SCAN_OPT_NONE,
-		.interval   = 0x0005,
-		.window     = 0x0005,
-	};
 	int err;
 
-    // Bind USB UART
-    device_get_binding(CONFIG_UART_CONSOLE_ON_DEV_NAME);
+    // Bind USB UART, records are sent over it as binary frames
+    const struct device* uart = device_get_binding(UART_FRAME_DEV_NAME);
 
     if (usb_enable(NULL)) {
 
         return;
     }
 
+    if (os_uartFrameInit(uart, commandHandler)) {
+
+        return;
+    }
+
     k_sleep(K_MSEC(5000));
 
 	// Initialize the Bluetooth Subsystem
@@ -167,16 +337,38 @@ void main(void) {
 		return;
 	}
 
-	err = bt_le_scan_start(&scanParams, staticCallback);
+    os_telemetryInit();
+
+    os_whitelistInit();
+    for (uint8_t i = 0; i < ARRAY_SIZE(defaultMobiles); i++) {
+
+        os_whitelistAdd(&defaultMobiles[i].address, defaultMobiles[i].source);
+    }
+
+    scanFilter(&scanParams);
+	err = os_scanStart(&scanParams, staticCallback);
 	if (err) {
 
 		return;
 	}
 
-    // We have started scanning, now sit and do nothing forever :)
+    // We have started scanning, now just adapt scanning and report link
+    // statistics forever :)
+    uint32_t lastReport = k_uptime_get_32();
     while (1) {
 
-        k_sleep(K_MSEC(1));
+        k_sleep(K_MSEC(SCAN_EPOCH_MS));
+
+        uint32_t now = k_uptime_get_32();
+        // A failed scan restart is retried on the next tick, nothing is
+        // printed as the UART carries binary frames
+        os_scanTick(now, atomic_get(&scanFrames));
 
+        if (now - lastReport >= TELEMETRY_REPORT_MS) {
+
+            lastReport = now;
+            telemetryReport();
+            scanReport();
+        }
     }
 }
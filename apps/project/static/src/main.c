@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <zephyr.h>
 #include <zephyr/types.h>
 #include <stddef.h>
 #include <sys/printk.h>
@@ -17,6 +18,9 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 
+#include <os_advertise.h>
+#include <os_payload.h>
+
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
 
@@ -25,58 +29,41 @@
 						                    BT_GAP_ADV_FAST_INT_MAX_1, \
 						                    NULL)
 #ifdef ULTRASONIC_ID
+#include <hal_ultrasonic.h>
 
-#define     US_CONVERT  35                                                      
-#define     TIMEOUT     50000                                                   
-                                                                                
-#define TRIGGER_NODE DT_ALIAS(trigger)                                          
-#if DT_NODE_HAS_STATUS(TRIGGER_NODE, okay)                                      
-#define TRIGGER DT_GPIO_LABEL(TRIGGER_NODE, gpios)                              
-#define TRIGGER_PIN DT_GPIO_PIN(TRIGGER_NODE, gpios)                            
-#define TRIGGER_FLAGS   DT_GPIO_FLAGS(TRIGGER_NODE, gpios)                      
-#else                                                                           
-/* A build error here means your board isn't set up to blink an LED. */         
-#ifdef FAIL_CATASTROPHICALLY
-#error "Trigger pin not set up"                                                 
-#endif // FAIL_CATASTROPHICALLY
-#define TRIGGER ""                                                              
-#define TRIGGER_PIN 0                                                           
-#define TRIGGER_FLAGS   0                                                       
-#endif                                                                          
-                                                                                
-#define ECHO_NODE DT_ALIAS(echo)                                                
-#if DT_NODE_HAS_STATUS(ECHO_NODE, okay)                                         
-#define ECHO    DT_GPIO_LABEL(ECHO_NODE, gpios)                                 
-#define ECHO_PIN    DT_GPIO_PIN(ECHO_NODE, gpios)                               
-#define ECHO_FLAG   DT_GPIO_FLAGS(ECHO_NODE, gpios)                             
-#else                                                                           
-/* A build error here means your board isn't set up to blink an LED. */         
+// Time between readings, and between payload updates (ms)
+#define US_PERIOD   CONFIG_ULTRASONIC_SAMPLE_PERIOD_MS
+#define ADV_PERIOD  30
+
+#if !DT_NODE_HAS_STATUS(DT_ALIAS(trigger), okay) || \
+        !DT_NODE_HAS_STATUS(DT_ALIAS(echo), okay)
 #ifdef FAIL_CATASTROPHICALLY
-#error "Echo pin not set up"                                                    
+#error "Trigger or echo pin not set up"
 #endif // FAIL_CATASTROPHICALLY
-#define ECHO    ""                                                              
-#define ECHO_PIN    0                                                           
-#define ECHO_FLAG   0                                                           
 #endif
 
 #endif // ULTRASONIC_ID
 
-// Device pointers corresponding to ultrasonic sensor
-const struct device *trig;
-const struct device *ech;
-
-// Initial advertising structure, will be overriden in cyclic executive
-static const struct bt_data new_ad[] = {
-    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-    BT_DATA_BYTES(BT_DATA_UUID16_ALL, 0xAA, 0xFE),
-    BT_DATA_BYTES(BT_DATA_SVC_DATA16,
-            0xAA, 0xFE,     // Eddystone UUID
-            0x00,           // Eddystone UID frame type
-            0x00,           // Calibrated Tx power at 0m
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00)
-};
+// Advertised payload
+#ifdef ULTRASONIC_ID
+static StaticPayload staticPayload = {.seq = 0, .nodeId = ULTRASONIC_ID, 
+        .ultrasonic = PAYLOAD_US_NONE};
+#else
+static StaticPayload staticPayload = {.seq = 0, .nodeId = 0, 
+        .ultrasonic = PAYLOAD_US_NONE};
+#endif  // ULTRASONIC_ID
+static uint8_t payload[ADV_SERVICE_DATA_MAX];
+
+// We have to use default parameters for the disco board since it doesn't 
+// support the faster advertising frequency
+#ifndef ULTRASONIC_ID
+#define STATIC_ADV_PARAM    BT_LE_FASTER_ADV
+#else
+#define STATIC_ADV_PARAM    BT_LE_ADV_NCONN_IDENTITY
+#endif  // ULTRASONIC_ID
+
+// Given once advertising has started
+K_SEM_DEFINE(btReady, 0, 1);
 
 /* Set Scan Response data */
 static const struct bt_data sd[] = {
@@ -97,20 +84,15 @@ static void bt_ready(int err)
 	printk("Bluetooth initialized\n");
 
 	// Start advertising
-    // We have to use default parameters for the disco board since it doesn't 
-    // support the faster advertising frequency
-#ifndef ULTRASONIC_ID
-	err = bt_le_adv_start(BT_LE_FASTER_ADV, new_ad, ARRAY_SIZE(new_ad),
-	        sd, ARRAY_SIZE(sd));
-#else
-    err = bt_le_adv_start(BT_LE_ADV_NCONN_IDENTITY, new_ad, ARRAY_SIZE(new_ad),
-            sd, ARRAY_SIZE(sd));
-#endif  // ULTRASONIC_ID
+	err = os_payloadEncodeStatic(&staticPayload, payload, sizeof(payload));
+	err = os_advertiseStart(STATIC_ADV_PARAM, payload, err, sd, 
+	        ARRAY_SIZE(sd));
 	if (err) {
 		printk("Advertising failed to start (err %d)\n", err);
 		return;
 	}
 
+	k_sem_give(&btReady);
 
 	/* For connectable advertising you would use
 	 * bt_le_oob_get_local().  For non-connectable non-identity
@@ -124,6 +106,37 @@ static void bt_ready(int err)
 	printk("Beacon started, advertising as %s\n", addr_s);
 }
 
+#ifdef ULTRASONIC_ID
+/**
+ * @brief   Advertise the latest filtered ultrasonic reading, if it changed
+ */
+static void us_advertise(void) {
+
+    UltrasonicSample sample;
+
+    if (hal_ultrasonic_get_latest(&sample) != 0) {
+
+        return;
+    }
+
+    // New readings get a new sequence number, kept only once on air so a
+    // failed update is retried with the next sample
+    if (sample.echoUs != staticPayload.ultrasonic) {
+
+        StaticPayload next = staticPayload;
+        next.seq++;
+        next.ultrasonic = sample.echoUs;
+        next.uptime = sample.time & 0xFFFF;
+
+        int len = os_payloadEncodeStatic(&next, payload, sizeof(payload));
+        if (len > 0 && os_advertiseUpdate(payload, len) == 0) {
+
+            staticPayload = next;
+        }
+    }
+}
+#endif  // ULTRASONIC_ID
+
 void main(void)
 {
 	int err;
@@ -137,62 +150,27 @@ void main(void)
 	}
 
 #ifdef ULTRASONIC_ID
-    trig = device_get_binding(TRIGGER);                                           
-    ech = device_get_binding(ECHO);                                               
-    double dist;                                                                  
-    gpio_config(trig, TRIGGER_PIN, GPIO_OUTPUT_ACTIVE);                           
-    gpio_config(ech, ECHO_PIN, GPIO_INPUT);                                       
-    uint16_t pulseTime;                                                           
-    gpio_pin_set(trig, TRIGGER_PIN, 0);                                           
-    k_usleep(5);
+    err = hal_ultrasonic_init();
+    if (!err) {
+        err = hal_ultrasonic_sampleStart(US_PERIOD);
+    }
+    if (err) {
+        printk("Ultrasonic init failed (err %d)\n", err);
+    }
 #endif // ULTRASONIC_ID
 
-    while (1) {
+    // Payload only changes once advertising is running
+    k_sem_take(&btReady, K_FOREVER);
 
 #ifdef ULTRASONIC_ID
+    // Sampling runs in the driver's thread, the payload just follows it
+    while (1) {
 
-    gpio_pin_set(trig, TRIGGER_PIN, 1);                                         
-    k_usleep(10);                                                               
-    gpio_pin_set(trig, TRIGGER_PIN, 0);                                         
-                                                                                
-    while(!(gpio_pin_get(ech, ECHO_PIN))) {                                     
-    }                                                                           
-    pulseTime = 0;                                                              
-    while (gpio_pin_get(ech, ECHO_PIN)) {                                       
-      pulseTime++;                                                              
-      k_usleep(1);                                                              
-    }                                                                           
-    dist = (((double) pulseTime) / US_CONVERT);
-
-#endif // ULTRASONIC_ID
-
-        err = bt_le_adv_stop();
-
-        const struct bt_data temp_ad[] = {
-                BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-                BT_DATA_BYTES(BT_DATA_UUID16_ALL, 0xAA, 0xFE),    
-                BT_DATA_BYTES(BT_DATA_SVC_DATA16,
-                        0xAA, 0xFE,     // Eddystone UUID
-                        0x00,           // Eddystone UID frame type
-                        0x00,           // Calibrated Tx power at 0m
-#ifdef ULTRASONIC_ID
-                        0xF0, 0xBA, ULTRASONIC_ID, (uint8_t)((pulseTime & 0xFF00) >> 8), (uint8_t)pulseTime & 0xFF, 
-#else
-                        0x00, 0x00, 0x00, 0x00, 0x00,
+        us_advertise();
+        k_sleep(K_MSEC(ADV_PERIOD));
+    }
 #endif  // ULTRASONIC_ID
-                        0x00, 0x00, 0x00, 0x00, 0x00,
-                        0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-                        0x00, 0x00)
-        };
-
 
-
-#ifndef ULTRASONIC_ID
-        err = bt_le_adv_start(BT_LE_FASTER_ADV, temp_ad, ARRAY_SIZE(temp_ad), sd, ARRAY_SIZE(sd));
-#else
-        err = bt_le_adv_start(BT_LE_ADV_NCONN_IDENTITY, temp_ad, 
-                ARRAY_SIZE(temp_ad), sd, ARRAY_SIZE(sd));
-#endif  // ULTRASONIC_ID
-        k_sleep(K_MSEC(30));
-    }
+    // Non-ultrasonic static nodes advertise a fixed payload, advertising
+    // carries on without us
 }
@@ -0,0 +1,209 @@
+## Decoder for the base node's binary UART output - host side mirror of
+## myoslib/src/os_uartframe.c. Frames are COBS([type] [payload] [CRC16 LE])
+## followed by a 0x00 delimiter.
+##
+## Usage: python3 uart_frames.py /dev/ttyACM0 [add ADDR SOURCE | remove ADDR |
+##                                             clear | list]
+
+import struct
+import sys
+
+UART_FRAME_MOBILE = 0x01
+UART_FRAME_STATS = 0x02
+UART_FRAME_UART = 0x03
+UART_FRAME_ACK = 0x04
+UART_FRAME_WHITELIST = 0x05
+UART_FRAME_SCAN = 0x06
+
+UART_CMD_WHITELIST_ADD = 0x10
+UART_CMD_WHITELIST_REMOVE = 0x11
+UART_CMD_WHITELIST_CLEAR = 0x12
+UART_CMD_WHITELIST_LIST = 0x13
+
+BT_ADDR_LE_PUBLIC = 0
+BT_ADDR_LE_RANDOM = 1
+
+TELEMETRY_HIST_BINS = 8
+TELEMETRY_HIST_BASE_MS = 16
+
+PAYLOAD_AGE_UNIT_MS = 4
+PAYLOAD_US_NONE = 0xFFFF
+
+
+def crc16_ccitt(data, seed=0):
+    """Zephyr's crc16_ccitt (reflected 0x1021)"""
+    crc = seed
+    for b in data:
+        e = (crc ^ b) & 0xFF
+        f = (e ^ (e << 4)) & 0xFF
+        crc = ((crc >> 8) ^ (f << 8) ^ (f << 3) ^ (f >> 4)) & 0xFFFF
+    return crc
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("bad COBS frame")
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def cobs_encode(data):
+    out = bytearray([0])
+    code = 0
+    for b in data:
+        if b != 0:
+            out.append(b)
+        if b == 0 or len(out) - code == 0xFF:
+            out[code] = len(out) - code
+            code = len(out)
+            out.append(0)
+    out[code] = len(out) - code
+    return bytes(out)
+
+
+def encode_frame(rtype, payload=b""):
+    """Frame a record or command for the wire, delimiter included"""
+    raw = bytes([rtype]) + bytes(payload)
+    return cobs_encode(raw + struct.pack("<H", crc16_ccitt(raw))) + b"\x00"
+
+
+def address_bytes(address):
+    """'E1:38:D4:CD:DE:AF' -> bytes in bt_addr_t order (least significant
+    first)"""
+    return bytes(reversed(bytes.fromhex(address.replace(":", ""))))
+
+
+def address_string(data):
+    return ":".join("%02X" % b for b in reversed(data))
+
+
+def whitelist_add(address, source, addr_type=BT_ADDR_LE_RANDOM):
+    return encode_frame(UART_CMD_WHITELIST_ADD, bytes([addr_type]) +
+                        address_bytes(address) + struct.pack("<H", source))
+
+
+def whitelist_remove(address):
+    return encode_frame(UART_CMD_WHITELIST_REMOVE, address_bytes(address))
+
+
+def whitelist_clear():
+    return encode_frame(UART_CMD_WHITELIST_CLEAR)
+
+
+def whitelist_list():
+    return encode_frame(UART_CMD_WHITELIST_LIST)
+
+
+def parse_record(rtype, payload):
+    """Decode a record into a dict, or None for unknown types"""
+    if rtype == UART_FRAME_MOBILE:
+        source, seq, uptime, age, n = struct.unpack_from("<HBHBB", payload)
+        rssi = list(struct.unpack_from("<%db" % n, payload, 7))
+        us = [None if u == PAYLOAD_US_NONE else u
+              for u in struct.unpack_from("<2H", payload, 7 + n)]
+        has_hop, *hop = struct.unpack_from("<5B", payload, 11 + n)
+        ## Static to mobile hop (lost, wrapping, and jitter) per reading
+        hop = ([None if u is None else {"lost": lost, "jitter_ms": jitter}
+                for u, lost, jitter in zip(us, hop[0::2], hop[1::2])]
+               if has_hop else None)
+        return {"type": "mobile", "source": source, "seq": seq,
+                "uptime": uptime, "age_ms": age * PAYLOAD_AGE_UNIT_MS,
+                "rssi": rssi, "ultrasonic": us, "hop": hop}
+    if rtype == UART_FRAME_STATS:
+        fields = struct.unpack_from("<H%dI" % (3 + TELEMETRY_HIST_BINS), payload)
+        source, received, lost, jitter = fields[:4]
+        total = received + lost
+        return {"type": "stats", "source": source, "received": received,
+                "lost": lost, "loss_pct": 100.0 * lost / total if total else 0.0,
+                "jitter_ms": jitter / 16.0,
+                "aoi_bins_ms": [TELEMETRY_HIST_BASE_MS << i
+                                for i in range(TELEMETRY_HIST_BINS - 1)],
+                "aoi": list(fields[4:])}
+    if rtype == UART_FRAME_UART:
+        sent, dropped = struct.unpack_from("<2I", payload)
+        return {"type": "uart", "sent": sent, "dropped": dropped}
+    if rtype == UART_FRAME_ACK:
+        command, status, count = struct.unpack_from("<BbH", payload)
+        return {"type": "ack", "command": command, "status": status,
+                "count": count}
+    if rtype == UART_FRAME_SCAN:
+        level, fps, frames, on_ms, energy, changes = struct.unpack_from("<BHIIII", payload)
+        return {"type": "scan", "level": level, "frames_per_sec": fps,
+                "frames": frames, "scan_on_ms": on_ms, "energy_mj": energy,
+                "level_changes": changes}
+    if rtype == UART_FRAME_WHITELIST:
+        addr_type, = struct.unpack_from("<B", payload)
+        source, = struct.unpack_from("<H", payload, 7)
+        return {"type": "whitelist", "address": address_string(payload[1:7]),
+                "addr_type": addr_type, "source": source}
+    return None
+
+
+class FrameDecoder:
+    """Feed raw bytes in, get decoded records out. Frames that fail COBS or
+    CRC checks (e.g. console text mixed into the stream) are counted and
+    skipped, the decoder resynchronises on the next 0x00."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.frames = 0
+        self.errors = 0
+
+    def feed(self, data):
+        self.buffer += data
+        records = []
+        while True:
+            end = self.buffer.find(b"\x00")
+            if end < 0:
+                break
+            frame = bytes(self.buffer[:end])
+            del self.buffer[:end + 1]
+            if not frame:
+                continue
+            try:
+                raw = cobs_decode(frame)
+                if len(raw) < 3 or crc16_ccitt(raw[:-2]) != struct.unpack("<H", raw[-2:])[0]:
+                    raise ValueError("bad CRC")
+                record = parse_record(raw[0], raw[1:-2])
+            except (ValueError, struct.error):
+                self.errors += 1
+                continue
+            self.frames += 1
+            if record is not None:
+                records.append(record)
+        return records
+
+
+def read_records(stream, chunk=256):
+    """Generator of decoded records from a file-like byte stream"""
+    decoder = FrameDecoder()
+    while True:
+        data = stream.read(chunk)
+        if not data:
+            return
+        for record in decoder.feed(data):
+            yield record
+
+
+if __name__ == "__main__":
+    import serial
+    port = serial.Serial(sys.argv[1], 115200, timeout=1)
+    commands = {
+        "add": lambda a: whitelist_add(a[0], int(a[1])),
+        "remove": lambda a: whitelist_remove(a[0]),
+        "clear": lambda a: whitelist_clear(),
+        "list": lambda a: whitelist_list(),
+    }
+    if len(sys.argv) > 2:
+        port.write(commands[sys.argv[2]](sys.argv[3:]))
+    decoder = FrameDecoder()
+    while True:
+        for record in decoder.feed(port.read(port.in_waiting or 1)):
+            print(record)
@@ -0,0 +1,67 @@
+## Local stand-in for the dashboard's data API, for testing the uploader.
+## Accepts POSTed JSON record lists like tago's /data endpoint, and can be
+## made slow or unreliable to exercise buffering and backoff.
+##
+##   python upload_stub.py [--port N] [--fail FRACTION] [--delay SECONDS]
+##   python gui.py --upload-url http://localhost:8000/data
+
+import argparse
+import json
+import random
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class StubHandler(BaseHTTPRequestHandler):
+    fail = 0.0
+    delay = 0.0
+    received = 0
+
+    def _reply(self, code, body):
+        data = json.dumps(body).encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        time.sleep(self.delay)
+        if random.random() < self.fail:
+            self._reply(503, {"status": False, "message": "stub failure"})
+            return
+        try:
+            records = json.loads(body)
+        except ValueError:
+            self._reply(400, {"status": False, "message": "bad JSON"})
+            return
+        StubHandler.received += len(records)
+        print("%d records (%d total), first %s" % (
+            len(records), StubHandler.received,
+            records[0] if records else None))
+        self._reply(200, {"status": True,
+                          "result": "%d added" % len(records)})
+
+    def log_message(self, format, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Dashboard API stub")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--fail", type=float, default=0.0,
+                        help="fraction of requests answered 503")
+    parser.add_argument("--delay", type=float, default=0.0,
+                        help="seconds before each answer")
+    args = parser.parse_args()
+
+    StubHandler.fail = args.fail
+    StubHandler.delay = args.delay
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), StubHandler)
+    print("listening on http://127.0.0.1:%d/data" % args.port)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,196 @@
+## Dashboard uploader stage - tracking hands it the latest locations without
+## blocking, and its own thread batches every tag's position once per
+## interval into a buffer on disk, then sends the buffer with retry and
+## backoff. Records survive upload failures and restarts, so a slow or down
+## dashboard never stalls tracking or loses positions.
+##
+## device is anything with tago.Device's insert(list of records) -> {
+## "status": bool, "result" or "message"}, e.g. HttpDevice below pointed at
+## upload_stub.py for testing.
+
+import json
+import os
+import random
+import threading
+import time
+import urllib.request
+from datetime import datetime, timezone
+
+## Seconds between batches of positions
+UPLOAD_INTERVAL = 60
+## Least seconds between requests, retries included
+UPLOAD_MIN_GAP = 1.0
+## Records sent per request
+UPLOAD_BATCH = 500
+## Records kept on disk, the oldest are dropped past this
+UPLOAD_MAX_RECORDS = 100000
+## Retry backoff, doubling from the first to the most seconds
+BACKOFF_FIRST = 2.0
+BACKOFF_MAX = 300.0
+
+BUFFER = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      "upload_buffer.jsonl")
+
+
+class HttpDevice:
+    """Posts records as JSON to url, answering like tago.Device.insert()"""
+
+    def __init__(self, url, token=None, timeout=10):
+        self.url = url
+        self.token = token
+        self.timeout = timeout
+
+    def insert(self, data):
+        request = urllib.request.Request(
+            self.url, data=json.dumps(data).encode(), method="POST",
+            headers={"Content-Type": "application/json"})
+        if self.token:
+            request.add_header("Device-Token", self.token)
+        try:
+            with urllib.request.urlopen(request, timeout=self.timeout) as r:
+                return json.loads(r.read() or b"{}") or {"status": True}
+        except (OSError, ValueError) as e:
+            return {"status": False, "message": str(e)}
+
+
+class RecordBuffer:
+    """Records waiting to be sent, appended to a JSON lines file and
+    rewritten when records leave"""
+
+    def __init__(self, path=BUFFER, max_records=UPLOAD_MAX_RECORDS):
+        self.path = path
+        self.max_records = max_records
+        self.records = []
+        self.dropped = 0
+        if os.path.exists(path):
+            with open(path) as f:
+                for line in f:
+                    try:
+                        self.records.append(json.loads(line))
+                    except ValueError:
+                        self.dropped += 1     ## torn write at a crash
+        self._trim()
+
+    def _trim(self):
+        excess = len(self.records) - self.max_records
+        if excess > 0:
+            del self.records[:excess]
+            self.dropped += excess
+            self._rewrite()
+
+    def _rewrite(self):
+        temp = self.path + ".tmp"
+        with open(temp, "w") as f:
+            for record in self.records:
+                f.write(json.dumps(record) + "\n")
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(temp, self.path)
+
+    def append(self, records):
+        with open(self.path, "a") as f:
+            for record in records:
+                f.write(json.dumps(record) + "\n")
+            f.flush()
+            os.fsync(f.fileno())
+        self.records.extend(records)
+        self._trim()
+
+    def remove(self, count):
+        del self.records[:count]
+        self._rewrite()
+
+    def __len__(self):
+        return len(self.records)
+
+
+class Uploader:
+    """Uploads the latest location of every tag once per interval"""
+
+    def __init__(self, device, path=BUFFER, interval=UPLOAD_INTERVAL,
+                 min_gap=UPLOAD_MIN_GAP, batch=UPLOAD_BATCH):
+        self.device = device
+        self.buffer = RecordBuffer(path)
+        self.interval = interval
+        self.min_gap = min_gap
+        self.batch = batch
+        self.sent = 0
+        self.failures = 0
+        self.last_error = None
+        self._latest = None
+        self._queued = None
+        self._wake = threading.Event()
+        self._running = False
+        self._thread = None
+
+    def submit(self, locations):
+        """Latest {tag: (x, y)}, never blocks - only the newest locations at
+        each interval are uploaded"""
+        self._latest = locations
+
+    def start(self):
+        self._running = True
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        self._running = False
+        self._wake.set()
+
+    def _batch(self):
+        """Queue the latest locations as records, if they changed"""
+        locations = self._latest
+        if not locations or locations is self._queued:
+            return
+        self._queued = locations
+        now = datetime.now(timezone.utc).isoformat()
+        self.buffer.append([{
+            "variable": "Mobile" + str(tag),
+            "value": [x, y],
+            "time": now,
+        } for tag, (x, y) in sorted(locations.items())])
+
+    def _send(self):
+        """Send one request of buffered records, True if it was accepted"""
+        records = self.buffer.records[:self.batch]
+        try:
+            result = self.device.insert(records)
+        except Exception as e:      ## client libraries raise anything
+            result = {"status": False, "message": str(e)}
+        if not result.get("status"):
+            self.failures += 1
+            self.last_error = result.get("message")
+            return False
+        self.buffer.remove(len(records))
+        self.sent += len(records)
+        return True
+
+    def _run(self):
+        next_batch = time.monotonic() + self.interval
+        next_send = 0.0
+        backoff = 0.0
+        while self._running:
+            now = time.monotonic()
+            if now >= next_batch:
+                self._batch()
+                next_batch = now + self.interval
+            if len(self.buffer) and now >= next_send:
+                if self._send():
+                    backoff = 0.0
+                    next_send = now + self.min_gap
+                else:
+                    ## Full jitter keeps restarted hosts from retrying
+                    ## together
+                    backoff = min(BACKOFF_MAX, max(BACKOFF_FIRST,
+                                                   2 * backoff))
+                    next_send = now + max(self.min_gap,
+                                          random.uniform(0, backoff))
+            wake = min(next_batch, next_send) if len(self.buffer) \
+                else next_batch
+            self._wake.wait(max(0.0, wake - time.monotonic()))
+            self._wake.clear()
+
+    def summary(self):
+        return "upload %d sent, %d buffered, %d dropped, %d failures%s" % (
+            self.sent, len(self.buffer), self.buffer.dropped, self.failures,
+            " (%s)" % self.last_error if self.last_error else "")
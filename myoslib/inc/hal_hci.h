@@ -3,13 +3,15 @@
 * @file myoslib/src/hal_hci.c
 * @author Desmond Gan - S4526441
 * @date 14042021
-* @brief shell log driver
-* REFERENCE: 
+* @brief HCI transport over SPI
+* REFERENCE:
 ***************************************************************
 * EXTERNAL FUNCTIONS
 ***************************************************************
 * hal_hci_master_init()  - Initialise HCI master
 * hal_hci_slave_init() - Initialise HCI slave
+* hal_hci_request(uint8_t* msg, HciCallback callback, void* arg) - Send a request, callback gets the response
+* hal_hci_request_sync(uint8_t* msg, uint8_t* resp, k_timeout_t timeout) - Send a request and wait for the response
 * hal_hci_transmit(uint8_t* trsmtMsg) -  Write via SPI
 * hal_hci_receive() - Receive from SPI
 ***************************************************************
@@ -21,15 +23,35 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <zephyr.h>
 
-#define SPI_BUFFER 10
+#define SPI_BUFFER 32
+
+// Frame layout shared by every packet, the last byte carries the sequence
+// ID that matches a response to its request (0 = none)
+#define HCI_PREAMBLE        0xAA
+#define HCI_TYPE_REQUEST    1
+#define HCI_TYPE_RESPONSE   2
+#define HCI_TYPE_BATCH      3
+#define HCI_SEQ_INDEX       (SPI_BUFFER - 1)
+
+// Requests that can wait for a response at once
+#define HCI_MAX_INFLIGHT    4
+
+// Longest wait for a response, the slave may take a sensor reading first
+#define HCI_TIMEOUT_MS      200
+
+// Called from the HCI thread with the response (NULL if err is not 0)
+typedef void (*HciCallback)(int err, const uint8_t* resp, void* arg);
 
 extern uint8_t rxBuffer[SPI_BUFFER];
-extern uint8_t tx_buffer[SPI_BUFFER];
 
 extern void hal_hci_master_init();
 extern void hal_hci_slave_init();
-extern void hal_hci_transmit(uint8_t *trsmtMsg);
-extern void hal_hci_receive();
+extern int hal_hci_request(uint8_t* msg, HciCallback callback, void* arg);
+extern int hal_hci_request_sync(uint8_t* msg, uint8_t* resp,
+        k_timeout_t timeout);
+extern int hal_hci_transmit(uint8_t *trsmtMsg);
+extern int hal_hci_receive();
 
-#endif
\ No newline at end of file
+#endif
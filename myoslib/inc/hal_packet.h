@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include "hal_hci.h"
 
 struct Packet {
     uint8_t preamb;
@@ -44,6 +45,19 @@ struct Packetback {
     uint8_t d6;
 };
 
+// Batch request: count then (i2c_addr, reg_addr, length) per operation.
+// Response: total length, operations done, then the data of each in order.
+#define HCI_BATCH_OPS       3
+#define HCI_BATCH_DATA      4
+#define HCI_BATCH_MAX_OPS   ((HCI_SEQ_INDEX - HCI_BATCH_OPS) / 3)
+#define HCI_BATCH_MAX_DATA  (HCI_SEQ_INDEX - HCI_BATCH_DATA)
+
+struct BatchOp {
+    uint8_t i2c_addr;
+    uint8_t reg_addr;
+    uint8_t length;
+};
+
 struct UsPacket {
     uint8_t preamb;
     uint8_t type;
@@ -52,12 +66,22 @@ struct UsPacket {
     uint8_t data[2];
 };
 
+extern void hal_build_request(uint8_t* msg, uint8_t sid, size_t argc,
+        char** argv, uint8_t pac_type);
+extern void hal_build_lsm_request(uint8_t* msg, uint8_t axis);
 extern void hal_parse_to_spi(uint8_t sid, size_t argc, char** argv, uint8_t device);
 extern struct Packet hal_parse_from_spi(uint8_t *msg);
 extern void hal_slave_to_master(uint8_t mode, uint8_t* data);
 extern struct Packetback hal_master_from_slave(uint8_t *msg);
 extern void hal_lsmx_slave_to_master(uint8_t mode, uint8_t* data);
+extern int hal_build_batch(uint8_t* msg, const struct BatchOp* ops,
+        uint8_t count);
+extern uint8_t hal_parse_batch(uint8_t* msg, struct BatchOp* ops);
+extern void hal_batch_slave_to_master(uint8_t done, uint8_t* data,
+        uint8_t length);
 
+extern void hal_build_spi(uint8_t* msg, uint8_t sid, uint16_t data,
+        uint8_t type);
 extern void hal_parse_spi(uint8_t sid, uint16_t data, uint8_t type);
 extern struct UsPacket hal_unparse_spi(uint8_t *msg);
 
@@ -1,7 +1,73 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/hal_ultrasonic.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Interrupt driven ultrasonic ranging driver (HC-SR04 style
+ *                  trigger and echo pins, devicetree aliases "trigger" and
+ *                  "echo")
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * hal_ultrasonic_init()        - Set up the trigger and echo pins
+ * hal_ultrasonic_calibrate()   - Set the speed of sound and echo offset
+ * hal_ultrasonic_start()       - Start a reading, the callback gets it
+ * hal_ultrasonic_read()        - Take a reading, blocking until it is done
+ * hal_ultrasonic_sampleStart() - Start the background sampling thread
+ * hal_ultrasonic_sampleStop()  - Stop the background sampling thread
+ * hal_ultrasonic_get_latest()  - Latest filtered reading, never blocks
+ * hal_ultrasonic_history()     - Copy the raw readings in the ring buffer
+ ******************************************************************************
+ */
+
 #ifndef HAL_ULTRASONIC_H
 #define HAL_ULTRASONIC_H
 
-void hal_ultrasonic_init();
-uint16_t hal_ultrasonic_read();
+#include <zephyr/types.h>
+
+// Defaults for builds without the static node Kconfig
+#ifndef CONFIG_ULTRASONIC_SAMPLE_PERIOD_MS
+#define CONFIG_ULTRASONIC_SAMPLE_PERIOD_MS  60
+#endif
+#ifndef CONFIG_ULTRASONIC_RING_LEN
+#define CONFIG_ULTRASONIC_RING_LEN          16
+#endif
+#ifndef CONFIG_ULTRASONIC_FILTER_LEN
+#define CONFIG_ULTRASONIC_FILTER_LEN        5
+#endif
+#ifndef CONFIG_ULTRASONIC_HAMPEL_K
+#define CONFIG_ULTRASONIC_HAMPEL_K          3
+#endif
+
+// Echo time of a reading that failed (matches PAYLOAD_US_NONE)
+#define HAL_ULTRASONIC_NONE         0xFFFF
+
+// Speed of sound at 20 C (mm/s), the default calibration
+#define HAL_ULTRASONIC_SOUND_MM_S   343000
+
+// Called from the system work queue once a reading is done. err is 0, or
+// -ETIMEDOUT if no echo ended in time (echoUs is then HAL_ULTRASONIC_NONE).
+typedef void (*UltrasonicCallback)(int err, uint16_t echoUs,
+        uint16_t distanceMm);
+
+// A sampled reading. Raw readings that failed have echoUs
+// HAL_ULTRASONIC_NONE; filtered readings flag whether the raw reading was
+// replaced by the window median.
+typedef struct {
+    uint16_t    echoUs;
+    uint16_t    distanceMm;
+    uint32_t    time;           // Uptime of the reading (ms)
+    uint8_t     outlier;
+} UltrasonicSample;
+
+// Function prototypes - more detailed top comments in source file
+int hal_ultrasonic_init(void);
+void hal_ultrasonic_calibrate(uint32_t, uint16_t);
+int hal_ultrasonic_start(UltrasonicCallback);
+uint16_t hal_ultrasonic_read(void);
+int hal_ultrasonic_sampleStart(uint16_t);
+void hal_ultrasonic_sampleStop(void);
+int hal_ultrasonic_get_latest(UltrasonicSample*);
+uint8_t hal_ultrasonic_history(UltrasonicSample*, uint8_t);
 
-#endif
\ No newline at end of file
+#endif // HAL_ULTRASONIC_H
@@ -0,0 +1,49 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_advertise.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Eddystone service data advertising, updated in place
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_advertiseStart()      - Start advertising with an initial payload
+ * os_advertiseUpdate()     - Change the advertised payload (if it changed)
+ ******************************************************************************
+ */
+
+#ifndef OS_ADVERTISE_H
+#define OS_ADVERTISE_H
+
+#include <bluetooth/bluetooth.h>
+#include <sys/atomic.h>
+
+// Eddystone service UUID (little endian)
+#define ADV_EDDYSTONE_UUID_0        0xAA
+#define ADV_EDDYSTONE_UUID_1        0xFE
+
+// Service data bytes that fit after the flags and service data headers in a 
+// 31 byte legacy advertisement
+#define ADV_SERVICE_DATA_MAX        24
+
+// Longest the advertised payload is left untouched for when nothing changes
+#define ADV_UPDATE_DEADLINE_MS      1000
+
+// Shortest time between payload updates, so bursts of changes are batched
+#define ADV_UPDATE_MIN_INTERVAL_MS  30
+
+// Counters for advertising payload updates
+typedef struct {
+    atomic_t    pushed;     // Payload changed, handed to the controller
+    atomic_t    skipped;    // Payload unchanged, controller left alone
+    atomic_t    failed;     // Controller refused, old payload kept on air
+} AdvUpdateStats;
+
+extern AdvUpdateStats os_advUpdateStats;
+
+// Function prototypes - more detailed top comments in source file
+int os_advertiseStart(const struct bt_le_adv_param*, const uint8_t*, uint8_t,
+        const struct bt_data*, size_t);
+int os_advertiseUpdate(const uint8_t*, uint8_t);
+
+#endif // OS_ADVERTISE_H
@@ -4,26 +4,44 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <drivers/gpio.h>
+#include <sys/atomic.h>
 
 #define DEVICE_NAME             CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN         (sizeof(DEVICE_NAME) - 1)
 
 #define NUM_STATIC_NODES        13
 #define NUM_MOBILE_NODES        3
-#define NUN_ULTRASONIC_NODES    2
+#define NUM_ULTRASONIC_NODES    2
 #define NUM_HOUSEHOLDS          1
-#define PAYLOAD_SIZE            16
-#define PAYLOAD_BUFFER_OFFSET   13
-#define NODE_QUEUE_ALIGNMENT    32
 #define MAX_RESIDENTS           10
 #define MAX_HOUSEHOLDS          10
 
-#define BT_QUEUE_LENGTH         32
 #define BT_THREAD_STACK_SIZE    500
 #define BT_THREAD_PRIORITY      5
 
 #define SLEEP_TIME_MS           100
 
+// Address index - size must be a power of 2, and comfortably larger than the
+// number of known (static + mobile) addresses so probe chains stay short
+#define ADV_INDEX_BITS          5
+#define ADV_INDEX_SIZE          (1 << ADV_INDEX_BITS)
+
+// Kinds of advertiser the mobile node knows about
+#define ADV_KIND_UNKNOWN        0
+#define ADV_KIND_STATIC         1
+#define ADV_KIND_MOBILE         2
+
+// Live node state is packed into one atomic word per node:
+// [31:24] update counter, [23:8] ultrasonic reading, [7:0] RSSI
+#define NODE_STATE_PACK(rssi, us, count)    ((atomic_val_t)( \
+                                            ((uint32_t)(uint8_t)(rssi)) | \
+                                            ((uint32_t)(uint16_t)(us) << 8) | \
+                                            ((uint32_t)(uint8_t)(count) << 24)))
+#define NODE_STATE_RSSI(state)              ((int8_t)((state) & 0xFF))
+#define NODE_STATE_US(state)                ((uint16_t)(((state) >> 8) & 0xFFFF))
+#define NODE_STATE_COUNT(state)             ((uint8_t)(((state) >> 24) & 0xFF))
+#define NODE_RSSI_NONE                      -128
+
 #define false                   0
 #define true                    1
 
@@ -54,8 +72,6 @@
 typedef struct {
     bt_addr_t   address;
     uint8_t     hasUltrasonic;
-    int8_t      rssi;
-    uint8_t     ultrasonic;
 } StaticNode;
 
 // Static node list item, each with an index and node properties
@@ -64,12 +80,36 @@ typedef struct {
     StaticNode  node;
 } NodeListItem;
 
-// Items on the node message queue
+// Address index entry, maps a (packed 48-bit) address to a node list slot
 typedef struct {
-    uint8_t     index;
-    int8_t      rssi;
-    uint8_t     payload[PAYLOAD_SIZE];
-} NodeQueueItem;
+    uint64_t    key;
+    uint8_t     kind;
+    uint8_t     slot;
+} AdvIndexEntry;
+
+// Counters for advertisements seen by the mobile node scan callback
+typedef struct {
+    atomic_t    accepted;
+    atomic_t    rejected;
+} AdvStats;
+
+// Sequence accounting for payloads heard from one static node
+typedef struct {
+    uint8_t     lastSeq;
+    uint8_t     seen;
+    uint16_t    lastTransit;    // Arrival - sender uptime (ms, wrapping)
+    atomic_t    received;
+    atomic_t    lost;
+    atomic_t    jitter;         // RFC 3550 inter-arrival jitter (ms << 4)
+} HopStats;
+
+// Copy of the live readings of every static node
+typedef struct {
+    int8_t      rssi[NUM_STATIC_NODES];
+    uint16_t    ultrasonic[NUM_ULTRASONIC_NODES];
+    uint32_t    changes;    // os_NodeStateChanges when taken
+    uint32_t    stamp;      // Uptime (ms) of the last change
+} NodeSnapshot;
 
 // Households that have residents
 typedef struct {
@@ -78,19 +118,37 @@ typedef struct {
     bt_addr_t   addresses[MAX_RESIDENTS];
 } Household;
 
-// Mutex for accessing list of node properties
-extern struct k_mutex os_MutexNodeList;
-
-// List of nodes and their properties
-// ##### MUST USE MUTEX (os_MutexNodeList) TO ACCESS THIS LIST #####
+// List of nodes and their properties, indexed by node index
+// ##### READ-ONLY ONCE SCANNING HAS STARTED #####
 extern NodeListItem nodeList[NUM_STATIC_NODES];
 
-// Message queue for incoming bluetooth messages (from static nodes)
-extern struct k_msgq os_QueueBtNodeMessage;
+// Live state of each node (see NODE_STATE_*), indexed by node index. Only
+// written by os_bluetoothMobileListen, read with os_bluetoothNodeSnapshot
+extern atomic_t os_NodeState[NUM_STATIC_NODES];
+
+// Given by os_bluetoothMobileListen whenever a node's published state changes
+extern struct k_sem os_SemNodeStateChanged;
+
+// Uptime (ms) of the last published node state change
+extern atomic_t os_NodeStateStamp;
+
+// Count of published node state changes, compared to spot new values (two
+// changes can share a stamp)
+extern atomic_t os_NodeStateChanges;
+
+// Accepted/rejected advertisement counters (updated from BT RX context)
+extern AdvStats os_btAdvStats;
+
+// Static node -> mobile node hop loss, indexed by node index
+extern HopStats os_btHopStats[NUM_STATIC_NODES];
 
 // Function prototypes - more detailed top comments in source file
 uint8_t os_ledInit(void);
 uint8_t addressesEqual(bt_addr_t, bt_addr_t);
+uint64_t os_bluetoothAddressKey(const bt_addr_t*);
+void os_bluetoothIndexInit(void);
+void os_bluetoothNodeStateInit(void);
+void os_bluetoothNodeSnapshot(NodeSnapshot*);
 void bt_mobileCallback(const bt_addr_le_t*, int8_t, uint8_t,
         struct net_buf_simple*);
 void os_bluetooth_staticBeaconInit(int);
@@ -10,9 +10,9 @@
 ***************************************************************
 * os_hci_transmit(uint8_t sid, size_t argc, char** argv, uint8_t device) - Transmit packet via SPI.
 * os_hci_receive() - Receive packet via SPI
-* os_hci_reg_process() - Process i2C request  
-* os_hci_lsm() - Process lsm6dsl request
-* os_transmit_lsm(uint8_t read_register) - Transmit response for I2C request
+* os_hci_reg_read(uint8_t sid, size_t argc, char** argv, uint8_t* value) - Read i2c register via SPI
+* os_hci_lsm_read(uint8_t axis, int16_t* value) - Read lsm6dsl axis via SPI
+* os_hci_batch_read(const struct BatchOp* ops, uint8_t count, uint8_t* data) - Read several registers in one request
 ***************************************************************
 */
 
@@ -20,11 +20,15 @@
 #define OS_HCI_H
 
 #include <stdint.h>
+#include <stdlib.h>
+#include "hal_packet.h"
 
 extern void os_hci_transmit(uint8_t sid, size_t argc, char** argv, uint8_t device);
 extern void os_hci_receive();
-extern uint8_t os_hci_reg_process();
-extern void os_transmit_lsm(uint8_t read_register);
-extern struct Packetback os_hci_lsm();
+extern int os_hci_reg_read(uint8_t sid, size_t argc, char** argv,
+        uint8_t* value);
+extern int os_hci_lsm_read(uint8_t axis, int16_t* value);
+extern int os_hci_batch_read(const struct BatchOp* ops, uint8_t count,
+        uint8_t* data);
 #endif
 
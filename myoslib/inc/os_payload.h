@@ -0,0 +1,99 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_payload.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Advertising payload codec shared by static, mobile and base
+ *                  nodes (and mirrored by apps/payload.py on the host)
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_payloadFind()         - Find our service data in raw advertising data
+ * os_payloadKind()         - Check version and get the kind of a payload
+ * os_payloadEncodeStatic() - Encode a static node payload
+ * os_payloadDecodeStatic() - Decode a static node payload
+ * os_payloadEncodeMobile() - Encode a mobile node payload
+ * os_payloadDecodeMobile() - Decode a mobile node payload
+ ******************************************************************************
+ * WIRE FORMAT (service data after the Eddystone UUID, little endian)
+ ******************************************************************************
+ * Common:  [0] version << 4 | kind   [1] sequence number
+ * Static:  [2] node id (0 = identified by address)  [3..4] ultrasonic (us)
+ *          [5..6] sender uptime (ms, wrapping)
+ * Mobile:  [2] number of anchors N
+ *          [3] delta width (bits 0-2) | ultrasonic present mask (bits 4-5)
+ *              | hop statistics present (bit 6)
+ *          [4..5] anchor heard bitmap
+ *          [6] RSSI floor (int8)
+ *          [7..8] sender uptime (ms, wrapping)
+ *          [9] age of the newest reading (PAYLOAD_AGE_UNIT_MS, saturating)
+ *          [10..] heard anchors' RSSI - floor, bit packed LSB first
+ *          then one 16 bit ultrasonic reading per present mask bit
+ *          then, if present, the static to mobile hop of each ultrasonic 
+ *          reading: [0] payloads lost (wrapping) [1] jitter (ms, saturating)
+ ******************************************************************************
+ */
+
+#ifndef OS_PAYLOAD_H
+#define OS_PAYLOAD_H
+
+#include <zephyr/types.h>
+
+#define PAYLOAD_VERSION             2
+
+#define PAYLOAD_KIND_STATIC         1
+#define PAYLOAD_KIND_MOBILE         2
+
+#define PAYLOAD_MAX_ANCHORS         16
+#define PAYLOAD_MAX_ULTRASONIC      2
+#define PAYLOAD_MAX_DELTA_BITS      7
+
+// Values meaning "no reading"
+#define PAYLOAD_RSSI_NONE           -128
+#define PAYLOAD_US_NONE             0xFFFF
+
+#define PAYLOAD_STATIC_LEN          7
+#define PAYLOAD_MOBILE_HEADER_LEN   10
+
+// Mobile payload hop statistics flag (byte 3), and jitter ceiling
+#define PAYLOAD_HOP_PRESENT         0x40
+#define PAYLOAD_HOP_JITTER_MAX      0xFF
+
+// Resolution of the mobile payload age field
+#define PAYLOAD_AGE_UNIT_MS         4
+#define PAYLOAD_AGE_MAX             0xFF
+
+// Eddystone service UUID (little endian) our service data is sent under
+#define PAYLOAD_UUID_0              0xAA
+#define PAYLOAD_UUID_1              0xFE
+
+// Static node payload
+typedef struct {
+    uint8_t     seq;
+    uint8_t     nodeId;
+    uint16_t    ultrasonic;
+    uint16_t    uptime;
+} StaticPayload;
+
+// Mobile node payload
+typedef struct {
+    uint8_t     seq;
+    uint16_t    uptime;
+    uint8_t     age;
+    uint8_t     numAnchors;
+    int8_t      rssi[PAYLOAD_MAX_ANCHORS];
+    uint16_t    ultrasonic[PAYLOAD_MAX_ULTRASONIC];
+    uint8_t     hasHop;     // Hop statistics wanted (encode)/present (decode)
+    uint8_t     hopLost[PAYLOAD_MAX_ULTRASONIC];
+    uint8_t     hopJitter[PAYLOAD_MAX_ULTRASONIC];
+} MobilePayload;
+
+// Function prototypes - more detailed top comments in source file
+int os_payloadFind(const uint8_t*, uint8_t, const uint8_t**, uint8_t*);
+int os_payloadKind(const uint8_t*, uint8_t);
+int os_payloadEncodeStatic(const StaticPayload*, uint8_t*, uint8_t);
+int os_payloadDecodeStatic(const uint8_t*, uint8_t, StaticPayload*);
+int os_payloadEncodeMobile(const MobilePayload*, uint8_t*, uint8_t);
+int os_payloadDecodeMobile(const uint8_t*, uint8_t, MobilePayload*);
+
+#endif // OS_PAYLOAD_H
@@ -0,0 +1,49 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_rssi.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Per-node RSSI smoothing filters for the mobile node
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_rssiFilterInit()      - Reset every node's filter
+ * os_rssiFilterUpdate()    - Feed a raw RSSI sample, get the filtered value
+ * os_rssiFilterExpire()    - Check (and reset) a node that has gone quiet
+ ******************************************************************************
+ */
+
+#ifndef OS_RSSI_H
+#define OS_RSSI_H
+
+#include <zephyr/types.h>
+
+// Defaults for builds without the mobile node Kconfig
+#ifndef CONFIG_RSSI_FILTER_EWMA_SHIFT
+#define CONFIG_RSSI_FILTER_EWMA_SHIFT   2
+#endif
+#ifndef CONFIG_RSSI_FILTER_MEDIAN_LEN
+#define CONFIG_RSSI_FILTER_MEDIAN_LEN   5
+#endif
+#ifndef CONFIG_RSSI_FILTER_KALMAN_Q
+#define CONFIG_RSSI_FILTER_KALMAN_Q     64
+#endif
+#ifndef CONFIG_RSSI_FILTER_KALMAN_R
+#define CONFIG_RSSI_FILTER_KALMAN_R     1024
+#endif
+#ifndef CONFIG_RSSI_STALE_TIMEOUT_MS
+#define CONFIG_RSSI_STALE_TIMEOUT_MS    2000
+#endif
+
+// RSSI reported for a node that has not been heard (or has gone stale)
+#define RSSI_NONE                       -128
+
+// Fixed point fraction bits used by the filters
+#define RSSI_FRAC_BITS                  8
+
+// Function prototypes - more detailed top comments in source file
+void os_rssiFilterInit(void);
+int8_t os_rssiFilterUpdate(uint8_t, int8_t, uint32_t);
+uint8_t os_rssiFilterExpire(uint8_t, uint32_t);
+
+#endif // OS_RSSI_H
@@ -0,0 +1,72 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_scan.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Scan duty cycle scheduler for mobile and base nodes
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_scanStart()           - Start scanning at the densest level
+ * os_scanRestart()         - Restart scanning after the parameters changed
+ * os_scanNoteRssi()        - Give the latest RSSI vector (motion detection)
+ * os_scanTick()            - Run the scheduler, adapts once per epoch
+ * os_scanGetStats()        - Copy of the scan counters
+ * os_scanEnergyMj()        - Estimated radio energy spent scanning
+ ******************************************************************************
+ */
+
+#ifndef OS_SCAN_H
+#define OS_SCAN_H
+
+#include <zephyr/types.h>
+#include <bluetooth/bluetooth.h>
+
+// Scheduler runs once per epoch
+#define SCAN_EPOCH_MS               1000
+
+// Duty cycle levels, 0 is continuous. Every level keeps the same window so a
+// window always spans at least one advertising interval of our nodes
+#define SCAN_WINDOW                 0x0060  // 60 ms
+#define SCAN_NUM_LEVELS             5
+#define SCAN_LEVEL_INTERVALS        {0x0060, 0x00C0, 0x0180, 0x0300, 0x0640}
+
+// Stable epochs (no motion, enough frames) before backing off a level
+#define SCAN_STABLE_EPOCHS          3
+
+// Epochs to stay at level 0 after motion is seen
+#define SCAN_BURST_EPOCHS           2
+
+// Fewer relevant frames than this in an epoch means we are missing data
+#define SCAN_MIN_FRAMES             4
+
+// Summed RSSI change (dB) between epochs that counts as motion
+#define SCAN_MOTION_DB              12
+
+#define SCAN_MAX_ANCHORS            16
+
+// Radio receive power for the energy estimate (nRF52840, 3 V, DC/DC)
+#define SCAN_RX_POWER_UW            14400
+
+// Scan counters
+typedef struct {
+    uint8_t     level;
+    uint16_t    framesPerSec;       // Relevant frames, last epoch
+    uint32_t    frames;             // Relevant frames, total
+    uint32_t    scanOnMs;           // Time the radio spent scanning
+    uint32_t    levelChanges;
+    uint32_t    motionEpochs;
+} ScanStats;
+
+// Called by os_scanRestart() while scanning is stopped
+typedef void (*ScanStoppedHook)(struct bt_le_scan_param*);
+
+// Function prototypes - more detailed top comments in source file
+int os_scanStart(struct bt_le_scan_param*, bt_le_scan_cb_t*);
+int os_scanRestart(ScanStoppedHook);
+void os_scanNoteRssi(const int8_t*, uint8_t);
+int os_scanTick(uint32_t, uint32_t);
+void os_scanGetStats(ScanStats*);
+uint32_t os_scanEnergyMj(void);
+
+#endif // OS_SCAN_H
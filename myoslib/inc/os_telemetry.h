@@ -0,0 +1,47 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_telemetry.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Base node link statistics for mobile node payloads - loss,
+ *                  inter-arrival jitter and age of information per source
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_telemetryInit()       - Reset every source's statistics
+ * os_telemetryRecord()     - Account for a payload heard from a source
+ * os_telemetryGet()        - Take a consistent copy of a source's statistics
+ ******************************************************************************
+ */
+
+#ifndef OS_TELEMETRY_H
+#define OS_TELEMETRY_H
+
+#include <zephyr/types.h>
+
+// One per whitelisted mobile node (WHITELIST_MAX_MOBILES)
+#define TELEMETRY_MAX_SOURCES       256
+
+// Age of information histogram - bin i counts ages below 
+// TELEMETRY_HIST_BASE_MS << i, the last bin counts everything older
+#define TELEMETRY_HIST_BINS         8
+#define TELEMETRY_HIST_BASE_MS      16
+
+// Statistics of a single source
+typedef struct {
+    uint8_t     seen;
+    uint8_t     lastSeq;
+    uint16_t    lastTransit;    // Arrival - sender uptime (ms, wrapping)
+    uint16_t    minTransit;     // Smallest transit seen, taken as 0 delay
+    uint32_t    received;
+    uint32_t    lost;
+    uint32_t    jitter;         // RFC 3550 inter-arrival jitter (ms << 4)
+    uint32_t    aoi[TELEMETRY_HIST_BINS];
+} TelemetrySource;
+
+// Function prototypes - more detailed top comments in source file
+void os_telemetryInit(void);
+uint8_t os_telemetryRecord(uint16_t, uint8_t, uint16_t, uint8_t, uint32_t);
+void os_telemetryGet(uint16_t, TelemetrySource*);
+
+#endif // OS_TELEMETRY_H
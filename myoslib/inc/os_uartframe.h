@@ -0,0 +1,80 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_uartframe.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Binary framed UART link (COBS framing with CRC16) of the 
+ *                  base node, mirrored by apps/uart_frames.py on the host
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_uartFrameInit()       - Bind the UART frames are sent and received over
+ * os_uartFrameSend()       - Queue a record to be sent, never blocks
+ * os_uartFrameSendWait()   - Queue a record, waiting for room if needed
+ * os_uartFrameTx()         - Thread routine draining queued records
+ * os_uartFrameRx()         - Thread routine decoding received commands
+ ******************************************************************************
+ * FRAME FORMAT
+ ******************************************************************************
+ * COBS([type] [payload] [CRC16 LE]) 0x00
+ * CRC16 is Zephyr's crc16_ccitt (reflected 0x1021, seed 0) over type and
+ * payload. All multi-byte payload fields are little endian.
+ ******************************************************************************
+ */
+
+#ifndef OS_UARTFRAME_H
+#define OS_UARTFRAME_H
+
+#include <zephyr/types.h>
+#include <device.h>
+#include <sys/atomic.h>
+
+// Record types sent by the base node
+#define UART_FRAME_MOBILE           0x01    // Mobile node payload
+#define UART_FRAME_STATS            0x02    // Link statistics of a source
+#define UART_FRAME_UART             0x03    // UART output counters
+#define UART_FRAME_ACK              0x04    // Command result
+#define UART_FRAME_WHITELIST        0x05    // Whitelist entry
+#define UART_FRAME_SCAN             0x06    // Scan scheduler counters
+
+// Command types received by the base node (same framing)
+#define UART_CMD_WHITELIST_ADD      0x10    // [addr type] [addr 6] [source 2]
+#define UART_CMD_WHITELIST_REMOVE   0x11    // [addr 6]
+#define UART_CMD_WHITELIST_CLEAR    0x12
+#define UART_CMD_WHITELIST_LIST     0x13
+
+#define UART_FRAME_MAX_PAYLOAD      64
+
+// Queued records, each [length] [type] [payload]
+#define UART_FRAME_RING_SIZE        1024
+
+// Longest os_uartFrameSendWait() waits for room before dropping a record
+#define UART_FRAME_WAIT_MS          500
+
+// Received bytes waiting to be decoded
+#define UART_FRAME_RX_RING_SIZE     256
+
+// Longest frame on the wire - COBS adds a byte per 254, plus the delimiter
+#define UART_FRAME_MAX_RAW          (1 + UART_FRAME_MAX_PAYLOAD + 2)
+#define UART_FRAME_MAX_ENCODED      (UART_FRAME_MAX_RAW + \
+        (UART_FRAME_MAX_RAW / 254) + 2)
+
+// Output counters
+typedef struct {
+    atomic_t    sent;
+    atomic_t    dropped;
+} UartFrameStats;
+
+extern UartFrameStats os_uartFrameStats;
+
+// Called from the RX thread for every command frame that passes its CRC
+typedef void (*UartFrameHandler)(uint8_t, const uint8_t*, uint8_t);
+
+// Function prototypes - more detailed top comments in source file
+int os_uartFrameInit(const struct device*, UartFrameHandler);
+int os_uartFrameSend(uint8_t, const uint8_t*, uint8_t);
+int os_uartFrameSendWait(uint8_t, const uint8_t*, uint8_t);
+void os_uartFrameTx(void*, void*, void*);
+void os_uartFrameRx(void*, void*, void*);
+
+#endif // OS_UARTFRAME_H
@@ -0,0 +1,53 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/inc/os_whitelist.h
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Runtime list of mobile nodes the base node forwards, with
+ *                  the controller's accept list used when the list fits
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_whitelistInit()       - Empty the list
+ * os_whitelistAdd()        - Add (or re-number) a mobile node
+ * os_whitelistRemove()     - Remove a mobile node
+ * os_whitelistClear()      - Remove every mobile node
+ * os_whitelistLookup()     - Get the source index of an address
+ * os_whitelistCount()      - Number of mobile nodes in the list
+ * os_whitelistGet()        - Get the n-th mobile node in the list
+ * os_whitelistHwSync()     - Program the controller accept list
+ ******************************************************************************
+ */
+
+#ifndef OS_WHITELIST_H
+#define OS_WHITELIST_H
+
+#include <zephyr/types.h>
+#include <bluetooth/bluetooth.h>
+
+// Mobile nodes the list can hold, source indexes are 0 to this - 1
+#define WHITELIST_MAX_MOBILES       256
+
+// Hash table - size must be a power of 2 and at least twice the entries, so
+// probe chains stay short and an empty slot always ends them
+#define WHITELIST_TABLE_BITS        9
+#define WHITELIST_TABLE_SIZE        (1 << WHITELIST_TABLE_BITS)
+
+// Controller accept list size (from the controller's Kconfig if known)
+#ifdef CONFIG_BT_CTLR_WL_SIZE
+#define WHITELIST_HW_SIZE           CONFIG_BT_CTLR_WL_SIZE
+#else
+#define WHITELIST_HW_SIZE           8
+#endif
+
+// Function prototypes - more detailed top comments in source file
+void os_whitelistInit(void);
+int os_whitelistAdd(const bt_addr_le_t*, uint16_t);
+int os_whitelistRemove(const bt_addr_t*);
+void os_whitelistClear(void);
+int os_whitelistLookup(const bt_addr_t*);
+uint16_t os_whitelistCount(void);
+int os_whitelistGet(uint16_t, bt_addr_le_t*, uint16_t*);
+int os_whitelistHwSync(void);
+
+#endif // OS_WHITELIST_H
@@ -15,6 +15,8 @@
 * cmd_i2c_read(const struct shell *shell, size_t argc, char **argv) - Shell command to read i2c selected register
 * cmd_i2c_write(const struct shell *shell, size_t argc, char **argv) - Shell command to write i2c selected register
 * cmd_lsm_read(const struct shell *shell, size_t argc, char **argv) - Shell command to read LSM6DSL sensor data 
+* cmd_snapshot(const struct shell *shell, size_t argc, char **argv) - Shell command to read IMU and environment sensors in one request
+* cli_read_accel(int16_t* raw) - Read the LSM6DSL accelerometer axes in one HCI request
 ***************************************************************
 */
 
@@ -30,6 +32,34 @@
 #include "os_hci.h"
 #include "hal_packet.h"
 #include "hal_hci.h"
+#include "os_i2c.h"
+
+// Registers read by a snapshot, auto-incrementing from the first output
+#define LIS3MDL_REG_OUT_X_L     (0x28 | 0x80)
+#define LPS22HB_REG_PRESS_OUT_XL 0x28
+#define HTS221_REG_HUMIDITY_OUT_L (0x28 | 0x80)
+
+/**
+ * @brief Read the LSM6DSL accelerometer axes in one HCI request
+ * 
+ * @param raw: Filled with the raw x, y and z readings
+ * @retval 0 if successful, otherwise the os_hci_batch_read() error
+ * 
+ **/
+static int cli_read_accel(int16_t* raw) {
+
+    struct BatchOp op = { sensors[0] | 1, LSM6DSL_REG_OUTX_L_XL, 6 };
+    uint8_t data[6];
+    int err = os_hci_batch_read(&op, 1, data);
+
+    if (err != 0) {
+        return err;
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        raw[i] = (int16_t)(data[2 * i + 1] << 8 | data[2 * i]);
+    }
+    return 0;
+}
 
 /**
  * @brief Transmit and display LSM6DSL sensor data
@@ -39,69 +69,46 @@
  * 
  **/
 void process_lsm(size_t argc, char **argv) {
-    struct Packetback x_data, y_data, z_data;
-    int16_t temp_x,temp_y,temp_z;
-    double xval, yval, zval;
-    if (strcmp(argv[1], "x") == 0) {
 
-        os_transmit_lsm(1);
-        k_msleep(500);
-        // x_data = os_hci_lsm();
-        uint8_t unparsed_msg[SPI_BUFFER];
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_x = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        xval = (double)(temp_x) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "X-axis: %lf", xval);
+    static const char* names[] = { "X", "Y", "Z" };
+    uint8_t axis;
+    int16_t raw[3];
+    double val;
 
+    if (strcmp(argv[1], "x") == 0) {
+        axis = 1;
     } else if (strcmp(argv[1], "y") == 0) {
-
-        os_transmit_lsm(2);
-        k_msleep(500);
-        // x_data = os_hci_lsm();
-        uint8_t unparsed_msg[SPI_BUFFER];
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_y = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        yval = (double)(temp_y) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "Y-axis: %lf", yval);
-    }  else if (strcmp(argv[1], "z") == 0) {
-
-        os_transmit_lsm(3);
-        k_msleep(500);
-        uint8_t unparsed_msg[SPI_BUFFER];
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_z = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        zval = (double)(temp_z) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "Z-axis: %lf", zval);
+        axis = 2;
+    } else if (strcmp(argv[1], "z") == 0) {
+        axis = 3;
     } else if (strcmp(argv[1], "a") == 0) {
-        os_transmit_lsm(1);
-        k_msleep(200);
-        uint8_t unparsed_msg[SPI_BUFFER];
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_x = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        xval = (double)(temp_x) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "X-axis: %lf", xval);
-
-         os_transmit_lsm(2);
-        k_msleep(200);
-        // x_data = os_hci_lsm();
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_y = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        yval = (double)(temp_y) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "Y-axis: %lf", yval);
-
-        os_transmit_lsm(3);
-        k_msleep(200);
-        hal_hci_receive();
-        memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER);
-        temp_z = ( unparsed_msg[3] << 8 | unparsed_msg[4] );
-        zval = (double)(temp_z) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
-        shell_print(shell_backend_uart_get_ptr(), "Z-axis: %lf", zval);
+        axis = 0;
+    } else {
+        return;
+    }
+
+    if (axis != 0) {
+        if (os_hci_lsm_read(axis, &raw[axis - 1]) != 0) {
+            shell_print(shell_backend_uart_get_ptr(), "%s-axis: no response",
+                    names[axis - 1]);
+            return;
+        }
+        val = (double)(raw[axis - 1]) * (61LL / 1000.0) * SENSOR_G_DOUBLE /
+                1000;
+        shell_print(shell_backend_uart_get_ptr(), "%s-axis: %lf",
+                names[axis - 1], val);
+        return;
+    }
 
+    // All three axes in one request
+    if (cli_read_accel(raw) != 0) {
+        shell_print(shell_backend_uart_get_ptr(), "No response");
+        return;
+    }
+    for (axis = 0; axis < 3; axis++) {
+        val = (double)(raw[axis]) * (61LL / 1000.0) * SENSOR_G_DOUBLE / 1000;
+        shell_print(shell_backend_uart_get_ptr(), "%s-axis: %lf",
+                names[axis], val);
     }
 }
 
@@ -116,13 +123,16 @@ void process_lsm(size_t argc, char **argv) {
  **/
 static int cmd_i2c_read(const struct shell *shell, size_t argc, char **argv) {
 
-    struct Packetback data;
     uint8_t regvalue;
     int sid = atoi(argv[1]);
-    os_hci_transmit(sid, argc, argv, 1);
-    k_msleep(500);
-    regvalue = os_hci_reg_process();
+    int err = os_hci_reg_read(sid, argc, argv, &regvalue);
+
+    if (err != 0) {
+        shell_print(shell, "No response (err: %d)", err);
+        return err;
+    }
     shell_print(shell, "Register value: %d", regvalue);
+    return 0;
 }
 
 /**
@@ -152,6 +162,50 @@ static int cmd_lsm_read(const struct shell *shell, size_t argc, char **argv) {
     process_lsm(argc, argv);
 }
 
+/**
+ * @brief Shell command to read the IMU and environment sensors in one HCI
+ *        request, printing the raw little endian readings
+ * 
+ * @param shell: Pointer to the shell struct, which time will print on.
+ * @param argc: Number of arguments of shell command
+ * @param argv: List of string of arguments of shell command
+ * 
+ **/
+static int cmd_snapshot(const struct shell *shell, size_t argc, char **argv) {
+
+    // Gyroscope and accelerometer outputs are contiguous on the LSM6DSL
+    struct BatchOp ops[] = {
+        { sensors[0] | 1, LSM6DSL_REG_OUTX_L_G, 12 },
+        { sensors[1] | 1, LIS3MDL_REG_OUT_X_L, 6 },
+        { sensors[2] | 1, LPS22HB_REG_PRESS_OUT_XL, 3 },
+        { sensors[4] | 1, HTS221_REG_HUMIDITY_OUT_L, 4 },
+    };
+    uint8_t data[HCI_BATCH_MAX_DATA];
+    int16_t v[11];
+    int err = os_hci_batch_read(ops, ARRAY_SIZE(ops), data);
+
+    if (err != 0) {
+        shell_print(shell, "No response (err: %d)", err);
+        return err;
+    }
+
+    // Every output but the 24 bit pressure is 16 bit
+    for (uint8_t i = 0; i < 9; i++) {
+        v[i] = (int16_t)(data[2 * i + 1] << 8 | data[2 * i]);
+    }
+    for (uint8_t i = 0; i < 2; i++) {
+        v[9 + i] = (int16_t)(data[22 + 2 * i] << 8 | data[21 + 2 * i]);
+    }
+
+    shell_print(shell, "Gyro: %d %d %d", v[0], v[1], v[2]);
+    shell_print(shell, "Accel: %d %d %d", v[3], v[4], v[5]);
+    shell_print(shell, "Mag: %d %d %d", v[6], v[7], v[8]);
+    shell_print(shell, "Pressure: %d", data[20] << 16 | data[19] << 8 |
+            data[18]);
+    shell_print(shell, "Humidity: %d Temp: %d", v[9], v[10]);
+    return 0;
+}
+
 /**
  * @brief Initialize shell command for i2creg and lsm6dsl. Allows sub-commands for i2creg and lsm6dsl commands.
  **/
@@ -165,6 +219,8 @@ void cli_hci_init() {
 		SHELL_CMD_ARG(r, NULL, "Read from i2c register", cmd_lsm_read, 2, 0),
 		SHELL_SUBCMD_SET_END);
     SHELL_CMD_REGISTER(lsm6dsl, &sub_lsm, "Get data from LSM6DSL sensor.", NULL);
+    SHELL_CMD_REGISTER(snapshot, NULL,
+            "Read IMU and environment sensors in one request.", cmd_snapshot);
 }
 
 
@@ -3,13 +3,23 @@
 * @file myoslib/src/hal_hci.c
 * @author Desmond Gan - S4526441
 * @date 14042021
-* @brief shell log driver
-* REFERENCE: 
+* @brief HCI transport over SPI. One thread owns the bus and runs every
+*        transfer with spi_transceive_async(), sleeping on a poll signal
+*        while the driver moves the frame (EasyDMA on the nRF52840 master,
+*        the interrupt driver on the STM32 slave). Transfers are full
+*        duplex: the master sends its next request (or a poll frame of
+*        zeroes while requests are waiting) and clocks in whatever response
+*        the slave has queued. Responses carry their request's sequence
+*        ID, which finds the request in a small in-flight table, so a round
+*        trip takes as long as the slave does instead of a fixed sleep.
+* REFERENCE:
 ***************************************************************
 * EXTERNAL FUNCTIONS
 ***************************************************************
 * hal_hci_master_init()  - Initialise HCI master
 * hal_hci_slave_init() - Initialise HCI slave
+* hal_hci_request(uint8_t* msg, HciCallback callback, void* arg) - Send a request, callback gets the response
+* hal_hci_request_sync(uint8_t* msg, uint8_t* resp, k_timeout_t timeout) - Send a request and wait for the response
 * hal_hci_transmit(uint8_t* trsmtMsg) -  Write via SPI
 * hal_hci_receive() - Receive from SPI
 ***************************************************************
@@ -20,114 +30,443 @@
 #include <devicetree.h>
 #include <drivers/gpio.h>
 #include <drivers/spi.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/printk.h>
 #include <version.h>
 #include <zephyr.h>
 #include "hal_hci.h"
 
-#define SPI_BUFFER 10
+#define HCI_STACKSIZE 1024
+#define HCI_PRIORITY 6
+
+// Gap between poll frames while requests wait, lets the slave work (us)
+#define HCI_POLL_US 500
+
+// Back off after a failed transfer, so a broken bus does not spin (ms)
+#define HCI_RETRY_MS 100
+
+// Frames queued in each direction
+#define HCI_QUEUE_LEN (2 * HCI_MAX_INFLIGHT)
+
+typedef enum {
+    HCI_NONE,
+    HCI_MASTER,
+    HCI_SLAVE,
+} HciRole;
+
+// A request waiting for its response, seq 0 when the slot is free
+typedef struct {
+    uint8_t seq;
+    HciCallback callback;
+    void* arg;
+    int64_t deadline;
+} HciRequest;
+
+// Completion of a hal_hci_request_sync() call
+typedef struct {
+    struct k_sem done;
+    uint8_t* resp;
+    int err;
+} HciWaiter;
 
 uint8_t rxBuffer[SPI_BUFFER];
-uint8_t tx_buffer[SPI_BUFFER];
-uint8_t tx_buffer_d[SPI_BUFFER];
-uint8_t dumb_rxBuf[SPI_BUFFER];
 
-const struct device *spi;
-struct spi_config spi_cfg = { 0 };
-struct spi_cs_control spi_cs;
+// Frames on the wire, only touched by the HCI thread
+static uint8_t txFrame[SPI_BUFFER];
+static uint8_t rxFrame[SPI_BUFFER];
 
-struct spi_buf rx_buf = {
-	.buf = rxBuffer,
-	.len = sizeof(rxBuffer),
-};
+static const struct device *spi;
+static struct spi_config spi_cfg = { 0 };
+static struct spi_cs_control spi_cs;
 
-struct spi_buf rx_buf_d = {
-	.buf = dumb_rxBuf,
-	.len = sizeof(dumb_rxBuf),
-};
+static struct spi_buf tx_buf = { .buf = txFrame, .len = sizeof(txFrame) };
+static struct spi_buf rx_buf = { .buf = rxFrame, .len = sizeof(rxFrame) };
+static const struct spi_buf_set tx = { .buffers = &tx_buf, .count = 1 };
+static const struct spi_buf_set rx = { .buffers = &rx_buf, .count = 1 };
 
-struct spi_buf tx_buf = { .buf = tx_buffer, .len = sizeof(tx_buffer) };
-struct spi_buf tx_buf_d = { .buf = tx_buffer_d, .len = sizeof(tx_buffer) };
+static struct k_poll_signal spiDone = K_POLL_SIGNAL_INITIALIZER(spiDone);
 
-struct spi_buf_set tx = { .buffers = &tx_buf, .count = 1 };
-struct spi_buf_set tx_d = { .buffers = &tx_buf_d, .count = 1 };
+static HciRole role = HCI_NONE;
 
-struct spi_buf_set rx = { .buffers = &rx_buf, .count = 1 };
-struct spi_buf_set rx_d = { .buffers = &rx_buf_d, .count = 1 };
+// Frames to send, and (slave) requests received
+K_MSGQ_DEFINE(txQueue, SPI_BUFFER, HCI_QUEUE_LEN, 1);
+K_MSGQ_DEFINE(rxQueue, SPI_BUFFER, HCI_QUEUE_LEN, 1);
+
+// Given once a role is chosen, starts the HCI thread
+K_SEM_DEFINE(hciStart, 0, 1);
+
+// Master in-flight requests
+static HciRequest inflight[HCI_MAX_INFLIGHT];
+static uint8_t numInflight;
+static uint8_t nextSeq = 1;
+static struct k_spinlock hciLock;
+
+// Slave sequence ID of the request last received, echoed by responses
+static uint8_t requestSeq;
 
 /**
- * @brief Initialise HCI master
- * 
+ * @brief Set up the SPI bus and start the HCI thread
+ *
+ * @param mode: Master or slave
+ * @param cs_pin: Chip select pin on GPIO_0
+ *
  **/
-void hal_hci_master_init() {
+static void hal_hci_init(HciRole mode, uint32_t cs_pin) {
 
     spi = device_get_binding("SPI_1");
 
-	if (spi == NULL) {
-		return;
-	} 
+    if (spi == NULL) {
+        return;
+    }
+
+    spi_cfg.operation = SPI_WORD_SET(8) | SPI_TRANSFER_MSB |
+            (mode == HCI_MASTER ? SPI_OP_MODE_MASTER : SPI_OP_MODE_SLAVE);
+    spi_cfg.frequency = 2000000;
+    spi_cfg.slave = mode == HCI_MASTER ? 0 : 1;
 
-	spi_cfg.operation =
-		SPI_WORD_SET(8) | SPI_TRANSFER_MSB | SPI_OP_MODE_MASTER;
-	spi_cfg.frequency = 2000000;
-	spi_cfg.slave = 0;
+    spi_cs.gpio_dev = device_get_binding("GPIO_0");
+    spi_cs.gpio_pin = cs_pin;
+    spi_cs.delay = 0;
+    spi_cs.gpio_dt_flags = GPIO_ACTIVE_LOW;
+    spi_cfg.cs = &spi_cs;
 
-	spi_cs.gpio_dev = device_get_binding("GPIO_0");
-	spi_cs.gpio_pin = 31;
-	spi_cs.delay = 0;
-	spi_cs.gpio_dt_flags = GPIO_ACTIVE_LOW;
-	spi_cfg.cs = &spi_cs;
+    role = mode;
+    k_sem_give(&hciStart);
+}
+
+/**
+ * @brief Initialise HCI master
+ *
+ **/
+void hal_hci_master_init() {
+
+    hal_hci_init(HCI_MASTER, 31);
 }
 
 /**
  * @brief Initialise HCI slave
- * 
+ *
  **/
 void hal_hci_slave_init() {
 
-    spi = device_get_binding("SPI_1");
+    hal_hci_init(HCI_SLAVE, 15);
+}
+
+/**
+ * @brief Run one full duplex transfer of txFrame and rxFrame, sleeping
+ *        until the DMA is done. There is no way to abort a transfer, so
+ *        this always waits for it to finish before the frames are reused
+ *        (the slave waits for the master to clock it).
+ *
+ * @retval 0 if successful, otherwise the SPI error
+ *
+ **/
+static int hal_hci_transfer() {
+
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+            K_POLL_MODE_NOTIFY_ONLY, &spiDone);
+    unsigned int signaled;
+    int result;
+    int err;
+
+    k_poll_signal_reset(&spiDone);
+    err = spi_transceive_async(spi, &spi_cfg, &tx, &rx, &spiDone);
+    if (err != 0) {
+        return err;
+    }
+
+    k_poll(&event, 1, K_FOREVER);
+    k_poll_signal_check(&spiDone, &signaled, &result);
+    return result;
+}
+
+/**
+ * @brief Finish the in-flight request with a sequence ID (master)
+ *
+ * @param seq: Sequence ID
+ * @param err: 0 if resp is its response, otherwise the error
+ * @param resp: Response frame
+ *
+ **/
+static void hal_hci_complete(uint8_t seq, int err, const uint8_t* resp) {
+
+    HciCallback callback = NULL;
+    void* arg = NULL;
+
+    k_spinlock_key_t key = k_spin_lock(&hciLock);
+    for (uint8_t i = 0; i < HCI_MAX_INFLIGHT; i++) {
+        if (inflight[i].seq == seq) {
+            callback = inflight[i].callback;
+            arg = inflight[i].arg;
+            inflight[i].seq = 0;
+            numInflight--;
+            break;
+        }
+    }
+    k_spin_unlock(&hciLock, key);
+
+    // Callbacks run unlocked, so they can send the next request
+    if (callback != NULL) {
+        callback(err, err == 0 ? resp : NULL, arg);
+    }
+}
+
+/**
+ * @brief Time out in-flight requests past their deadline (master)
+ *
+ **/
+static void hal_hci_expire() {
+
+    int64_t now = k_uptime_get();
+
+    for (uint8_t i = 0; i < HCI_MAX_INFLIGHT; i++) {
+        uint8_t seq = inflight[i].seq;
+        if (seq != 0 && now >= inflight[i].deadline) {
+            hal_hci_complete(seq, -ETIMEDOUT, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Master side of the HCI thread. Sends queued frames, polls the
+ *        slave while requests wait and matches the responses.
+ *
+ **/
+static void hal_hci_master_run() {
+
+    int err;
+
+    while (1) {
+        k_timeout_t wait = numInflight ? K_USEC(HCI_POLL_US) : K_FOREVER;
+
+        if (k_msgq_get(&txQueue, txFrame, wait) != 0) {
+            memset(txFrame, 0, sizeof(txFrame));
+        }
+
+        err = hal_hci_transfer();
+        if (err != 0) {
+            // The frame is lost, its request times out below
+            printk("HCI transfer failed (err: %d)\n", err);
+            k_msleep(HCI_RETRY_MS);
+        } else if (rxFrame[0] == HCI_PREAMBLE &&
+                rxFrame[1] == HCI_TYPE_RESPONSE &&
+                rxFrame[HCI_SEQ_INDEX] != 0) {
+            hal_hci_complete(rxFrame[HCI_SEQ_INDEX], 0, rxFrame);
+        }
 
-	if (spi == NULL) {
-		// printk("Could not find SPI driver\n");
-		return;
-	}
-
-	spi_cfg.operation =
-		SPI_WORD_SET(8) | SPI_TRANSFER_MSB | SPI_OP_MODE_SLAVE;
-	spi_cfg.frequency = 2000000;
-	spi_cfg.slave = 1;
-
-	spi_cs.gpio_dev = device_get_binding("GPIO_0");
-	spi_cs.gpio_pin = 15;
-	spi_cs.delay = 0;
-	spi_cs.gpio_dt_flags = GPIO_ACTIVE_LOW;
-	spi_cfg.cs = &spi_cs;
+        hal_hci_expire();
+    }
 }
 
 /**
- * @brief Write via SPI
- * 
+ * @brief Slave side of the HCI thread. Keeps a transfer posted for the
+ *        master, loaded with the next queued response (or zeroes), and
+ *        queues the requests that arrive.
+ *
+ **/
+static void hal_hci_slave_run() {
+
+    int err;
+
+    while (1) {
+        if (k_msgq_get(&txQueue, txFrame, K_NO_WAIT) != 0) {
+            memset(txFrame, 0, sizeof(txFrame));
+        }
+
+        err = hal_hci_transfer();
+        if (err != 0) {
+            printk("HCI transfer failed (err: %d)\n", err);
+            k_msleep(HCI_RETRY_MS);
+        } else if (rxFrame[0] == HCI_PREAMBLE) {
+            k_msgq_put(&rxQueue, rxFrame, K_NO_WAIT);
+        }
+    }
+}
+
+/**
+ * @brief HCI thread, owns the SPI bus once a role is chosen
+ *
+ **/
+static void hal_hci_thread() {
+
+    k_sem_take(&hciStart, K_FOREVER);
+
+    if (role == HCI_MASTER) {
+        hal_hci_master_run();
+    } else {
+        hal_hci_slave_run();
+    }
+}
+
+K_THREAD_DEFINE(hal_hci_id, HCI_STACKSIZE, hal_hci_thread, NULL, NULL, NULL,
+        HCI_PRIORITY, 0, 0);
+
+/**
+ * @brief Send a request to the slave (master). Its sequence ID is written
+ *        into msg[HCI_SEQ_INDEX].
+ *
+ * @param msg: Request frame, SPI_BUFFER bytes
+ * @param callback: Called from the HCI thread with the response, or
+ *                  -ETIMEDOUT after HCI_TIMEOUT_MS
+ * @param arg: Passed to callback
+ * @retval Sequence ID (1 to 255), -ENODEV if not a master, -ENOSPC if too
+ *         many requests are waiting
+ *
+ **/
+int hal_hci_request(uint8_t* msg, HciCallback callback, void* arg) {
+
+    HciRequest* slot = NULL;
+    uint8_t seq;
+
+    if (role != HCI_MASTER || spi == NULL) {
+        return -ENODEV;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&hciLock);
+    for (uint8_t i = 0; i < HCI_MAX_INFLIGHT && slot == NULL; i++) {
+        if (inflight[i].seq == 0) {
+            slot = &inflight[i];
+        }
+    }
+    if (slot == NULL) {
+        k_spin_unlock(&hciLock, key);
+        return -ENOSPC;
+    }
+
+    // Next free sequence ID, 0 means no request
+    do {
+        seq = nextSeq;
+        nextSeq = nextSeq == UINT8_MAX ? 1 : nextSeq + 1;
+        for (uint8_t i = 0; i < HCI_MAX_INFLIGHT; i++) {
+            if (inflight[i].seq == seq) {
+                seq = 0;
+            }
+        }
+    } while (seq == 0);
+
+    slot->seq = seq;
+    slot->callback = callback;
+    slot->arg = arg;
+    slot->deadline = k_uptime_get() + HCI_TIMEOUT_MS;
+    numInflight++;
+    k_spin_unlock(&hciLock, key);
+
+    msg[HCI_SEQ_INDEX] = seq;
+    if (k_msgq_put(&txQueue, msg, K_NO_WAIT) != 0) {
+        key = k_spin_lock(&hciLock);
+        slot->seq = 0;
+        numInflight--;
+        k_spin_unlock(&hciLock, key);
+        return -ENOSPC;
+    }
+
+    return seq;
+}
+
+/**
+ * @brief hal_hci_request_sync() completion
+ *
+ **/
+static void hal_hci_wake(int err, const uint8_t* resp, void* arg) {
+
+    HciWaiter* waiter = arg;
+
+    waiter->err = err;
+    if (err == 0) {
+        memcpy(waiter->resp, resp, SPI_BUFFER);
+    }
+    k_sem_give(&waiter->done);
+}
+
+/**
+ * @brief Send a request to the slave and sleep until its response arrives
+ *        (master)
+ *
+ * @param msg: Request frame, SPI_BUFFER bytes
+ * @param resp: Filled with the response frame, SPI_BUFFER bytes
+ * @param timeout: Longest wait, the request itself gives up after
+ *                 HCI_TIMEOUT_MS
+ * @retval 0 if successful, -ETIMEDOUT if no response came, otherwise the
+ *         hal_hci_request() error
+ *
+ **/
+int hal_hci_request_sync(uint8_t* msg, uint8_t* resp, k_timeout_t timeout) {
+
+    HciWaiter waiter = { .resp = resp, .err = -ETIMEDOUT };
+    int seq;
+
+    k_sem_init(&waiter.done, 0, 1);
+
+    seq = hal_hci_request(msg, hal_hci_wake, &waiter);
+    if (seq < 0) {
+        return seq;
+    }
+
+    if (k_sem_take(&waiter.done, timeout) != 0) {
+        // Take the request back, unless its callback already has the waiter
+        uint8_t found = 0;
+        k_spinlock_key_t key = k_spin_lock(&hciLock);
+        for (uint8_t i = 0; i < HCI_MAX_INFLIGHT; i++) {
+            if (inflight[i].seq == seq) {
+                inflight[i].seq = 0;
+                numInflight--;
+                found = 1;
+            }
+        }
+        k_spin_unlock(&hciLock, key);
+
+        if (found) {
+            return -ETIMEDOUT;
+        }
+        k_sem_take(&waiter.done, K_FOREVER);
+    }
+
+    return waiter.err;
+}
+
+/**
+ * @brief Write via SPI. A master sends the frame without waiting for a
+ *        response, a slave queues it as the response to the request last
+ *        received, stamped with that request's sequence ID.
+ *
  * @param trsmtMsg: message to transmit
- * 
+ * @retval 0 if queued, -ENODEV if not initialised, -ENOSPC if the queue is
+ *         full
+ *
  **/
-void hal_hci_transmit(uint8_t* trsmtMsg) {
+int hal_hci_transmit(uint8_t* trsmtMsg) {
+
+    uint8_t frame[SPI_BUFFER];
 
-    memcpy(tx_buffer, trsmtMsg, (sizeof(uint8_t) * SPI_BUFFER));
-	
-    if(spi_transceive(spi, &spi_cfg, &tx, &rx_d) == 0) {
-		// spi_transceive(spi, &spi_cfg, &tx_d, &rx);
-    }   
+    if (role == HCI_NONE || spi == NULL) {
+        return -ENODEV;
+    }
+
+    memcpy(frame, trsmtMsg, sizeof(frame));
+    frame[HCI_SEQ_INDEX] = role == HCI_SLAVE ? requestSeq : 0;
+
+    return k_msgq_put(&txQueue, frame, K_NO_WAIT) == 0 ? 0 : -ENOSPC;
 }
 
 /**
- * @brief Recevie from SPI
- * 
+ * @brief Recevie from SPI (slave). Sleeps until the master sends a frame,
+ *        which is copied into rxBuffer.
+ *
+ * @retval 0 if successful, -ENODEV if not a slave
+ *
  **/
-void hal_hci_receive() {
-    if (spi_read(spi, &spi_cfg, &rx) == 0) {
-		
-	}  
-}
\ No newline at end of file
+int hal_hci_receive() {
+
+    if (role != HCI_SLAVE || spi == NULL) {
+        return -ENODEV;
+    }
+
+    k_msgq_get(&rxQueue, rxBuffer, K_FOREVER);
+    requestSeq = rxBuffer[HCI_SEQ_INDEX];
+
+    return 0;
+}
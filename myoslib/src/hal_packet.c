@@ -8,11 +8,17 @@
 ***************************************************************
 * EXTERNAL FUNCTIONS
 ***************************************************************
+* hal_build_request(uint8_t* msg, uint8_t sid, size_t argc, char** argv, uint8_t pac_type) - Build packet for HCI request
+* hal_build_lsm_request(uint8_t* msg, uint8_t axis) - Build packet for HCI LSM6DSL request
 * hal_parse_to_spi(uint8_t sid, size_t argc, char** argv, uint8_t pac_type) - Parse data into packet for HCI request
 * hal_parse_from_spi(uint8_t *msg) - Parse data from request packet 
 * hal_slave_to_master(uint8_t mode, uint8_t* data) - Parse data into packet for HCI I2C response
 * hal_lsmx_slave_to_master(uint8_t mode, uint8_t* data) - Parse data into packet for HCI LSM6DSL response
 * hal_master_from_slave(uint8_t *msg) - Parse data from response packet 
+* hal_build_batch(uint8_t* msg, const struct BatchOp* ops, uint8_t count) - Build packet for HCI batch request
+* hal_parse_batch(uint8_t* msg, struct BatchOp* ops) - Parse operations from batch request packet
+* hal_batch_slave_to_master(uint8_t done, uint8_t* data, uint8_t length) - Parse data into packet for HCI batch response
+* hal_build_spi(uint8_t* msg, uint8_t sid, uint16_t data, uint8_t type) - Build ultrasonic packet
 ***************************************************************
 */
 
@@ -20,6 +26,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/util.h>
 #include <shell/shell_uart.h>
 #include <shell/shell.h>
 #include "hal_packet.h"
@@ -28,18 +36,20 @@
 
 
 /**
- * @brief Parse data into packet for HCI request
+ * @brief Build packet for HCI request
  * 
+ * @param msg: Packet to fill, SPI_BUFFER bytes
  * @param sid: Sensor ID
  * @param argc: Size of argument
  * @param argv: List of argument
  * @param pac_tpye: Type of packet
  * 
  **/
-void hal_parse_to_spi(uint8_t sid, size_t argc, char** argv, uint8_t pac_type) {
+void hal_build_request(uint8_t* msg, uint8_t sid, size_t argc, char** argv,
+        uint8_t pac_type) {
 
-    uint8_t msg[8];
-        msg[0] = 0xAA;
+    memset(msg, 0, SPI_BUFFER);
+    msg[0] = 0xAA;
     // read from register
     if (argc == 3) {
         msg[1] = pac_type;
@@ -55,7 +65,38 @@ void hal_parse_to_spi(uint8_t sid, size_t argc, char** argv, uint8_t pac_type) {
         msg[5] = atoi(argv[2]); // regaddr to write to
         msg[6] = atoi(argv[3]); // regval to write
     } 
+}
+
+/**
+ * @brief Build packet for HCI LSM6DSL request
+ * 
+ * @param msg: Packet to fill, SPI_BUFFER bytes
+ * @param axis: 1 for x, 2 for y, 3 for z
+ * 
+ **/
+void hal_build_lsm_request(uint8_t* msg, uint8_t axis) {
+
+    memset(msg, 0, SPI_BUFFER);
+    msg[0] = HCI_PREAMBLE;
+    msg[1] = HCI_TYPE_REQUEST;
+    msg[2] = 1;
+    msg[3] = axis;
+}
+
+/**
+ * @brief Parse data into packet for HCI request
+ * 
+ * @param sid: Sensor ID
+ * @param argc: Size of argument
+ * @param argv: List of argument
+ * @param pac_tpye: Type of packet
+ * 
+ **/
+void hal_parse_to_spi(uint8_t sid, size_t argc, char** argv, uint8_t pac_type) {
 
+    uint8_t msg[SPI_BUFFER];
+
+    hal_build_request(msg, sid, argc, argv, pac_type);
     hal_hci_transmit(msg);
 }    
 
@@ -88,7 +129,7 @@ struct Packet hal_parse_from_spi(uint8_t *msg) {
  **/
 void hal_slave_to_master(uint8_t mode, uint8_t* data) {
 
-    uint8_t msg[SPI_BUFFER];
+    uint8_t msg[SPI_BUFFER] = { 0 };
     msg[0] = 0xAA;
     msg[1] = 2;
     msg[2] = sizeof(data);
@@ -109,7 +150,7 @@ void hal_slave_to_master(uint8_t mode, uint8_t* data) {
  **/
 void hal_lsmx_slave_to_master(uint8_t mode, uint8_t* data) {
 
-    uint8_t msg[SPI_BUFFER];
+    uint8_t msg[SPI_BUFFER] = { 0 };
     msg[0] = 0xAA;
     msg[1] = 2;
     msg[2] = sizeof(data);
@@ -142,9 +183,91 @@ struct Packetback hal_master_from_slave(uint8_t *msg) {
     return data_back;
 }
 
-void hal_parse_spi(uint8_t sid, uint16_t data, uint8_t type) {
-    
-    uint8_t msg[SPI_BUFFER];
+/**
+ * @brief Build packet for HCI batch request, read back to back by the slave
+ * 
+ * @param msg: Packet to fill, SPI_BUFFER bytes
+ * @param ops: Registers to read
+ * @param count: Number of ops
+ * @retval 0 if successful, -EINVAL if the ops or their data do not fit
+ * 
+ **/
+int hal_build_batch(uint8_t* msg, const struct BatchOp* ops, uint8_t count) {
+
+    uint16_t total = 0;
+
+    if (count == 0 || count > HCI_BATCH_MAX_OPS) {
+        return -EINVAL;
+    }
+
+    memset(msg, 0, SPI_BUFFER);
+    msg[0] = HCI_PREAMBLE;
+    msg[1] = HCI_TYPE_BATCH;
+    msg[2] = count;
+    for (uint8_t i = 0; i < count; i++) {
+        msg[HCI_BATCH_OPS + 3 * i] = ops[i].i2c_addr;
+        msg[HCI_BATCH_OPS + 3 * i + 1] = ops[i].reg_addr;
+        msg[HCI_BATCH_OPS + 3 * i + 2] = ops[i].length;
+        total += ops[i].length;
+    }
+
+    return total > HCI_BATCH_MAX_DATA ? -EINVAL : 0;
+}
+
+/**
+ * @brief Parse operations from batch request packet
+ * 
+ * @param msg: Batch request packet data
+ * @param ops: Filled with up to HCI_BATCH_MAX_OPS operations
+ * @retval Number of operations
+ * 
+ **/
+uint8_t hal_parse_batch(uint8_t* msg, struct BatchOp* ops) {
+
+    uint8_t count = MIN(msg[2], HCI_BATCH_MAX_OPS);
+
+    for (uint8_t i = 0; i < count; i++) {
+        ops[i].i2c_addr = msg[HCI_BATCH_OPS + 3 * i];
+        ops[i].reg_addr = msg[HCI_BATCH_OPS + 3 * i + 1];
+        ops[i].length = msg[HCI_BATCH_OPS + 3 * i + 2];
+    }
+
+    return count;
+}
+
+/**
+ * @brief Parse data into packet for HCI batch response
+ * 
+ * @param done: Operations read, stops at the first that failed
+ * @param data: Data read by those operations, in order
+ * @param length: Size of data
+ * 
+ **/
+void hal_batch_slave_to_master(uint8_t done, uint8_t* data, uint8_t length) {
+
+    uint8_t msg[SPI_BUFFER] = { 0 };
+
+    length = MIN(length, HCI_BATCH_MAX_DATA);
+    msg[0] = HCI_PREAMBLE;
+    msg[1] = HCI_TYPE_RESPONSE;
+    msg[2] = length;
+    msg[3] = done;
+    memcpy(&msg[HCI_BATCH_DATA], data, length);
+    hal_hci_transmit(msg);
+}
+
+/**
+ * @brief Build ultrasonic packet
+ * 
+ * @param msg: Packet to fill, SPI_BUFFER bytes
+ * @param sid: Sensor ID
+ * @param data: Echo time, for a response
+ * @param type: 1 for request, 2 for response
+ * 
+ **/
+void hal_build_spi(uint8_t* msg, uint8_t sid, uint16_t data, uint8_t type) {
+
+    memset(msg, 0, SPI_BUFFER);
     if (sid == 6) {
         msg[0] = 0xAA; // spi preamb
         msg[2] = 3; // sid and data size
@@ -157,9 +280,14 @@ void hal_parse_spi(uint8_t sid, uint16_t data, uint8_t type) {
             msg[1] = 1;
         }
     }
+}
+
+void hal_parse_spi(uint8_t sid, uint16_t data, uint8_t type) {
     
-    hal_hci_transmit(msg);
+    uint8_t msg[SPI_BUFFER];
 
+    hal_build_spi(msg, sid, data, type);
+    hal_hci_transmit(msg);
 }
 
 
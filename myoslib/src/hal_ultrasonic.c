@@ -1,73 +1,622 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/hal_ultrasonic.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Interrupt driven ultrasonic ranging driver. A reading
+ *                  pulses the trigger pin, then both edges of the echo pulse
+ *                  are timestamped with the hardware cycle counter from the
+ *                  echo pin's interrupt, so the CPU is free while the sound
+ *                  travels. A one shot timer ends readings whose echo never
+ *                  comes, and the result is handed to the caller's callback
+ *                  on the system work queue.
+ *                  In sampling mode a background thread takes readings at a
+ *                  fixed rate into a ring buffer and Hampel filters them, so
+ *                  callers just pick up the latest filtered reading.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * hal_ultrasonic_init()        - Set up the trigger and echo pins
+ * hal_ultrasonic_calibrate()   - Set the speed of sound and echo offset
+ * hal_ultrasonic_start()       - Start a reading, the callback gets it
+ * hal_ultrasonic_read()        - Take a reading, blocking until it is done
+ * hal_ultrasonic_sampleStart() - Start the background sampling thread
+ * hal_ultrasonic_sampleStop()  - Stop the background sampling thread
+ * hal_ultrasonic_get_latest()  - Latest filtered reading, never blocks
+ * hal_ultrasonic_history()     - Copy the raw readings in the ring buffer
+ ******************************************************************************
+ */
+
 #include <zephyr.h>
-#include <sys/printk.h>
 #include <device.h>
 #include <devicetree.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <string.h>
 #include <drivers/gpio.h>
-#include <sys_clock.h>
 #include <sys/util.h>
-#include <limits.h>
-#include "hal_ultrasonic.h"
+#include <errno.h>
 
-#define     US_CONVERT  35
-#define     TIMEOUT     50000
+#include <hal_ultrasonic.h>
 
-#define TRIGGER_NODE DT_ALIAS(trigger)
-#if DT_NODE_HAS_STATUS(TRIGGER_NODE, okay)
-#define TRIGGER	DT_GPIO_LABEL(TRIGGER_NODE, gpios)
-#define TRIGGER_PIN	DT_GPIO_PIN(TRIGGER_NODE, gpios)
-#define TRIGGER_FLAGS	DT_GPIO_FLAGS(TRIGGER_NODE, gpios)
-#else
-/* A build error here means your board isn't set up to blink an LED. */
-#error "Trigger pin not set up"
-#define TRIGGER	""
-#define TRIGGER_PIN	0
-#define TRIGGER_FLAGS	0
-#endif
-
-#define ECHO_NODE DT_ALIAS(echo)
-#if DT_NODE_HAS_STATUS(ECHO_NODE, okay)
-#define ECHO	DT_GPIO_LABEL(ECHO_NODE, gpios)
-#define ECHO_PIN	DT_GPIO_PIN(ECHO_NODE, gpios)
-#define ECHO_FLAG	DT_GPIO_FLAGS(ECHO_NODE, gpios)
-#else
-/* A build error here means your board isn't set up to blink an LED. */
-#error "Echo pin not set up"
-#define ECHO	""
-#define ECHO_PIN	0
-#define ECHO_FLAG	0
-#endif
+// Longest echo we wait for (us), the sensor gives up by about 38 ms
+#define TIMEOUT             50000
+
+// Trigger pulse width (us)
+#define TRIGGER_US          10
+
+// Sampling thread
+#define SAMPLE_STACKSIZE    1024
+#define SAMPLE_PRIORITY     7
+
+// Gaussian consistency scale of the median absolute deviation (x1000)
+#define MAD_SCALE           1483
+
+BUILD_ASSERT(CONFIG_ULTRASONIC_FILTER_LEN % 2 == 1,
+        "Ultrasonic filter length must be odd");
+BUILD_ASSERT(CONFIG_ULTRASONIC_FILTER_LEN <= CONFIG_ULTRASONIC_RING_LEN,
+        "Ultrasonic filter window must fit in the ring buffer");
+
+#define TRIGGER_NODE        DT_ALIAS(trigger)
+#define ECHO_NODE           DT_ALIAS(echo)
+
+#if DT_NODE_HAS_STATUS(TRIGGER_NODE, okay) && \
+        DT_NODE_HAS_STATUS(ECHO_NODE, okay)
+
+#define TRIGGER             DT_GPIO_LABEL(TRIGGER_NODE, gpios)
+#define TRIGGER_PIN         DT_GPIO_PIN(TRIGGER_NODE, gpios)
+#define TRIGGER_FLAGS       DT_GPIO_FLAGS(TRIGGER_NODE, gpios)
+#define ECHO                DT_GPIO_LABEL(ECHO_NODE, gpios)
+#define ECHO_PIN            DT_GPIO_PIN(ECHO_NODE, gpios)
+#define ECHO_FLAGS          DT_GPIO_FLAGS(ECHO_NODE, gpios)
+
+// Reading state, changed from thread, echo interrupt and timer contexts
+typedef enum {
+    US_IDLE,
+    US_WAIT_RISE,
+    US_WAIT_FALL,
+    US_DONE,                // Result waiting for the work queue
+} UsState;
+
+static const struct device* trig;
+static const struct device* ech;
+static struct gpio_callback echoCallback;
+static struct k_timer timeoutTimer;
+static struct k_work doneWork;
+static struct k_spinlock lock;
+
+static UsState state = US_IDLE;
+static uint32_t riseCycles;
+static uint32_t echoCycles;
+static int result;
+static UltrasonicCallback callback;
+
+// Calibration, distance = (echo - offset) * speed of sound / 2
+static uint32_t soundMmPerS = HAL_ULTRASONIC_SOUND_MM_S;
+static uint16_t offsetUs;
+
+// Blocking reads
+K_SEM_DEFINE(readDone, 0, 1);
+static uint16_t readEchoUs;
+
+// Sampling mode, the ring and latest are written by the sampling thread only
+K_SEM_DEFINE(sampleWake, 0, 1);
+K_SEM_DEFINE(sampleDone, 0, 1);
+static volatile uint16_t samplePeriod;      // ms, 0 when stopped
+static uint16_t sampleEchoUs;
+static UltrasonicSample ring[CONFIG_ULTRASONIC_RING_LEN];
+static uint8_t ringNext;
+static uint8_t ringCount;
+static UltrasonicSample latest;
+static uint8_t haveLatest;
+
+/**
+ * @brief   Convert an echo time to a distance (lock must be held)
+ * @param   echoUs: Echo time (us)
+ * @retval  Distance (mm)
+ */
+static uint16_t us_distance(uint16_t echoUs) {
+
+    uint32_t us = echoUs > offsetUs ? echoUs - offsetUs : 0;
+
+    return MIN((uint64_t)us * soundMmPerS / 2000000, UINT16_MAX);
+}
+
+/**
+ * @brief   End the reading in progress (lock must be held)
+ * @param   err:    0 if the echo was timed, else the error
+ */
+static void us_finish(int err) {
+
+    gpio_pin_interrupt_configure(ech, ECHO_PIN, GPIO_INT_DISABLE);
+    k_timer_stop(&timeoutTimer);
+
+    result = err;
+    state = US_DONE;
+    k_work_submit(&doneWork);
+}
 
-const struct device *trig;
-const struct device *ech;
+/**
+ * @brief   Echo pin interrupt, timestamps the edges of the echo pulse
+ * @param   dev:    Echo port
+ * @param   cb:     Callback
+ * @param   pins:   Pins that fired
+ */
+static void us_echoEdge(const struct device* dev, struct gpio_callback* cb,
+        uint32_t pins) {
 
+    uint32_t now = k_cycle_get_32();
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    ARG_UNUSED(dev);
+    ARG_UNUSED(cb);
+    ARG_UNUSED(pins);
+
+    if (state == US_WAIT_RISE) {
+
+        riseCycles = now;
+        state = US_WAIT_FALL;
+    } else if (state == US_WAIT_FALL) {
+
+        echoCycles = now - riseCycles;
+        us_finish(0);
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+/**
+ * @brief   Timer expiry, the echo never started or never ended
+ * @param   timer:  Timer
+ */
+static void us_timeout(struct k_timer* timer) {
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    ARG_UNUSED(timer);
+
+    if (state == US_WAIT_RISE || state == US_WAIT_FALL) {
+
+        us_finish(-ETIMEDOUT);
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+/**
+ * @brief   Convert and deliver a finished reading (system work queue)
+ * @param   work:   Work item
+ */
+static void us_done(struct k_work* work) {
+
+    uint16_t echoUs = HAL_ULTRASONIC_NONE;
+    uint16_t distanceMm = 0;
+    UltrasonicCallback done;
+    int err;
+
+    ARG_UNUSED(work);
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    err = result;
+    done = callback;
+    if (err == 0) {
+
+        uint32_t us = k_cyc_to_us_floor32(echoCycles);
+        echoUs = MIN(us, HAL_ULTRASONIC_NONE - 1);
+        distanceMm = us_distance(echoUs);
+    }
+
+    // Idle before the callback, so it can start the next reading
+    state = US_IDLE;
+    k_spin_unlock(&lock, key);
+
+    if (done != NULL) {
+
+        done(err, echoUs, distanceMm);
+    }
+}
+
+/**
+ * @brief   Set up the trigger and echo pins
+ * @retval  0 if successful, -ENODEV if a pin's port is missing, otherwise
+ *          the GPIO error
+ */
+int hal_ultrasonic_init(void) {
+
+    int err;
 
-void hal_ultrasonic_init() {
     trig = device_get_binding(TRIGGER);
     ech = device_get_binding(ECHO);
+    if (trig == NULL || ech == NULL) {
+
+        return -ENODEV;
+    }
+
+    err = gpio_pin_configure(trig, TRIGGER_PIN,
+            GPIO_OUTPUT_INACTIVE | TRIGGER_FLAGS);
+    if (err == 0) {
+
+        err = gpio_pin_configure(ech, ECHO_PIN, GPIO_INPUT | ECHO_FLAGS);
+    }
+    if (err != 0) {
+
+        return err;
+    }
+
+    gpio_init_callback(&echoCallback, us_echoEdge, BIT(ECHO_PIN));
+    k_timer_init(&timeoutTimer, us_timeout, NULL);
+    k_work_init(&doneWork, us_done);
 
-    gpio_config(trig, TRIGGER_PIN, GPIO_OUTPUT_ACTIVE);
-    gpio_config(ech, ECHO_PIN, GPIO_INPUT);
+    return gpio_add_callback(ech, &echoCallback);
 }
 
-uint16_t hal_ultrasonic_read() {
-    uint16_t pulseTime;
-    double dist;
+/**
+ * @brief   Set the calibration used to turn echo times into distances
+ * @param   soundMmS:   Speed of sound (mm/s), HAL_ULTRASONIC_SOUND_MM_S at
+ *                      20 C, about 600 more per degree warmer
+ * @param   offset:     Fixed sensor latency subtracted from echoes (us)
+ */
+void hal_ultrasonic_calibrate(uint32_t soundMmS, uint16_t offset) {
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    soundMmPerS = soundMmS;
+    offsetUs = offset;
+
+    k_spin_unlock(&lock, key);
+}
+
+/**
+ * @brief   Start a reading. The CPU is free until the callback is given the
+ *          result, at most TIMEOUT us later.
+ * @param   done:   Called from the system work queue with the reading
+ * @retval  0 if started, -EBUSY if a reading is in progress, -ENODEV if the
+ *          driver is not initialised, otherwise the GPIO error
+ */
+int hal_ultrasonic_start(UltrasonicCallback done) {
+
+    int err;
+
+    if (ech == NULL) {
+
+        return -ENODEV;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (state != US_IDLE) {
+
+        k_spin_unlock(&lock, key);
+        return -EBUSY;
+    }
+    state = US_WAIT_RISE;
+    callback = done;
+    k_spin_unlock(&lock, key);
+
+    err = gpio_pin_interrupt_configure(ech, ECHO_PIN, GPIO_INT_EDGE_BOTH);
+    if (err != 0) {
+
+        key = k_spin_lock(&lock);
+        state = US_IDLE;
+        k_spin_unlock(&lock, key);
+        return err;
+    }
+
+    // The timeout covers the trigger pulse and the sensor's burst too
+    k_timer_start(&timeoutTimer, K_USEC(TIMEOUT), K_NO_WAIT);
 
     gpio_pin_set(trig, TRIGGER_PIN, 1);
-    k_usleep(10);
+    k_busy_wait(TRIGGER_US);
     gpio_pin_set(trig, TRIGGER_PIN, 0);
 
-    while(!(gpio_pin_get(ech, ECHO_PIN))) {
+    return 0;
+}
+
+/**
+ * @brief   Blocking reading callback
+ */
+static void us_readDone(int err, uint16_t echoUs, uint16_t distanceMm) {
+
+    ARG_UNUSED(err);
+    ARG_UNUSED(distanceMm);
+
+    readEchoUs = echoUs;
+    k_sem_give(&readDone);
+}
+
+/**
+ * @brief   Take a reading, sleeping (not spinning) until it is done. Must
+ *          not be called from the system work queue.
+ * @retval  Echo time (us), HAL_ULTRASONIC_NONE if it failed
+ */
+uint16_t hal_ultrasonic_read(void) {
+
+    k_sem_reset(&readDone);
+    if (hal_ultrasonic_start(us_readDone) != 0) {
+
+        return HAL_ULTRASONIC_NONE;
+    }
+
+    k_sem_take(&readDone, K_FOREVER);
+
+    return readEchoUs;
+}
+
+/**
+ * @brief   Median of a few echo times
+ * @param   values: Echo times, sorted in place
+ * @param   count:  Number of echo times, at least 1
+ * @retval  Median
+ */
+static uint16_t us_median(uint16_t* values, uint8_t count) {
+
+    // Insertion sort - the window is tiny
+    for (uint8_t i = 1; i < count; i++) {
+
+        uint16_t value = values[i];
+        int8_t j = i - 1;
+
+        while (j >= 0 && values[j] > value) {
+
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = value;
+    }
+
+    return values[count / 2];
+}
+
+/**
+ * @brief   Add a raw reading to the ring and refilter. The newest reading
+ *          is replaced by the median of the filter window if it is more
+ *          than CONFIG_ULTRASONIC_HAMPEL_K scaled MADs from it (a Hampel
+ *          filter, 0 gives a plain median). The target counts as gone while
+ *          half or more of the readings in the window have failed.
+ * @param   echoUs: Echo time (us), HAL_ULTRASONIC_NONE if it failed
+ * @param   now:    Uptime of the reading (ms)
+ */
+static void us_sampleAdd(uint16_t echoUs, uint32_t now) {
+
+    uint16_t window[CONFIG_ULTRASONIC_FILTER_LEN];
+    uint16_t deviation[CONFIG_ULTRASONIC_FILTER_LEN];
+    UltrasonicSample filtered = {.echoUs = echoUs, .time = now};
+    uint8_t windowLen;
+    uint8_t count = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    ring[ringNext] = (UltrasonicSample){.echoUs = echoUs, .time = now,
+            .distanceMm = echoUs == HAL_ULTRASONIC_NONE ? 0 :
+            us_distance(echoUs)};
+    ringNext = (ringNext + 1) % CONFIG_ULTRASONIC_RING_LEN;
+    if (ringCount < CONFIG_ULTRASONIC_RING_LEN) {
+
+        ringCount++;
+    }
+
+    // Successful readings in the window, newest first
+    windowLen = MIN(ringCount, CONFIG_ULTRASONIC_FILTER_LEN);
+    for (uint8_t i = 0; i < windowLen; i++) {
+
+        uint8_t index = (ringNext + CONFIG_ULTRASONIC_RING_LEN - 1 - i) %
+                CONFIG_ULTRASONIC_RING_LEN;
+        if (ring[index].echoUs != HAL_ULTRASONIC_NONE) {
+
+            window[count++] = ring[index].echoUs;
+        }
+    }
+
+    if (2 * count <= windowLen) {
+
+        filtered.echoUs = HAL_ULTRASONIC_NONE;
+    } else {
+
+        uint16_t median = us_median(window, count);
+
+        for (uint8_t i = 0; i < count; i++) {
+
+            deviation[i] = window[i] > median ? window[i] - median :
+                    median - window[i];
+        }
+        uint32_t limit = ((uint32_t)CONFIG_ULTRASONIC_HAMPEL_K *
+                us_median(deviation, count) * MAD_SCALE + 500) / 1000;
+
+        uint32_t error = echoUs > median ? echoUs - median : median - echoUs;
+
+        if (echoUs == HAL_ULTRASONIC_NONE || error > limit) {
+
+            filtered.echoUs = median;
+            filtered.outlier = echoUs != median;
+        }
+        filtered.distanceMm = us_distance(filtered.echoUs);
+    }
+
+    latest = filtered;
+    haveLatest = true;
+
+    k_spin_unlock(&lock, key);
+}
+
+/**
+ * @brief   Sampling mode reading callback
+ */
+static void us_sampleDone(int err, uint16_t echoUs, uint16_t distanceMm) {
+
+    ARG_UNUSED(err);
+    ARG_UNUSED(distanceMm);
+
+    sampleEchoUs = echoUs;
+    k_sem_give(&sampleDone);
+}
+
+/**
+ * @brief   Sampling thread, takes a reading every sample period while
+ *          sampling is on
+ */
+static void us_sampleThread(void) {
+
+    while (1) {
+
+        uint16_t period = samplePeriod;
+
+        if (period == 0) {
+
+            k_sem_take(&sampleWake, K_FOREVER);
+            continue;
+        }
+
+        int64_t next = k_uptime_get() + period;
+
+        // The driver's timeout bounds the wait for the callback
+        if (hal_ultrasonic_start(us_sampleDone) == 0) {
+
+            k_sem_take(&sampleDone, K_FOREVER);
+            us_sampleAdd(sampleEchoUs, k_uptime_get_32());
+        }
+
+        // Woken early if sampling is stopped or restarted
+        int64_t left = next - k_uptime_get();
+        if (left > 0) {
+
+            k_sem_take(&sampleWake, K_MSEC(left));
+        }
+    }
+}
+
+K_THREAD_DEFINE(us_sampleId, SAMPLE_STACKSIZE, us_sampleThread, NULL, NULL,
+        NULL, SAMPLE_PRIORITY, 0, 0);
+
+/**
+ * @brief   Start (or restart) sampling in the background. Readings are
+ *          taken every period, or back to back if an echo takes longer.
+ *          Other readings should not be started while sampling is on.
+ * @param   period: Time between readings (ms),
+ *                  CONFIG_ULTRASONIC_SAMPLE_PERIOD_MS by default
+ * @retval  0 if successful, -EINVAL if period is 0, -ENODEV if the driver
+ *          is not initialised
+ */
+int hal_ultrasonic_sampleStart(uint16_t period) {
+
+    if (ech == NULL) {
+
+        return -ENODEV;
     }
-    pulseTime = 0;
-    while (gpio_pin_get(ech, ECHO_PIN)) {
-      pulseTime++;
-      k_usleep(1);
+    if (period == 0) {
+
+        return -EINVAL;
     }
 
-    // dist = (((double) pulseTime) / US_CONVERT);
-    return pulseTime;
-}
\ No newline at end of file
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    ringNext = 0;
+    ringCount = 0;
+    haveLatest = false;
+    k_spin_unlock(&lock, key);
+
+    samplePeriod = period;
+    k_sem_give(&sampleWake);
+
+    return 0;
+}
+
+/**
+ * @brief   Stop sampling, a reading in progress still finishes
+ */
+void hal_ultrasonic_sampleStop(void) {
+
+    samplePeriod = 0;
+    k_sem_give(&sampleWake);
+}
+
+/**
+ * @brief   Latest filtered reading. Cheap enough to call from any thread
+ *          or interrupt, it only copies the reading.
+ * @param   sample: Filled with the reading, echoUs is HAL_ULTRASONIC_NONE
+ *                  if the target is gone
+ * @retval  0 if successful, -ENODATA if nothing has been sampled yet
+ */
+int hal_ultrasonic_get_latest(UltrasonicSample* sample) {
+
+    int err = -ENODATA;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    if (haveLatest) {
+
+        *sample = latest;
+        err = 0;
+    }
+    k_spin_unlock(&lock, key);
+
+    return err;
+}
+
+/**
+ * @brief   Copy the raw readings in the ring buffer, oldest first
+ * @param   samples:    Filled with up to max readings
+ * @param   max:        Size of samples
+ * @retval  Number of readings copied, the newest ones if max is short
+ */
+uint8_t hal_ultrasonic_history(UltrasonicSample* samples, uint8_t max) {
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint8_t count = MIN(ringCount, max);
+
+    for (uint8_t i = 0; i < count; i++) {
+
+        samples[i] = ring[(ringNext + CONFIG_ULTRASONIC_RING_LEN - count + i) %
+                CONFIG_ULTRASONIC_RING_LEN];
+    }
+    k_spin_unlock(&lock, key);
+
+    return count;
+}
+
+#else
+
+// No trigger and echo pins on this board, every reading fails
+
+int hal_ultrasonic_init(void) {
+
+    return -ENODEV;
+}
+
+void hal_ultrasonic_calibrate(uint32_t soundMmS, uint16_t offset) {
+
+    ARG_UNUSED(soundMmS);
+    ARG_UNUSED(offset);
+}
+
+int hal_ultrasonic_start(UltrasonicCallback done) {
+
+    ARG_UNUSED(done);
+
+    return -ENODEV;
+}
+
+uint16_t hal_ultrasonic_read(void) {
+
+    return HAL_ULTRASONIC_NONE;
+}
+
+int hal_ultrasonic_sampleStart(uint16_t period) {
+
+    ARG_UNUSED(period);
+
+    return -ENODEV;
+}
+
+void hal_ultrasonic_sampleStop(void) {
+}
+
+int hal_ultrasonic_get_latest(UltrasonicSample* sample) {
+
+    ARG_UNUSED(sample);
+
+    return -ENODATA;
+}
+
+uint8_t hal_ultrasonic_history(UltrasonicSample* samples, uint8_t max) {
+
+    ARG_UNUSED(samples);
+    ARG_UNUSED(max);
+
+    return 0;
+}
+
+#endif // trigger and echo aliases
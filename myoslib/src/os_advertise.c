@@ -0,0 +1,131 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_advertise.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Eddystone service data advertising. Advertising is started
+ *                  once, and the service data is then changed in place with 
+ *                  bt_le_adv_update_data() - only when the bytes actually 
+ *                  change - instead of stopping and restarting the advertiser.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_advertiseStart()      - Start advertising with an initial payload
+ * os_advertiseUpdate()     - Change the advertised payload (if it changed)
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/printk.h>
+#include <sys/util.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <os_advertise.h>
+
+// Service data: Eddystone UUID followed by the payload
+static uint8_t serviceData[2 + ADV_SERVICE_DATA_MAX] = {
+        ADV_EDDYSTONE_UUID_0, ADV_EDDYSTONE_UUID_1};
+
+static const uint8_t adFlags[] = {BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR};
+
+// Advertising data, the service data entry points at serviceData. There is no
+// UUID list, the space goes to the payload instead
+static struct bt_data adData[] = {
+    BT_DATA(BT_DATA_FLAGS, adFlags, sizeof(adFlags)),
+    BT_DATA(BT_DATA_SVC_DATA16, serviceData, 2),
+};
+
+// Scan response data given at start, reused for every update
+static const struct bt_data* responseData;
+static size_t responseDataLen;
+
+AdvUpdateStats os_advUpdateStats;
+
+/**
+ * @brief   Copy a payload into the advertised service data
+ * @param   payload:    Payload bytes (after the Eddystone UUID)
+ * @param   len:        Number of payload bytes
+ */
+static void advertiseSetPayload(const uint8_t* payload, uint8_t len) {
+
+    memcpy(&serviceData[2], payload, len);
+    adData[ARRAY_SIZE(adData) - 1].data_len = 2 + len;
+}
+
+/**
+ * @brief   Start advertising with an initial service data payload
+ * @param   param:      Advertising parameters
+ * @param   payload:    Payload bytes (after the Eddystone UUID)
+ * @param   len:        Number of payload bytes
+ * @param   sd:         Scan response data
+ * @param   sdLen:      Number of scan response data entries
+ * @retval  0 if successful, error from bt_le_adv_start otherwise
+ */
+int os_advertiseStart(const struct bt_le_adv_param* param, 
+        const uint8_t* payload, uint8_t len, const struct bt_data* sd, 
+        size_t sdLen) {
+
+    if (len > ADV_SERVICE_DATA_MAX) {
+
+        return -EINVAL;
+    }
+
+    advertiseSetPayload(payload, len);
+    responseData = sd;
+    responseDataLen = sdLen;
+
+    atomic_clear(&os_advUpdateStats.pushed);
+    atomic_clear(&os_advUpdateStats.skipped);
+
+    return bt_le_adv_start(param, adData, ARRAY_SIZE(adData), responseData, 
+            responseDataLen);
+}
+
+/**
+ * @brief   Change the advertised service data payload. The controller is only
+ *          touched if the payload differs from what is already on air, and
+ *          advertising keeps running throughout (no radio gap).
+ * @param   payload:    Payload bytes (after the Eddystone UUID)
+ * @param   len:        Number of payload bytes
+ * @retval  0 if successful (or unchanged), error from bt_le_adv_update_data
+ *          otherwise (the old payload is kept, so the update can be retried)
+ */
+int os_advertiseUpdate(const uint8_t* payload, uint8_t len) {
+
+    uint8_t previous[ADV_SERVICE_DATA_MAX];
+    uint8_t previousLen;
+    int err;
+
+    if (len > ADV_SERVICE_DATA_MAX) {
+
+        return -EINVAL;
+    }
+
+    if (adData[ARRAY_SIZE(adData) - 1].data_len == 2 + len && 
+            memcmp(&serviceData[2], payload, len) == 0) {
+
+        atomic_inc(&os_advUpdateStats.skipped);
+        return 0;
+    }
+
+    previousLen = adData[ARRAY_SIZE(adData) - 1].data_len - 2;
+    memcpy(previous, &serviceData[2], previousLen);
+
+    advertiseSetPayload(payload, len);
+    err = bt_le_adv_update_data(adData, ARRAY_SIZE(adData), responseData, 
+            responseDataLen);
+    if (err) {
+
+        advertiseSetPayload(previous, previousLen);
+        atomic_inc(&os_advUpdateStats.failed);
+        return err;
+    }
+
+    atomic_inc(&os_advUpdateStats.pushed);
+    return 0;
+}
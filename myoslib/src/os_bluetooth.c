@@ -21,14 +21,45 @@
 #include <drivers/gpio.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
+#include <sys/atomic.h>
+#include <string.h>
+#include <errno.h>
 
 #include <os_bluetooth.h>
+#include <os_rssi.h>
+#include <os_payload.h>
 
 uint8_t violatingDistance = false;
 const struct device* thingyLed;
 
 bt_addr_le_t selfAddr = {0};
 
+// Address to node slot index, built once by os_bluetoothIndexInit()
+static AdvIndexEntry advIndex[ADV_INDEX_SIZE];
+
+// Scan callback load counters
+AdvStats os_btAdvStats;
+
+// Static node hop loss counters, only written from BT RX context
+HopStats os_btHopStats[NUM_STATIC_NODES];
+
+// Live node state, one packed word per node (see NODE_STATE_*)
+atomic_t os_NodeState[NUM_STATIC_NODES];
+
+// Coalescing mailbox between the scan callback and the listening thread. Each
+// node has a single slot holding its latest reading (packed the same way as
+// os_NodeState), and a bit in nodeMailboxPending marks slots not yet consumed
+static atomic_t nodeMailbox[NUM_STATIC_NODES];
+static atomic_t nodeMailboxPending;
+K_SEM_DEFINE(nodeMailboxSem, 0, 1);
+
+BUILD_ASSERT(NUM_STATIC_NODES <= 32, "Mailbox pending mask is one word");
+
+// Node state change notification for the advertiser
+K_SEM_DEFINE(os_SemNodeStateChanged, 0, 1);
+atomic_t os_NodeStateStamp;
+atomic_t os_NodeStateChanges;
+
 // NOTE: To add family members of nodes, do this in os_bluetoothMobileListen()
 
 // Bluetooth addresses for mobile nodes:
@@ -135,161 +166,297 @@ uint8_t addressesEqual(bt_addr_t address1, bt_addr_t address2) {
 }
 
 /**
- * @brief       Callback function for mobile node scan
- * @param       addr:       Address of scan response
- * @param       rssi:       RSSI strength of response
- * @param       adv_type:   Response message type
- * @param       buf:        Data buffer of message
+ * @brief       Pack a bluetooth address into a 48-bit integer key
+ * @param       address: Address to pack
+ * @retval      Packed address (0 for the all-zero address)
  */
-void bt_mobileCallback(const bt_addr_le_t *addr, int8_t rssi, uint8_t adv_type,
-		    struct net_buf_simple *buf) {
+uint64_t os_bluetoothAddressKey(const bt_addr_t* address) {
 
-    // Listen for messages from node 1
-    if (buf->data[13] == 0xF0 && buf->data[14] == 0xBA && buf->data[15] == 1) {
+    return ((uint64_t)address->val[0])       | ((uint64_t)address->val[1] << 8) |
+           ((uint64_t)address->val[2] << 16) | ((uint64_t)address->val[3] << 24) |
+           ((uint64_t)address->val[4] << 32) | ((uint64_t)address->val[5] << 40);
+}
 
-        uint8_t payload[PAYLOAD_SIZE];
-        // Make up the payload array
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+/**
+ * @brief       Hash a packed address into an index table slot
+ * @param       key: Packed address
+ * @retval      Starting slot in the address index
+ */
+static inline uint8_t addressHash(uint64_t key) {
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET];
-        }
-        
-        // Make up the message item to send to listening thread
-        NodeQueueItem nodeQueueItem;
-        nodeQueueItem.index = 0;
-        nodeQueueItem.rssi = rssi;
-        memcpy(&nodeQueueItem.payload, &payload, sizeof(payload));
+    // Fibonacci hashing - top bits of the product are well mixed
+    return (uint8_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - ADV_INDEX_BITS));
+}
 
-        // Send off message to listening thread
-        while (k_msgq_put(&os_QueueBtNodeMessage, &nodeQueueItem, K_NO_WAIT) 
-                != 0) {
+/**
+ * @brief       Add an address to the index (only called during init)
+ * @param       address:    Address to add (all-zero addresses are ignored)
+ * @param       kind:       ADV_KIND_STATIC or ADV_KIND_MOBILE
+ * @param       slot:       Index into nodeList or mobileNodes
+ */
+static void advIndexInsert(const bt_addr_t* address, uint8_t kind, 
+        uint8_t slot) {
 
-            k_msgq_purge(&os_QueueBtNodeMessage);
-        }
+    uint64_t key = os_bluetoothAddressKey(address);
+    if (key == 0) {
+
+        // Node is identified by its payload, not its address
         return;
     }
 
-    // Listen for messages from node 2
-    else if (buf->data[13] == 0xF0 && buf->data[14] == 0xBA && 
-             buf->data[15] == 2) {
+    uint8_t i = addressHash(key);
+    while (advIndex[i].key != 0 && advIndex[i].key != key) {
 
-        uint8_t payload[PAYLOAD_SIZE];
-        // Make up the payload array
-        for (uint8_t i = 0; i < PAYLOAD_SIZE; i++) {
+        i = (i + 1) & (ADV_INDEX_SIZE - 1);
+    }
 
-            payload[i] = buf->data[i + PAYLOAD_BUFFER_OFFSET];
-        }
-        
-        // Make up the message item to send to listening thread
-        NodeQueueItem nodeQueueItem;
-        nodeQueueItem.index = 1;
-        nodeQueueItem.rssi = rssi;
-        memcpy(&nodeQueueItem.payload, &payload, sizeof(payload));
+    advIndex[i].key = key;
+    advIndex[i].kind = kind;
+    advIndex[i].slot = slot;
+}
 
-        // Send off message to listening thread
-        while (k_msgq_put(&os_QueueBtNodeMessage, &nodeQueueItem, K_NO_WAIT) 
-                != 0) {
+/**
+ * @brief       Look up an address in the index
+ * @param       address: Address to look up
+ * @retval      Matching index entry, or NULL if the address is unknown
+ */
+static inline const AdvIndexEntry* advIndexLookup(const bt_addr_t* address) {
 
-            k_msgq_purge(&os_QueueBtNodeMessage);
+    uint64_t key = os_bluetoothAddressKey(address);
+    uint8_t i = addressHash(key);
+
+    // Table is never more than half full, so an empty slot always ends the 
+    // probe sequence
+    while (advIndex[i].key != 0) {
+
+        if (advIndex[i].key == key) {
+
+            return &advIndex[i];
         }
+        i = (i + 1) & (ADV_INDEX_SIZE - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief   Build the address index from nodeList and mobileNodes. Must be 
+ *          called after nodeList is populated and before scanning starts, the 
+ *          index is read-only from then on.
+ */
+void os_bluetoothIndexInit(void) {
+
+    BUILD_ASSERT(ADV_INDEX_SIZE >= 2 * (NUM_STATIC_NODES + NUM_MOBILE_NODES),
+            "Address index too small");
+
+    memset(advIndex, 0, sizeof(advIndex));
+
+    for (uint8_t i = 0; i < NUM_STATIC_NODES; i++) {
+
+        advIndexInsert(&nodeList[i].node.address, ADV_KIND_STATIC, i);
+    }
+
+    for (uint8_t i = 0; i < NUM_MOBILE_NODES; i++) {
+
+        advIndexInsert(&mobileNodes[i], ADV_KIND_MOBILE, i);
+    }
+
+    atomic_clear(&os_btAdvStats.accepted);
+    atomic_clear(&os_btAdvStats.rejected);
+}
+
+/**
+ * @brief       Post a static node reading to the listening thread. Only the 
+ *              latest reading per node is kept, so a burst from one node 
+ *              never pushes out readings from the others. Safe to call from
+ *              the BT RX context, never blocks.
+ * @param       index:      Node list index of the static node
+ * @param       rssi:       RSSI strength of response
+ * @param       ultrasonic: Ultrasonic reading carried in the payload
+ */
+static void bt_postNodeMessage(uint8_t index, int8_t rssi, 
+        uint16_t ultrasonic) {
+
+    // Slot first, then pending bit - the listener clears bits before reading
+    // slots, so it can only ever see a newer value than the bit announced
+    atomic_set(&nodeMailbox[index], NODE_STATE_PACK(rssi, ultrasonic, 0));
+    atomic_or(&nodeMailboxPending, BIT(index));
+
+    // Binary semaphore, repeated gives while the listener is busy coalesce
+    k_sem_give(&nodeMailboxSem);
+}
+
+/**
+ * @brief       Decode the static node payload of an advertisement, if it has one
+ * @param       buf:        Data buffer of message
+ * @param       payload:    Decoded payload
+ * @retval      0 if successful, <0 if there is no static node payload
+ */
+static inline int bt_staticPayload(struct net_buf_simple* buf, 
+        StaticPayload* payload) {
+
+    const uint8_t* data;
+    uint8_t len;
+
+    if (os_payloadFind(buf->data, buf->len, &data, &len) != 0) {
+
+        return -ENOENT;
+    }
+
+    return os_payloadDecodeStatic(data, len, payload);
+}
+
+/**
+ * @brief       Account for a static node payload's sequence number and 
+ *              uptime. Nodes repeat a payload until it changes, so repeats 
+ *              are ignored and any gap is counted as lost payloads.
+ * @param       index:      Node index
+ * @param       payload:    Decoded payload
+ */
+static void bt_staticHop(uint8_t index, const StaticPayload* payload) {
+
+    HopStats* hop = &os_btHopStats[index];
+    uint16_t transit = (uint16_t)k_uptime_get_32() - payload->uptime;
+
+    if (hop->seen && payload->seq == hop->lastSeq) {
+
         return;
     }
 
-    // Listen for messages from all the (non-ultrasonic) static nodes
-    for (uint8_t i = NUM_ULTRASONIC_NODES; i < NUM_STATIC_NODES; i++) {
-
-        if (addressesEqual(addr->a, nodeList[i].node.address)) {
-
-            uint8_t payload[PAYLOAD_SIZE];                                          
-            // Make up the payload array                                            
-            for (uint8_t j = 0; j < PAYLOAD_SIZE; j++) {                            
-                                                                                
-                payload[j] = buf->data[j + PAYLOAD_BUFFER_OFFSET];                  
-            }                                                                       
-                                                                                
-            // Make up the message item to send to listening thread                 
-            NodeQueueItem nodeQueueItem;                                            
-            nodeQueueItem.index = i;                                                
-            nodeQueueItem.rssi = rssi;                                              
-            memcpy(&nodeQueueItem.payload, &payload, sizeof(payload));              
-                                                                                
-            // Send off message to listening thread                                 
-            while (k_msgq_put(&os_QueueBtNodeMessage, &nodeQueueItem, K_NO_WAIT)    
-                    != 0) {                                                         
-                                                                                
-                k_msgq_purge(&os_QueueBtNodeMessage);                               
-            }
-            return;
-        }
+    if (hop->seen) {
+
+        atomic_add(&hop->lost, (uint8_t)(payload->seq - hop->lastSeq - 1));
+
+        // Clock offset cancels out of the transit difference
+        int16_t d = (int16_t)(transit - hop->lastTransit);
+        atomic_val_t jitter = atomic_get(&hop->jitter);
+        atomic_set(&hop->jitter, jitter + (d < 0 ? -d : d) - (jitter >> 4));
     }
+    atomic_inc(&hop->received);
+    hop->lastSeq = payload->seq;
+    hop->lastTransit = transit;
+    hop->seen = true;
+}
 
-    // ----- Listen for messages from other mobile nodes -----
-    else if (addressesEqual(addr->a, mobileNodes[0]) ||
-             addressesEqual(addr->a, mobileNodes[1]) || 
-             addressesEqual(addr->a, mobileNodes[2])) {
+/**
+ * @brief       Check a mobile node advertisement for social distancing 
+ *              violations
+ * @param       addr:   Address of the other mobile node
+ * @param       rssi:   RSSI strength of response
+ */
+static void bt_mobileProximity(const bt_addr_le_t* addr, int8_t rssi) {
 
-        uint8_t isResident = false;
-        uint8_t isCoresident = false;
+    uint8_t isResident = false;
+    uint8_t isCoresident = false;
 #ifdef LEGACY_FAMILY_MEMBERS
-        for (uint16_t i = 0; i < 2; i++) {
+    for (uint16_t i = 0; i < 2; i++) {
 
-            if (addressesEqual(householdAddresses[i], ownAddress)) {
+        if (addressesEqual(householdAddresses[i], ownAddress)) {
 
-                isResident = true;
-                break;
-            }
+            isResident = true;
+            break;
         }
+    }
 
-        for (uint16_t i = 0; i < 2; i++) {
+    for (uint16_t i = 0; i < 2; i++) {
 
-            if (addressesEqual(householdAddresses[i], addr->a)) {
+        if (addressesEqual(householdAddresses[i], addr->a)) {
 
-                isCoresident = true;
-                break;
-            }
+            isCoresident = true;
+            break;
         }
+    }
 
 #else
-        int16_t ourHouse = -1;
-        // Iterate through and find the house we live at
-        for (uint8_t i = 0; i < numHouseholds; i++) {
+    int16_t ourHouse = -1;
+    // Iterate through and find the house we live at
+    for (uint8_t i = 0; i < numHouseholds; i++) {
 
-            for (uint8_t j = 0; j < householdList[i].numResidents; j++) {
+        for (uint8_t j = 0; j < householdList[i].numResidents; j++) {
 
-                if (addressesEqual(householdList[i].addresses[j], selfAddr.a)) {
+            if (addressesEqual(householdList[i].addresses[j], selfAddr.a)) {
 
-                    ourHouse = i;
-                    isResident = true;
-                    break;
-                }
+                ourHouse = i;
+                isResident = true;
+                break;
             }
         }
-        if (ourHouse != -1) {
-            
-            // We live in a house (that is registered), now find if other lives
-            // in our house as well (iterate over residents)
-            for (uint8_t j = 0; j < householdList[ourHouse].numResidents; 
-                    j++) {
-
-                if (addressesEqual(householdList[ourHouse].addresses[j], 
-                        addr->a)) {
-
-                    isCoresident = true;
-                    break;
-                }
+    }
+    if (ourHouse != -1) {
+        
+        // We live in a house (that is registered), now find if other lives
+        // in our house as well (iterate over residents)
+        for (uint8_t j = 0; j < householdList[ourHouse].numResidents; j++) {
+
+            if (addressesEqual(householdList[ourHouse].addresses[j], 
+                    addr->a)) {
+
+                isCoresident = true;
+                break;
             }
         }
+    }
 
 
 #endif // LEGACY_FAMILY_MEMBERS
-        uint8_t housePartner = isResident && isCoresident;
+    uint8_t housePartner = isResident && isCoresident;
+
+    if (housePartner || rssi < -60) {
+        violatingDistance = false;
+        return;
+    }
+    violatingDistance = true;
+}
 
-        if (housePartner || rssi < -60) {
-            violatingDistance = false;
+/**
+ * @brief       Callback function for mobile node scan
+ * @param       addr:       Address of scan response
+ * @param       rssi:       RSSI strength of response
+ * @param       adv_type:   Response message type
+ * @param       buf:        Data buffer of message
+ */
+void bt_mobileCallback(const bt_addr_le_t *addr, int8_t rssi, uint8_t adv_type,
+		    struct net_buf_simple *buf) {
+
+    StaticPayload payload;
+
+    // Known nodes are classified with a single index lookup
+    const AdvIndexEntry* entry = advIndexLookup(&addr->a);
+    if (entry == NULL) {
+
+        // Ultrasonic static nodes are identified by the node id in their
+        // payload rather than their address
+        if (bt_staticPayload(buf, &payload) == 0 && payload.nodeId >= 1 && 
+                payload.nodeId <= NUM_ULTRASONIC_NODES) {
+
+            atomic_inc(&os_btAdvStats.accepted);
+            bt_staticHop(payload.nodeId - 1, &payload);
+            bt_postNodeMessage(payload.nodeId - 1, rssi, payload.ultrasonic);
             return;
         }
-        violatingDistance = true;
 
+        atomic_inc(&os_btAdvStats.rejected);
+        return;
+    }
+
+    atomic_inc(&os_btAdvStats.accepted);
+
+    if (entry->kind == ADV_KIND_STATIC) {
+
+        // Beacons don't send our payload, only their RSSI matters
+        uint16_t ultrasonic = PAYLOAD_US_NONE;
+        if (nodeList[entry->slot].node.hasUltrasonic && 
+                bt_staticPayload(buf, &payload) == 0) {
+
+            bt_staticHop(entry->slot, &payload);
+            ultrasonic = payload.ultrasonic;
+        }
+        bt_postNodeMessage(entry->slot, rssi, ultrasonic);
+
+    } else if (entry->kind == ADV_KIND_MOBILE) {
+
+        // ----- Listen for messages from other mobile nodes -----
+        bt_mobileProximity(addr, rssi);
     }
 }
 
@@ -379,6 +546,46 @@ void os_bluetooth_mobileBeaconInit(int err) {
 
 }
 
+/**
+ * @brief   Reset the live state of every node to "not heard"
+ */
+void os_bluetoothNodeStateInit(void) {
+
+    for (uint8_t i = 0; i < NUM_STATIC_NODES; i++) {
+
+        atomic_set(&os_NodeState[i], NODE_STATE_PACK(NODE_RSSI_NONE, 
+                PAYLOAD_US_NONE, 0));
+    }
+    atomic_set(&os_NodeStateStamp, 0);
+    atomic_set(&os_NodeStateChanges, 0);
+    memset(os_btHopStats, 0, sizeof(os_btHopStats));
+}
+
+/**
+ * @brief   Take a copy of the live readings of every node. Never blocks - each
+ *          node's RSSI and ultrasonic reading are read together from a single
+ *          atomic word, so they are always consistent with each other.
+ *          The change count is read first, so a change landing mid-copy is
+ *          seen again with a higher count on the next snapshot.
+ * @param   snapshot:   Snapshot to fill in
+ */
+void os_bluetoothNodeSnapshot(NodeSnapshot* snapshot) {
+
+    snapshot->changes = (uint32_t)atomic_get(&os_NodeStateChanges);
+    snapshot->stamp = (uint32_t)atomic_get(&os_NodeStateStamp);
+
+    for (uint8_t i = 0; i < NUM_STATIC_NODES; i++) {
+
+        atomic_val_t state = atomic_get(&os_NodeState[i]);
+
+        snapshot->rssi[i] = NODE_STATE_RSSI(state);
+        if (i < NUM_ULTRASONIC_NODES) {
+
+            snapshot->ultrasonic[i] = NODE_STATE_US(state);
+        }
+    }
+}
+
 /**
  * @brief   Thread routine for mobile node queue listening - this thread is 
  *          responsible for listening on the queue of incoming bluetooth
@@ -387,55 +594,76 @@ void os_bluetooth_mobileBeaconInit(int err) {
  */
 uint8_t os_bluetoothMobileListen(void* args) {
 
-    NodeQueueItem nodeQueueItem;
+    // Wake up often enough to notice nodes going stale even when nothing is
+    // being heard at all
+    k_timeout_t staleCheck = CONFIG_RSSI_STALE_TIMEOUT_MS == 0 ? K_FOREVER :
+            K_MSEC(MAX(CONFIG_RSSI_STALE_TIMEOUT_MS / 4, 1));
+
+    os_rssiFilterInit();
 
     while (1) {
 
-        // Get next item from queue
-        k_msgq_get(&os_QueueBtNodeMessage, &nodeQueueItem, K_FOREVER);
+        // Wait for at least one node to have a new reading
+        k_sem_take(&nodeMailboxSem, staleCheck);
 
-        // Unpack incoming message into bytes
+        uint32_t now = k_uptime_get_32();
+        uint32_t pending = (uint32_t)atomic_clear(&nodeMailboxPending);
 
-        uint8_t index = nodeQueueItem.index;
-        int8_t  rssi  = nodeQueueItem.rssi;
-        uint8_t payload[PAYLOAD_SIZE];
-        memcpy(&payload, &nodeQueueItem.payload, sizeof(payload));
+        while (pending != 0) {
 
-        // Only 1 thread should access the node list at a time
-        k_mutex_lock(&os_MutexNodeList, K_FOREVER);
-        for (uint8_t i = 0; i < NUM_STATIC_NODES; i++) {
+            uint8_t index = __builtin_ctz(pending);
+            pending &= pending - 1;
 
-            // Look for item in node list with given index
-            if (nodeList[i].index == index) {
+            atomic_val_t message = atomic_get(&nodeMailbox[index]);
+            int8_t rssi = os_rssiFilterUpdate(index, 
+                    NODE_STATE_RSSI(message), now);
 
-                // We have the correct node item
-                nodeList[i].node.rssi = rssi;
-                // If this item is an ultrasonic sensor, save additional
-                // ultrasonic ranging information
-                if (nodeList[i].node.hasUltrasonic) {
+            // This is the only thread writing node state, so a plain read-
+            // modify-write of our own word is safe; readers only ever see 
+            // whole words
+            atomic_val_t state = atomic_get(&os_NodeState[index]);
+            uint16_t ultrasonic = NODE_STATE_US(state);
 
-                    nodeList[i].node.ultrasonic = payload[4];
+            // If this item is an ultrasonic sensor, save additional 
+            // ultrasonic ranging information
+            if (nodeList[index].node.hasUltrasonic) {
 
-                    break;
-                }
+                ultrasonic = NODE_STATE_US(message);
             }
-        }
-
 
 #ifdef DEBUG_PRINT
+            printk("message [%d - RSSI: %d (raw %d) - US: %d]\n", index, 
+                    rssi, NODE_STATE_RSSI(message), ultrasonic);
+#endif  // DEBUG_PRINT
+
+            // Filtered values often settle, only publish actual changes
+            if (rssi == NODE_STATE_RSSI(state) && 
+                    ultrasonic == NODE_STATE_US(state)) {
 
-        printk("message [%d - RSSI: %d]: ", nodeQueueItem.index, 
-                nodeQueueItem.rssi);
-    
-        for (uint8_t i = 0; i < 16; i++) {
+                continue;
+            }
 
-            printk("%d:", nodeQueueItem.payload[i]);
+            atomic_set(&os_NodeState[index], NODE_STATE_PACK(rssi, 
+                    ultrasonic, NODE_STATE_COUNT(state) + 1));
+            atomic_set(&os_NodeStateStamp, now);
+            atomic_inc(&os_NodeStateChanges);
+            k_sem_give(&os_SemNodeStateChanged);
         }
-        
-        printk("\n");
 
-#endif  // DEBUG_PRINT
-        k_mutex_unlock(&os_MutexNodeList);
+        // Nodes we have not heard from in a while go back to "not heard"
+        for (uint8_t index = 0; index < NUM_STATIC_NODES; index++) {
+
+            if (os_rssiFilterExpire(index, now)) {
+
+                atomic_val_t state = atomic_get(&os_NodeState[index]);
+                atomic_set(&os_NodeState[index], NODE_STATE_PACK(
+                        NODE_RSSI_NONE, PAYLOAD_US_NONE, 
+                        NODE_STATE_COUNT(state) + 1));
+                atomic_set(&os_NodeStateStamp, now);
+                atomic_inc(&os_NodeStateChanges);
+                k_sem_give(&os_SemNodeStateChanged);
+            }
+        }
     }
 
     return 0;
@@ -10,15 +10,17 @@
 ***************************************************************
 * os_hci_transmit(uint8_t sid, size_t argc, char** argv, uint8_t device) - Transmit packet via SPI.
 * os_hci_receive() - Receive packet via SPI
-* os_hci_reg_process() - Process i2C request  
-* os_hci_lsm() - Process lsm6dsl request
-* os_transmit_lsm(uint8_t read_register) - Transmit response for I2C request
+* os_hci_reg_read(uint8_t sid, size_t argc, char** argv, uint8_t* value) - Read i2c register via SPI
+* os_hci_lsm_read(uint8_t axis, int16_t* value) - Read lsm6dsl axis via SPI
+* os_hci_batch_read(const struct BatchOp* ops, uint8_t count, uint8_t* data) - Read several registers in one request
 ***************************************************************
 */
 
 #include <stdlib.h>
 #include <zephyr.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/util.h>
 #include <shell/shell.h>
 #include <shell/shell_uart.h>
 #include <lsm6dsl/lsm6dsl.h>
@@ -50,7 +52,26 @@ void os_hci_receive() {
     hal_hci_receive();
     memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER );
 
-    if (unparsed_msg[2] == 1) {  // check for lsm6dsl request
+    if (unparsed_msg[1] == HCI_TYPE_BATCH) { // batch of register reads
+
+        struct BatchOp ops[HCI_BATCH_MAX_OPS];
+        uint8_t data[HCI_BATCH_MAX_DATA];
+        uint8_t count = hal_parse_batch(unparsed_msg, ops);
+        uint8_t length = 0;
+        uint8_t done;
+
+        // Read back to back, stopping at the first failure or overflow
+        for (done = 0; done < count; done++) {
+            if (length + ops[done].length > sizeof(data) ||
+                    os_i2c_read_bytes(i2c_dev, ops[done].reg_addr,
+                    &data[length], ops[done].length,
+                    ops[done].i2c_addr) != 0) {
+                break;
+            }
+            length += ops[done].length;
+        }
+        hal_batch_slave_to_master(done, data, length);
+    } else if (unparsed_msg[2] == 1) {  // check for lsm6dsl request
 
         if (unparsed_msg[3] == 1) { // x-axis
             int16_t x;
@@ -101,48 +122,90 @@ void os_hci_receive() {
 }
 
 /**
- * @brief Process i2C request  
+ * @brief Read i2c register via SPI, waits only as long as the slave takes
+ * 
+ * @param sid: sensor ID
+ * @param argc: size of argv
+ * @param argv: list of argv
+ * @param value: register value read
+ * @retval 0 if successful, otherwise the hal_hci_request_sync() error
+ * 
  **/
-uint8_t os_hci_reg_process() {
+int os_hci_reg_read(uint8_t sid, size_t argc, char** argv, uint8_t* value) {
 
+    uint8_t msg[SPI_BUFFER];
+    uint8_t resp[SPI_BUFFER];
     struct Packetback recv;
-    uint8_t unparsed_msg[SPI_BUFFER];
-    hal_hci_receive();
-    memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER );
-    recv = hal_master_from_slave(unparsed_msg);
-    return recv.d1;
-    // shell_print(shell, "Register value:%d", recv.sid, recv.d1);
+    int err;
+
+    hal_build_request(msg, sid, argc, argv, HCI_TYPE_REQUEST);
+    err = hal_hci_request_sync(msg, resp, K_MSEC(HCI_TIMEOUT_MS));
+    if (err != 0) {
+        return err;
+    }
+
+    recv = hal_master_from_slave(resp);
+    *value = recv.d1;
+    return 0;
 }
 
 /**
- * @brief Process lsm6dsl request
+ * @brief Read lsm6dsl axis via SPI, waits only as long as the slave takes
+ * 
+ * @param axis: 1 for x, 2 for y, 3 for z
+ * @param value: raw axis reading
+ * @retval 0 if successful, otherwise the hal_hci_request_sync() error
+ * 
  **/
-struct Packetback os_hci_lsm() {
+int os_hci_lsm_read(uint8_t axis, int16_t* value) {
 
-    struct Packetback recv;
-    uint8_t unparsed_msg[SPI_BUFFER];
-    hal_hci_receive();
-    memcpy(unparsed_msg, rxBuffer, sizeof(uint8_t) * SPI_BUFFER );
-    recv = hal_master_from_slave(unparsed_msg);
-    return recv;
-    // shell_print(shell, "Register value:%d", recv.sid, recv.d1);
+    uint8_t msg[SPI_BUFFER];
+    uint8_t resp[SPI_BUFFER];
+    int err;
+
+    hal_build_lsm_request(msg, axis);
+    err = hal_hci_request_sync(msg, resp, K_MSEC(HCI_TIMEOUT_MS));
+    if (err != 0) {
+        return err;
+    }
 
+    *value = (int16_t)(resp[3] << 8 | resp[4]);
+    return 0;
 }
 
 /**
- * @brief Transmit response for I2C request
+ * @brief Read several registers in one request, the slave reads them back
+ *        to back and returns all the data in one response
  * 
- * @param read_register: Register value to be sent
+ * @param ops: Registers to read
+ * @param count: Number of ops
+ * @param data: Data of each op in order, up to HCI_BATCH_MAX_DATA bytes
+ * @retval 0 if every op was read, -EIO if the slave failed part way,
+ *         otherwise the hal_build_batch() or hal_hci_request_sync() error
  * 
  **/
-void os_transmit_lsm(uint8_t read_register) {
-    uint8_t msg[SPI_BUFFER];
-    msg[0] = 0xAA;
-    msg[1] = 1;
-    msg[2] = 1;
-    msg[3] = read_register;
+int os_hci_batch_read(const struct BatchOp* ops, uint8_t count,
+        uint8_t* data) {
 
-    hal_hci_transmit(msg);
+    uint8_t msg[SPI_BUFFER];
+    uint8_t resp[SPI_BUFFER];
+    uint8_t total = 0;
+    int err;
+
+    err = hal_build_batch(msg, ops, count);
+    if (err != 0) {
+        return err;
+    }
+
+    err = hal_hci_request_sync(msg, resp, K_MSEC(HCI_TIMEOUT_MS));
+    if (err != 0) {
+        return err;
+    }
+
+    // Never more than asked for, whatever the slave claims
+    for (uint8_t i = 0; i < count; i++) {
+        total += ops[i].length;
+    }
+    memcpy(data, &resp[HCI_BATCH_DATA], MIN(resp[2], total));
+    return resp[3] == count ? 0 : -EIO;
 }
-
-
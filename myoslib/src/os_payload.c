@@ -0,0 +1,356 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_payload.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Advertising payload codec shared by static, mobile and base
+ *                  nodes. See os_payload.h for the wire format.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_payloadFind()         - Find our service data in raw advertising data
+ * os_payloadKind()         - Check version and get the kind of a payload
+ * os_payloadEncodeStatic() - Encode a static node payload
+ * os_payloadDecodeStatic() - Decode a static node payload
+ * os_payloadEncodeMobile() - Encode a mobile node payload
+ * os_payloadDecodeMobile() - Decode a mobile node payload
+ ******************************************************************************
+ */
+
+#include <zephyr/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/util.h>
+#include <bluetooth/bluetooth.h>
+
+#include <os_payload.h>
+
+/**
+ * @brief   Find our (Eddystone UUID) service data in raw advertising data,
+ *          walking the AD structures rather than assuming fixed offsets
+ * @param   ad:         Raw advertising data
+ * @param   adLen:      Length of advertising data
+ * @param   data:       Set to the first byte after the UUID
+ * @param   dataLen:    Set to the number of bytes after the UUID
+ * @retval  0 if found, -ENOENT otherwise
+ */
+int os_payloadFind(const uint8_t* ad, uint8_t adLen, const uint8_t** data,
+        uint8_t* dataLen) {
+
+    uint8_t i = 0;
+
+    // Each structure is [length] [type] [length - 1 bytes of data]
+    while (i + 1 < adLen) {
+
+        uint8_t len = ad[i];
+        if (len == 0 || i + 1 + len > adLen) {
+
+            break;
+        }
+
+        if (ad[i + 1] == BT_DATA_SVC_DATA16 && len >= 3 &&
+                ad[i + 2] == PAYLOAD_UUID_0 && ad[i + 3] == PAYLOAD_UUID_1) {
+
+            *data = &ad[i + 4];
+            *dataLen = len - 3;
+            return 0;
+        }
+
+        i += 1 + len;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief   Check the version of a payload and get its kind
+ * @param   buf:    Payload
+ * @param   len:    Payload length
+ * @retval  PAYLOAD_KIND_*, or -EINVAL if not a payload we understand
+ */
+int os_payloadKind(const uint8_t* buf, uint8_t len) {
+
+    if (len < 2 || (buf[0] >> 4) != PAYLOAD_VERSION) {
+
+        return -EINVAL;
+    }
+
+    return buf[0] & 0x0F;
+}
+
+/**
+ * @brief   Encode a static node payload
+ * @param   payload:    Payload to encode
+ * @param   buf:        Buffer to encode into
+ * @param   size:       Size of buffer
+ * @retval  Encoded length, or -ENOSPC if the buffer is too small
+ */
+int os_payloadEncodeStatic(const StaticPayload* payload, uint8_t* buf, 
+        uint8_t size) {
+
+    if (size < PAYLOAD_STATIC_LEN) {
+
+        return -ENOSPC;
+    }
+
+    buf[0] = (PAYLOAD_VERSION << 4) | PAYLOAD_KIND_STATIC;
+    buf[1] = payload->seq;
+    buf[2] = payload->nodeId;
+    buf[3] = payload->ultrasonic & 0xFF;
+    buf[4] = payload->ultrasonic >> 8;
+    buf[5] = payload->uptime & 0xFF;
+    buf[6] = payload->uptime >> 8;
+
+    return PAYLOAD_STATIC_LEN;
+}
+
+/**
+ * @brief   Decode a static node payload
+ * @param   buf:        Payload
+ * @param   len:        Payload length
+ * @param   payload:    Decoded payload
+ * @retval  0 if successful, -EINVAL if not a valid static node payload
+ */
+int os_payloadDecodeStatic(const uint8_t* buf, uint8_t len, 
+        StaticPayload* payload) {
+
+    if (os_payloadKind(buf, len) != PAYLOAD_KIND_STATIC || 
+            len < PAYLOAD_STATIC_LEN) {
+
+        return -EINVAL;
+    }
+
+    payload->seq = buf[1];
+    payload->nodeId = buf[2];
+    payload->ultrasonic = buf[3] | (buf[4] << 8);
+    payload->uptime = buf[5] | (buf[6] << 8);
+
+    return 0;
+}
+
+/**
+ * @brief   Encode a mobile node payload. Heard anchors are sent as bit packed
+ *          offsets from the weakest heard RSSI. If the buffer is too small for
+ *          the full range, the offsets are narrowed and the weakest anchors
+ *          saturate at the new floor - strong anchors keep full precision.
+ *          Hop statistics only go in the space left over after that.
+ * @param   payload:    Payload to encode
+ * @param   buf:        Buffer to encode into
+ * @param   size:       Size of buffer
+ * @retval  Encoded length, -EINVAL for a bad payload, or -ENOSPC if the 
+ *          buffer is too small even for 0 bit offsets
+ */
+int os_payloadEncodeMobile(const MobilePayload* payload, uint8_t* buf, 
+        uint8_t size) {
+
+    uint16_t heard = 0;
+    uint8_t numHeard = 0;
+    uint8_t usMask = 0;
+    uint8_t usCount = 0;
+    int16_t min = 127;
+    int16_t max = PAYLOAD_RSSI_NONE;
+
+    if (payload->numAnchors > PAYLOAD_MAX_ANCHORS) {
+
+        return -EINVAL;
+    }
+
+    for (uint8_t i = 0; i < payload->numAnchors; i++) {
+
+        int8_t rssi = payload->rssi[i];
+        if (rssi == PAYLOAD_RSSI_NONE) {
+
+            continue;
+        }
+
+        heard |= 1 << i;
+        numHeard++;
+        min = MIN(min, rssi);
+        max = MAX(max, rssi);
+    }
+
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
+
+        if (payload->ultrasonic[i] != PAYLOAD_US_NONE) {
+
+            usMask |= 1 << i;
+            usCount++;
+        }
+    }
+
+    int16_t space = size - PAYLOAD_MOBILE_HEADER_LEN - 2 * usCount;
+    if (space < 0) {
+
+        return -ENOSPC;
+    }
+
+    // Narrowest width that holds the whole range, capped by what fits
+    uint8_t width = 0;
+    if (numHeard > 0) {
+
+        while (width < PAYLOAD_MAX_DELTA_BITS && 
+                (max - min) >= (1 << width)) {
+
+            width++;
+        }
+        width = MIN(width, (space * 8) / numHeard);
+        min = MAX(min, max - ((1 << width) - 1));
+    } else {
+
+        min = 0;
+    }
+
+    // Never narrow the offsets to make room for the hop statistics
+    uint8_t hop = payload->hasHop && usCount > 0 && 
+            (numHeard * width + 7) / 8 + 2 * usCount <= space;
+
+    buf[0] = (PAYLOAD_VERSION << 4) | PAYLOAD_KIND_MOBILE;
+    buf[1] = payload->seq;
+    buf[2] = payload->numAnchors;
+    buf[3] = width | (usMask << 4) | (hop ? PAYLOAD_HOP_PRESENT : 0);
+    buf[4] = heard & 0xFF;
+    buf[5] = heard >> 8;
+    buf[6] = (uint8_t)(int8_t)min;
+    buf[7] = payload->uptime & 0xFF;
+    buf[8] = payload->uptime >> 8;
+    buf[9] = payload->age;
+
+    // Pack offsets LSB first
+    uint8_t len = PAYLOAD_MOBILE_HEADER_LEN;
+    uint16_t bits = 0;
+    uint8_t numBits = 0;
+
+    for (uint8_t i = 0; i < payload->numAnchors; i++) {
+
+        if (!(heard & (1 << i))) {
+
+            continue;
+        }
+
+        int16_t delta = MAX(payload->rssi[i] - min, 0);
+        bits |= delta << numBits;
+        numBits += width;
+
+        while (numBits >= 8) {
+
+            buf[len++] = bits & 0xFF;
+            bits >>= 8;
+            numBits -= 8;
+        }
+    }
+
+    if (numBits > 0) {
+
+        buf[len++] = bits & 0xFF;
+    }
+
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
+
+        if (usMask & (1 << i)) {
+
+            buf[len++] = payload->ultrasonic[i] & 0xFF;
+            buf[len++] = payload->ultrasonic[i] >> 8;
+        }
+    }
+
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
+
+        if (hop && (usMask & (1 << i))) {
+
+            buf[len++] = payload->hopLost[i];
+            buf[len++] = payload->hopJitter[i];
+        }
+    }
+
+    return len;
+}
+
+/**
+ * @brief   Decode a mobile node payload
+ * @param   buf:        Payload
+ * @param   len:        Payload length
+ * @param   payload:    Decoded payload, anchors not heard are 
+ *                      PAYLOAD_RSSI_NONE and missing ultrasonic readings are
+ *                      PAYLOAD_US_NONE. Hop statistics are 0 unless hasHop.
+ * @retval  0 if successful, -EINVAL if not a valid mobile node payload
+ */
+int os_payloadDecodeMobile(const uint8_t* buf, uint8_t len, 
+        MobilePayload* payload) {
+
+    if (os_payloadKind(buf, len) != PAYLOAD_KIND_MOBILE || 
+            len < PAYLOAD_MOBILE_HEADER_LEN || 
+            buf[2] > PAYLOAD_MAX_ANCHORS) {
+
+        return -EINVAL;
+    }
+
+    uint8_t width = buf[3] & 0x07;
+    uint8_t usMask = (buf[3] >> 4) & 0x03;
+    uint16_t heard = buf[4] | (buf[5] << 8);
+    int8_t min = (int8_t)buf[6];
+    uint8_t pos = PAYLOAD_MOBILE_HEADER_LEN;
+    uint16_t bits = 0;
+    uint8_t numBits = 0;
+
+    payload->seq = buf[1];
+    payload->uptime = buf[7] | (buf[8] << 8);
+    payload->age = buf[9];
+    payload->numAnchors = buf[2];
+
+    for (uint8_t i = 0; i < payload->numAnchors; i++) {
+
+        if (!(heard & (1 << i))) {
+
+            payload->rssi[i] = PAYLOAD_RSSI_NONE;
+            continue;
+        }
+
+        while (numBits < width) {
+
+            if (pos >= len) {
+
+                return -EINVAL;
+            }
+            bits |= buf[pos++] << numBits;
+            numBits += 8;
+        }
+
+        payload->rssi[i] = min + (bits & ((1 << width) - 1));
+        bits >>= width;
+        numBits -= width;
+    }
+
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
+
+        payload->ultrasonic[i] = PAYLOAD_US_NONE;
+        if (usMask & (1 << i)) {
+
+            if (pos + 2 > len) {
+
+                return -EINVAL;
+            }
+            payload->ultrasonic[i] = buf[pos] | (buf[pos + 1] << 8);
+            pos += 2;
+        }
+    }
+
+    payload->hasHop = (buf[3] & PAYLOAD_HOP_PRESENT) != 0;
+    for (uint8_t i = 0; i < PAYLOAD_MAX_ULTRASONIC; i++) {
+
+        payload->hopLost[i] = 0;
+        payload->hopJitter[i] = 0;
+        if (payload->hasHop && (usMask & (1 << i))) {
+
+            if (pos + 2 > len) {
+
+                return -EINVAL;
+            }
+            payload->hopLost[i] = buf[pos];
+            payload->hopJitter[i] = buf[pos + 1];
+            pos += 2;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_rssi.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Per-node RSSI smoothing filters for the mobile node. The
+ *                  filter is picked at build time (CONFIG_RSSI_FILTER_*), and
+ *                  everything is integer maths so an update is a handful of
+ *                  instructions on the nRF52.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_rssiFilterInit()      - Reset every node's filter
+ * os_rssiFilterUpdate()    - Feed a raw RSSI sample, get the filtered value
+ * os_rssiFilterExpire()    - Check (and reset) a node that has gone quiet
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <string.h>
+
+#include <os_bluetooth.h>
+#include <os_rssi.h>
+
+BUILD_ASSERT(CONFIG_RSSI_FILTER_MEDIAN_LEN % 2 == 1, 
+        "Median filter length must be odd");
+
+// Filter state of a single node
+typedef struct {
+    uint8_t     heard;
+    uint32_t    lastHeard;
+#if defined(CONFIG_RSSI_FILTER_EWMA)
+    int32_t     estimate;       // RSSI, fixed point
+#elif defined(CONFIG_RSSI_FILTER_MEDIAN)
+    int8_t      window[CONFIG_RSSI_FILTER_MEDIAN_LEN];
+    uint8_t     next;
+    uint8_t     count;
+#elif defined(CONFIG_RSSI_FILTER_KALMAN)
+    int32_t     estimate;       // RSSI, fixed point
+    int32_t     variance;       // Estimate variance (dB^2), fixed point
+#endif
+} RssiFilter;
+
+// Filter state of every node, only touched by the listening thread
+static RssiFilter filters[NUM_STATIC_NODES];
+
+/**
+ * @brief   Reset every node's filter to "not heard"
+ */
+void os_rssiFilterInit(void) {
+
+    memset(filters, 0, sizeof(filters));
+}
+
+/**
+ * @brief   Round a fixed point RSSI to the nearest whole dB
+ * @param   value:  Fixed point RSSI
+ * @retval  RSSI in dB
+ */
+static inline int8_t rssiRound(int32_t value) {
+
+    return (int8_t)((value + (1 << (RSSI_FRAC_BITS - 1))) >> RSSI_FRAC_BITS);
+}
+
+#if defined(CONFIG_RSSI_FILTER_MEDIAN)
+/**
+ * @brief   Median of a node's sample window
+ * @param   filter: Node filter state
+ * @retval  Median of the samples seen so far
+ */
+static int8_t rssiMedian(const RssiFilter* filter) {
+
+    int8_t sorted[CONFIG_RSSI_FILTER_MEDIAN_LEN];
+
+    // Insertion sort - the window is tiny
+    for (uint8_t i = 0; i < filter->count; i++) {
+
+        int8_t value = filter->window[i];
+        int8_t j = i - 1;
+
+        while (j >= 0 && sorted[j] > value) {
+
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = value;
+    }
+
+    return sorted[filter->count / 2];
+}
+#endif  // CONFIG_RSSI_FILTER_MEDIAN
+
+/**
+ * @brief   Feed a raw RSSI sample through a node's filter
+ * @param   index:  Node list index
+ * @param   rssi:   Raw RSSI of the latest advertisement
+ * @param   now:    Current uptime (ms)
+ * @retval  Filtered RSSI
+ */
+int8_t os_rssiFilterUpdate(uint8_t index, int8_t rssi, uint32_t now) {
+
+    RssiFilter* filter = &filters[index];
+    int32_t sample = (int32_t)rssi << RSSI_FRAC_BITS;
+    uint8_t first = !filter->heard;
+
+    filter->heard = true;
+    filter->lastHeard = now;
+
+#if defined(CONFIG_RSSI_FILTER_EWMA)
+
+    if (first) {
+
+        filter->estimate = sample;
+    } else {
+
+        // estimate += (sample - estimate) / 2^shift
+        filter->estimate += (sample - filter->estimate) >> 
+                CONFIG_RSSI_FILTER_EWMA_SHIFT;
+    }
+
+    return rssiRound(filter->estimate);
+
+#elif defined(CONFIG_RSSI_FILTER_MEDIAN)
+
+    ARG_UNUSED(sample);
+    ARG_UNUSED(first);
+
+    filter->window[filter->next] = rssi;
+    filter->next = (filter->next + 1) % CONFIG_RSSI_FILTER_MEDIAN_LEN;
+    if (filter->count < CONFIG_RSSI_FILTER_MEDIAN_LEN) {
+
+        filter->count++;
+    }
+
+    return rssiMedian(filter);
+
+#elif defined(CONFIG_RSSI_FILTER_KALMAN)
+
+    if (first) {
+
+        filter->estimate = sample;
+        filter->variance = CONFIG_RSSI_FILTER_KALMAN_R;
+        return rssi;
+    }
+
+    // Predict - RSSI is modelled as constant plus process noise
+    filter->variance += CONFIG_RSSI_FILTER_KALMAN_Q;
+
+    // Update - gain is fixed point, 0..(1 << RSSI_FRAC_BITS)
+    int32_t gain = (filter->variance << RSSI_FRAC_BITS) / 
+            (filter->variance + CONFIG_RSSI_FILTER_KALMAN_R);
+    filter->estimate += (gain * (sample - filter->estimate)) >> 
+            RSSI_FRAC_BITS;
+    filter->variance = (((1 << RSSI_FRAC_BITS) - gain) * filter->variance) >> 
+            RSSI_FRAC_BITS;
+
+    return rssiRound(filter->estimate);
+
+#else
+
+    ARG_UNUSED(sample);
+    ARG_UNUSED(first);
+
+    return rssi;
+
+#endif  // CONFIG_RSSI_FILTER_*
+}
+
+/**
+ * @brief   Check whether a node has gone quiet for longer than the staleness 
+ *          timeout. A stale node has its filter reset, so the next sample it
+ *          sends starts from scratch.
+ * @param   index:  Node list index
+ * @param   now:    Current uptime (ms)
+ * @retval  true if the node has just gone stale, false otherwise
+ */
+uint8_t os_rssiFilterExpire(uint8_t index, uint32_t now) {
+
+    RssiFilter* filter = &filters[index];
+
+    if (CONFIG_RSSI_STALE_TIMEOUT_MS == 0 || !filter->heard) {
+
+        return false;
+    }
+
+    // Unsigned subtraction copes with uptime wrapping
+    if ((uint32_t)(now - filter->lastHeard) < CONFIG_RSSI_STALE_TIMEOUT_MS) {
+
+        return false;
+    }
+
+    memset(filter, 0, sizeof(*filter));
+    return true;
+}
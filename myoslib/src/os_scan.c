@@ -0,0 +1,263 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_scan.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Scan duty cycle scheduler. Scanning starts continuous, and
+ *                  backs off one level at a time while the RSSI vector is 
+ *                  stable and we still hear enough frames. Motion drops 
+ *                  straight back to continuous, and missing frames steps
+ *                  back up a level.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_scanStart()           - Start scanning at the densest level
+ * os_scanRestart()         - Restart scanning after the parameters changed
+ * os_scanNoteRssi()        - Give the latest RSSI vector (motion detection)
+ * os_scanTick()            - Run the scheduler, adapts once per epoch
+ * os_scanGetStats()        - Copy of the scan counters
+ * os_scanEnergyMj()        - Estimated radio energy spent scanning
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <bluetooth/bluetooth.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <os_scan.h>
+
+// RSSI meaning "not heard", matches the node state and payload codec
+#define SCAN_RSSI_NONE      -128
+
+static const uint16_t levelIntervals[SCAN_NUM_LEVELS] = SCAN_LEVEL_INTERVALS;
+
+// Scan parameters and callback owned by the caller, only the interval and
+// window are changed here
+static struct bt_le_scan_param* scanParams;
+static bt_le_scan_cb_t* scanCallback;
+K_MUTEX_DEFINE(scanLock);
+
+static ScanStats stats;
+
+// Scheduler state, only touched from os_scanTick()'s thread
+static uint32_t epochStart;
+static uint32_t epochFrames;
+static uint8_t stableEpochs;
+static uint8_t burstEpochs;
+static int8_t latest[SCAN_MAX_ANCHORS];
+static int8_t reference[SCAN_MAX_ANCHORS];
+static uint8_t numAnchors;
+
+// Set when starting the scan failed (start, restart or tick), so scanning
+// is stopped and the next tick tries again (scan lock must be held)
+static bool scanFailed;
+
+/**
+ * @brief   Stop and start scanning with the current level's parameters 
+ *          (scan lock must be held)
+ * @param   whileStopped:   Called while scanning is stopped, can be NULL
+ * @retval  0 if successful, otherwise the scan start error
+ */
+static int scan_apply(ScanStoppedHook whileStopped) {
+
+    if (scanParams == NULL) {
+
+        return -EINVAL;
+    }
+
+    bt_le_scan_stop();
+
+    if (whileStopped != NULL) {
+
+        whileStopped(scanParams);
+    }
+    scanParams->interval = levelIntervals[stats.level];
+    scanParams->window = SCAN_WINDOW;
+
+    return bt_le_scan_start(scanParams, scanCallback);
+}
+
+/**
+ * @brief   Start scanning at the densest level
+ * @param   params:     Scan parameters (kept and reused on every restart)
+ * @param   callback:   Scan callback
+ * @retval  0 if successful, otherwise the scan start error
+ */
+int os_scanStart(struct bt_le_scan_param* params, bt_le_scan_cb_t* callback) {
+
+    k_mutex_lock(&scanLock, K_FOREVER);
+
+    scanParams = params;
+    scanCallback = callback;
+    stats.level = 0;
+    epochStart = k_uptime_get_32();
+    memset(latest, SCAN_RSSI_NONE, sizeof(latest));
+    memset(reference, SCAN_RSSI_NONE, sizeof(reference));
+
+    int err = scan_apply(NULL);
+    scanFailed = err != 0;
+
+    k_mutex_unlock(&scanLock);
+    return err;
+}
+
+/**
+ * @brief   Restart scanning, giving the caller a chance to change the scan
+ *          options (or anything else that needs scanning stopped, like the
+ *          controller accept list) without racing the scheduler
+ * @param   whileStopped:   Called while scanning is stopped, can be NULL
+ * @retval  0 if successful, otherwise the scan start error
+ */
+int os_scanRestart(ScanStoppedHook whileStopped) {
+
+    k_mutex_lock(&scanLock, K_FOREVER);
+    int err = scan_apply(whileStopped);
+    scanFailed = err != 0;
+    k_mutex_unlock(&scanLock);
+
+    return err;
+}
+
+/**
+ * @brief   Give the latest RSSI vector, compared once per epoch to detect 
+ *          motion. Call from the same thread as os_scanTick().
+ * @param   rssi:   RSSI of each anchor, SCAN_RSSI_NONE if not heard
+ * @param   len:    Number of anchors
+ */
+void os_scanNoteRssi(const int8_t* rssi, uint8_t len) {
+
+    numAnchors = MIN(len, SCAN_MAX_ANCHORS);
+    memcpy(latest, rssi, numAnchors);
+}
+
+/**
+ * @brief   Summed RSSI change since the last epoch. An anchor appearing or
+ *          disappearing counts as a full SCAN_MOTION_DB change.
+ * @retval  Change in dB
+ */
+static uint16_t scan_rssiChange(void) {
+
+    uint16_t change = 0;
+
+    for (uint8_t i = 0; i < numAnchors; i++) {
+
+        if ((latest[i] == SCAN_RSSI_NONE) != 
+                (reference[i] == SCAN_RSSI_NONE)) {
+
+            change += SCAN_MOTION_DB;
+        } else if (latest[i] != SCAN_RSSI_NONE) {
+
+            change += abs(latest[i] - reference[i]);
+        }
+    }
+
+    memcpy(reference, latest, numAnchors);
+    return change;
+}
+
+/**
+ * @brief   Run the scheduler. Cheap to call often, only adapts once every
+ *          SCAN_EPOCH_MS.
+ * @param   now:        Uptime (ms)
+ * @param   frames:     Running total of relevant frames heard
+ * @retval  0 if scanning, otherwise the scan start error (retried on the
+ *          next tick at the level scanning last started with)
+ */
+int os_scanTick(uint32_t now, uint32_t frames) {
+
+    int err = 0;
+    uint32_t elapsed = now - epochStart;
+    if (scanParams == NULL) {
+
+        return 0;
+    }
+
+    if (elapsed < SCAN_EPOCH_MS) {
+
+        k_mutex_lock(&scanLock, K_FOREVER);
+        if (scanFailed) {
+
+            err = scan_apply(NULL);
+            scanFailed = err != 0;
+        }
+        k_mutex_unlock(&scanLock);
+        return err;
+    }
+
+    uint32_t heard = frames - epochFrames;
+    uint8_t level = stats.level;
+
+    k_mutex_lock(&scanLock, K_FOREVER);
+
+    // Account for the epoch just finished
+    stats.scanOnMs += (elapsed * SCAN_WINDOW) / levelIntervals[level];
+    stats.frames += heard;
+    stats.framesPerSec = (heard * 1000) / elapsed;
+    epochStart = now;
+    epochFrames = frames;
+
+    if (scan_rssiChange() >= SCAN_MOTION_DB) {
+
+        // Moving - scan continuously for a while
+        stats.motionEpochs++;
+        burstEpochs = SCAN_BURST_EPOCHS;
+        stableEpochs = 0;
+        level = 0;
+    } else if (burstEpochs > 0) {
+
+        burstEpochs--;
+    } else if (heard > 0 && heard < SCAN_MIN_FRAMES) {
+
+        // Missing data, scan more
+        stableEpochs = 0;
+        level = level > 0 ? level - 1 : 0;
+    } else if (++stableEpochs >= SCAN_STABLE_EPOCHS) {
+
+        // Nothing is changing (or nothing is there at all), scan less
+        stableEpochs = 0;
+        level = MIN(level + 1, SCAN_NUM_LEVELS - 1);
+    }
+
+    if (level != stats.level || scanFailed) {
+
+        uint8_t previous = stats.level;
+
+        stats.level = level;
+        err = scan_apply(NULL);
+        if (err != 0) {
+
+            // Scanning is stopped, keep the old level and try again
+            stats.level = previous;
+        } else if (level != previous) {
+
+            stats.levelChanges++;
+        }
+        scanFailed = err != 0;
+    }
+
+    k_mutex_unlock(&scanLock);
+    return err;
+}
+
+/**
+ * @brief   Copy of the scan counters
+ * @param   out:    Copy to fill in
+ */
+void os_scanGetStats(ScanStats* out) {
+
+    k_mutex_lock(&scanLock, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&scanLock);
+}
+
+/**
+ * @brief   Estimated radio energy spent scanning so far
+ * @retval  Energy (mJ)
+ */
+uint32_t os_scanEnergyMj(void) {
+
+    return ((uint64_t)stats.scanOnMs * SCAN_RX_POWER_UW) / 1000000;
+}
@@ -0,0 +1,127 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_telemetry.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Base node link statistics for mobile node payloads. Each
+ *                  payload carries a sequence number, the sender's uptime and
+ *                  the age of its newest reading, so without synchronised
+ *                  clocks we can still count gaps, track jitter of the one
+ *                  way delay, and estimate how old the information is by the
+ *                  time it reaches us.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_telemetryInit()       - Reset every source's statistics
+ * os_telemetryRecord()     - Account for a payload heard from a source
+ * os_telemetryGet()        - Take a consistent copy of a source's statistics
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <string.h>
+
+#include <os_payload.h>
+#include <os_telemetry.h>
+
+// Recorded from the BT RX thread, read from the reporting thread
+static TelemetrySource sources[TELEMETRY_MAX_SOURCES];
+static struct k_spinlock sourcesLock;
+
+/**
+ * @brief   Reset every source's statistics
+ */
+void os_telemetryInit(void) {
+
+    k_spinlock_key_t key = k_spin_lock(&sourcesLock);
+    memset(sources, 0, sizeof(sources));
+    k_spin_unlock(&sourcesLock, key);
+}
+
+/**
+ * @brief   Account for a payload heard from a source. Senders repeat a 
+ *          payload until it changes, so only the first copy of each sequence
+ *          number is counted, and any gap is counted as lost payloads.
+ * @param   source:     Source index
+ * @param   seq:        Payload sequence number
+ * @param   uptime:     Sender uptime when the payload was made (ms, wrapping)
+ * @param   age:        Age of the payload's newest reading 
+ *                      (PAYLOAD_AGE_UNIT_MS)
+ * @param   now:        Our uptime (ms)
+ * @retval  true if this is a new payload, false for a repeat
+ */
+uint8_t os_telemetryRecord(uint16_t source, uint8_t seq, uint16_t uptime, 
+        uint8_t age, uint32_t now) {
+
+    if (source >= TELEMETRY_MAX_SOURCES) {
+
+        return false;
+    }
+
+    TelemetrySource* s = &sources[source];
+    uint16_t transit = (uint16_t)now - uptime;
+    k_spinlock_key_t key = k_spin_lock(&sourcesLock);
+
+    if (s->seen && seq == s->lastSeq) {
+
+        k_spin_unlock(&sourcesLock, key);
+        return false;
+    }
+
+    if (s->seen) {
+
+        s->lost += (uint8_t)(seq - s->lastSeq - 1);
+
+        // Clock offset cancels out of the transit difference
+        int16_t d = (int16_t)(transit - s->lastTransit);
+        s->jitter += (d < 0 ? -d : d) - (s->jitter >> 4);
+    } else {
+
+        s->minTransit = transit;
+    }
+
+    // Delay above the fastest delivery seen, plus the time the reading
+    // spent on the sender before it went out
+    int16_t delay = (int16_t)(transit - s->minTransit);
+    if (delay < 0) {
+
+        s->minTransit = transit;
+        delay = 0;
+    }
+    uint32_t aoi = delay + age * PAYLOAD_AGE_UNIT_MS;
+
+    uint8_t bin = 0;
+    while (bin < TELEMETRY_HIST_BINS - 1 && 
+            aoi >= (TELEMETRY_HIST_BASE_MS << bin)) {
+
+        bin++;
+    }
+    s->aoi[bin]++;
+
+    s->received++;
+    s->lastSeq = seq;
+    s->lastTransit = transit;
+    s->seen = true;
+
+    k_spin_unlock(&sourcesLock, key);
+    return true;
+}
+
+/**
+ * @brief   Take a consistent copy of a source's statistics
+ * @param   source:     Source index
+ * @param   out:        Copy to fill in
+ */
+void os_telemetryGet(uint16_t source, TelemetrySource* out) {
+
+    if (source >= TELEMETRY_MAX_SOURCES) {
+
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&sourcesLock);
+    *out = sources[source];
+    k_spin_unlock(&sourcesLock, key);
+}
@@ -0,0 +1,373 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_uartframe.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Binary framed UART output from the base node. Records are
+ *                  copied into a ring buffer by the caller (usually the BT RX
+ *                  thread), and a separate thread frames them and hands each
+ *                  frame to the interrupt driven UART, so a slow link only 
+ *                  ever costs dropped records, never a stalled scan callback.
+ *                  Commands from the host use the same framing, and are 
+ *                  decoded on their own thread.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_uartFrameInit()       - Bind the UART frames are sent and received over
+ * os_uartFrameSend()       - Queue a record to be sent, never blocks
+ * os_uartFrameSendWait()   - Queue a record, waiting for room if needed
+ * os_uartFrameTx()         - Thread routine draining queued records
+ * os_uartFrameRx()         - Thread routine decoding received commands
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <device.h>
+#include <drivers/uart.h>
+#include <sys/ring_buffer.h>
+#include <sys/crc.h>
+#include <sys/util.h>
+#include <errno.h>
+
+#include <os_uartframe.h>
+
+UartFrameStats os_uartFrameStats;
+
+// Queued records, producers may be on different threads
+RING_BUF_DECLARE(frameRing, UART_FRAME_RING_SIZE);
+static struct k_spinlock frameRingLock;
+K_SEM_DEFINE(frameQueued, 0, K_SEM_MAX_LIMIT);
+K_SEM_DEFINE(frameSpace, 0, 1);
+
+// Frame currently being fed to the UART by the ISR
+static const struct device* uartDev;
+static const uint8_t* txData;
+static volatile uint16_t txRemaining;
+K_SEM_DEFINE(txDone, 0, 1);
+
+// Received bytes, only written by the ISR and read by the RX thread
+RING_BUF_DECLARE(rxRing, UART_FRAME_RX_RING_SIZE);
+K_SEM_DEFINE(rxReady, 0, 1);
+static UartFrameHandler rxHandler;
+
+/**
+ * @brief   UART interrupt handler, feeds the current frame into the TX FIFO
+ *          and moves received bytes into the RX ring
+ * @param   dev:        UART device
+ * @param   userData:   Unused
+ */
+static void uart_frameIsr(const struct device* dev, void* userData) {
+
+    uart_irq_update(dev);
+
+    if (uart_irq_rx_ready(dev)) {
+
+        uint8_t* space;
+        uint32_t size = ring_buf_put_claim(&rxRing, &space, 
+                UART_FRAME_RX_RING_SIZE);
+        int read = 0;
+
+        if (size > 0) {
+
+            read = uart_fifo_read(dev, space, size);
+        } else {
+
+            // Ring is full, the host is sending faster than we decode
+            uint8_t discard[16];
+            uart_fifo_read(dev, discard, sizeof(discard));
+        }
+        ring_buf_put_finish(&rxRing, MAX(read, 0));
+        k_sem_give(&rxReady);
+    }
+
+    if (!uart_irq_tx_ready(dev)) {
+
+        return;
+    }
+
+    if (txRemaining == 0) {
+
+        uart_irq_tx_disable(dev);
+        k_sem_give(&txDone);
+        return;
+    }
+
+    int filled = uart_fifo_fill(dev, txData, txRemaining);
+    if (filled > 0) {
+
+        txData += filled;
+        txRemaining -= filled;
+    }
+}
+
+/**
+ * @brief   COBS encode a buffer, so the frame contains no zero bytes
+ * @param   in:     Data to encode
+ * @param   len:    Length of data
+ * @param   out:    Encoded data (at least len + len / 254 + 1 bytes)
+ * @retval  Encoded length
+ */
+static uint16_t uart_cobsEncode(const uint8_t* in, uint16_t len, 
+        uint8_t* out) {
+
+    uint16_t code = 0;
+    uint16_t pos = 1;
+
+    for (uint16_t i = 0; i < len; i++) {
+
+        if (in[i] != 0) {
+
+            out[pos++] = in[i];
+        }
+
+        if (in[i] == 0 || pos - code == 0xFF) {
+
+            out[code] = pos - code;
+            code = pos++;
+        }
+    }
+    out[code] = pos - code;
+
+    return pos;
+}
+
+/**
+ * @brief   COBS decode a frame (without its delimiter)
+ * @param   in:     Encoded frame
+ * @param   len:    Length of encoded frame
+ * @param   out:    Decoded data (at least len bytes)
+ * @retval  Decoded length, or -EINVAL if the frame is malformed
+ */
+static int uart_cobsDecode(const uint8_t* in, uint16_t len, uint8_t* out) {
+
+    uint16_t pos = 0;
+    uint16_t i = 0;
+
+    while (i < len) {
+
+        uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > len) {
+
+            return -EINVAL;
+        }
+
+        for (uint8_t j = 1; j < code; j++) {
+
+            out[pos++] = in[i++];
+        }
+
+        if (code < 0xFF && i < len) {
+
+            out[pos++] = 0;
+        }
+    }
+
+    return pos;
+}
+
+/**
+ * @brief   Bind the UART frames are sent and received over
+ * @param   dev:        Interrupt driven UART device
+ * @param   handler:    Called for each command received, can be NULL
+ * @retval  0 if successful, -ENODEV if there is no device
+ */
+int os_uartFrameInit(const struct device* dev, UartFrameHandler handler) {
+
+    if (dev == NULL) {
+
+        return -ENODEV;
+    }
+
+    uart_irq_tx_disable(dev);
+    uart_irq_callback_user_data_set(dev, uart_frameIsr, NULL);
+    rxHandler = handler;
+    uartDev = dev;
+    uart_irq_rx_enable(dev);
+
+    return 0;
+}
+
+/**
+ * @brief   Copy a record into the queue if there is room
+ * @param   type:       Record type (UART_FRAME_*)
+ * @param   payload:    Record payload
+ * @param   len:        Payload length
+ * @retval  0 if queued, -ENOBUFS if there is no room (or no UART yet)
+ */
+static int uart_frameQueue(uint8_t type, const uint8_t* payload, uint8_t len) {
+
+    uint8_t header[2] = {len, type};
+    k_spinlock_key_t key = k_spin_lock(&frameRingLock);
+
+    if (uartDev == NULL || 
+            ring_buf_space_get(&frameRing) < sizeof(header) + len) {
+
+        k_spin_unlock(&frameRingLock, key);
+        return -ENOBUFS;
+    }
+
+    ring_buf_put(&frameRing, header, sizeof(header));
+    ring_buf_put(&frameRing, payload, len);
+
+    k_spin_unlock(&frameRingLock, key);
+
+    k_sem_give(&frameQueued);
+    return 0;
+}
+
+/**
+ * @brief   Queue a record to be sent. Never blocks - if the queue is full the
+ *          record is dropped and counted in os_uartFrameStats.
+ * @param   type:       Record type (UART_FRAME_*)
+ * @param   payload:    Record payload
+ * @param   len:        Payload length
+ * @retval  0 if queued, -EINVAL if too long, -ENOBUFS if dropped
+ */
+int os_uartFrameSend(uint8_t type, const uint8_t* payload, uint8_t len) {
+
+    if (len > UART_FRAME_MAX_PAYLOAD) {
+
+        return -EINVAL;
+    }
+
+    int err = uart_frameQueue(type, payload, len);
+    if (err) {
+
+        atomic_inc(&os_uartFrameStats.dropped);
+    }
+
+    return err;
+}
+
+/**
+ * @brief   Queue a record to be sent, waiting (up to UART_FRAME_WAIT_MS) for
+ *          room if the queue is full. For bulk output from threads that can 
+ *          afford to block, never from the scan callback.
+ * @param   type:       Record type (UART_FRAME_*)
+ * @param   payload:    Record payload
+ * @param   len:        Payload length
+ * @retval  0 if queued, -EINVAL if too long, -ENOBUFS if dropped
+ */
+int os_uartFrameSendWait(uint8_t type, const uint8_t* payload, uint8_t len) {
+
+    if (len > UART_FRAME_MAX_PAYLOAD) {
+
+        return -EINVAL;
+    }
+
+    uint32_t start = k_uptime_get_32();
+    int err;
+
+    while ((err = uart_frameQueue(type, payload, len)) != 0 && 
+            k_uptime_get_32() - start < UART_FRAME_WAIT_MS) {
+
+        // The TX thread gives this each time it frees up a record's space
+        k_sem_take(&frameSpace, K_MSEC(UART_FRAME_WAIT_MS));
+    }
+
+    if (err) {
+
+        atomic_inc(&os_uartFrameStats.dropped);
+    }
+
+    return err;
+}
+
+/**
+ * @brief   Thread routine draining queued records - each record is framed 
+ *          and handed to the UART interrupt, and the next one is only started
+ *          once the whole frame is in the TX FIFO
+ * @param   arg1:   Unused
+ * @param   arg2:   Unused
+ * @param   arg3:   Unused
+ */
+void os_uartFrameTx(void* arg1, void* arg2, void* arg3) {
+
+    uint8_t raw[UART_FRAME_MAX_RAW];
+    uint8_t frame[UART_FRAME_MAX_ENCODED];
+
+    while (1) {
+
+        k_sem_take(&frameQueued, K_FOREVER);
+
+        // Take the record out of the queue
+        uint8_t header[2];
+        k_spinlock_key_t key = k_spin_lock(&frameRingLock);
+        ring_buf_get(&frameRing, header, sizeof(header));
+        ring_buf_get(&frameRing, &raw[1], header[0]);
+        k_spin_unlock(&frameRingLock, key);
+        k_sem_give(&frameSpace);
+
+        // [type] [payload] [CRC16]
+        uint16_t len = 1 + header[0];
+        raw[0] = header[1];
+        uint16_t crc = crc16_ccitt(0, raw, len);
+        raw[len++] = crc & 0xFF;
+        raw[len++] = crc >> 8;
+
+        len = uart_cobsEncode(raw, len, frame);
+        frame[len++] = 0x00;
+
+        // The interrupt feeds the FIFO until the frame is gone
+        txData = frame;
+        txRemaining = len;
+        uart_irq_tx_enable(uartDev);
+        k_sem_take(&txDone, K_FOREVER);
+
+        atomic_inc(&os_uartFrameStats.sent);
+    }
+}
+
+/**
+ * @brief   Thread routine decoding received commands - bytes are collected up
+ *          to each 0x00 delimiter, and frames that decode and pass their CRC
+ *          are handed to the handler given to os_uartFrameInit()
+ * @param   arg1:   Unused
+ * @param   arg2:   Unused
+ * @param   arg3:   Unused
+ */
+void os_uartFrameRx(void* arg1, void* arg2, void* arg3) {
+
+    uint8_t frame[UART_FRAME_MAX_ENCODED];
+    uint8_t raw[UART_FRAME_MAX_ENCODED];
+    uint16_t len = 0;
+    uint8_t overflow = false;
+
+    while (1) {
+
+        k_sem_take(&rxReady, K_FOREVER);
+
+        uint8_t byte;
+        while (ring_buf_get(&rxRing, &byte, 1) == 1) {
+
+            if (byte != 0x00) {
+
+                // Too long to be one of ours, skip to the next delimiter
+                if (len == sizeof(frame)) {
+
+                    overflow = true;
+                } else {
+
+                    frame[len++] = byte;
+                }
+                continue;
+            }
+
+            int rawLen = overflow ? -EINVAL : uart_cobsDecode(frame, len, raw);
+            len = 0;
+            overflow = false;
+
+            if (rawLen < 3 || crc16_ccitt(0, raw, rawLen - 2) != 
+                    (raw[rawLen - 2] | (raw[rawLen - 1] << 8))) {
+
+                continue;
+            }
+
+            if (rxHandler != NULL) {
+
+                rxHandler(raw[0], &raw[1], rawLen - 3);
+            }
+        }
+    }
+}
@@ -0,0 +1,320 @@
+/**
+ ******************************************************************************
+ * @file            myoslib/src/os_whitelist.c
+ * @author          Alexander FitzGerald - 45330874
+ * @date            17102026
+ * @brief           Runtime list of mobile nodes the base node forwards. 
+ *                  Lookups from the scan callback are a hash and a short 
+ *                  linear probe. While the list fits in the controller's 
+ *                  accept list it is programmed there as well, so frames from
+ *                  anything else never reach the host.
+ ******************************************************************************
+ * EXTERNAL FUNCTIONS
+ ******************************************************************************
+ * os_whitelistInit()       - Empty the list
+ * os_whitelistAdd()        - Add (or re-number) a mobile node
+ * os_whitelistRemove()     - Remove a mobile node
+ * os_whitelistClear()      - Remove every mobile node
+ * os_whitelistLookup()     - Get the source index of an address
+ * os_whitelistCount()      - Number of mobile nodes in the list
+ * os_whitelistGet()        - Get the n-th mobile node in the list
+ * os_whitelistHwSync()     - Program the controller accept list
+ ******************************************************************************
+ */
+
+#include <zephyr.h>
+#include <zephyr/types.h>
+#include <bluetooth/bluetooth.h>
+#include <string.h>
+#include <errno.h>
+
+#include <os_bluetooth.h>
+#include <os_whitelist.h>
+
+BUILD_ASSERT(WHITELIST_TABLE_SIZE >= 2 * WHITELIST_MAX_MOBILES, 
+        "Whitelist table must be at least twice the maximum entries");
+
+#define SLOT_EMPTY      0
+#define SLOT_USED       1
+#define SLOT_DELETED    2
+
+// A single table slot
+typedef struct {
+    uint64_t    key;
+    uint16_t    source;
+    uint8_t     state;
+    uint8_t     type;
+} WhitelistSlot;
+
+// Written from the command thread, read from the scan callback. Both are
+// threads (never an ISR), so a mutex guards the table and interrupts stay on
+// while a rehash or listing walks it
+static WhitelistSlot table[WHITELIST_TABLE_SIZE];
+static uint16_t numUsed;
+static uint16_t numDeleted;
+K_MUTEX_DEFINE(tableLock);
+
+/**
+ * @brief   Hash a packed address into a table slot
+ * @param   key:    Packed address
+ * @retval  Starting slot in the table
+ */
+static inline uint16_t whitelist_hash(uint64_t key) {
+
+    // Fibonacci hashing - top bits of the product are well mixed
+    return (uint16_t)((key * 0x9E3779B97F4A7C15ULL) >> 
+            (64 - WHITELIST_TABLE_BITS));
+}
+
+/**
+ * @brief   Find the slot holding a key (table lock must be held)
+ * @param   key:    Packed address
+ * @retval  Slot index, or -ENOENT if not in the table
+ */
+static int whitelist_find(uint64_t key) {
+
+    uint16_t i = whitelist_hash(key);
+
+    // Deleted slots keep the probe chain going, only empty slots end it
+    while (table[i].state != SLOT_EMPTY) {
+
+        if (table[i].state == SLOT_USED && table[i].key == key) {
+
+            return i;
+        }
+        i = (i + 1) & (WHITELIST_TABLE_SIZE - 1);
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * @brief   Re-insert every entry to clear out deleted slots, once enough have
+ *          built up to lengthen probe chains (table lock must be held)
+ */
+static void whitelist_rehash(void) {
+
+    static WhitelistSlot live[WHITELIST_MAX_MOBILES];
+    uint16_t count = 0;
+
+    for (uint16_t i = 0; i < WHITELIST_TABLE_SIZE; i++) {
+
+        if (table[i].state == SLOT_USED) {
+
+            live[count++] = table[i];
+        }
+    }
+
+    memset(table, 0, sizeof(table));
+    for (uint16_t n = 0; n < count; n++) {
+
+        uint16_t i = whitelist_hash(live[n].key);
+        while (table[i].state != SLOT_EMPTY) {
+
+            i = (i + 1) & (WHITELIST_TABLE_SIZE - 1);
+        }
+        table[i] = live[n];
+    }
+    numDeleted = 0;
+}
+
+/**
+ * @brief   Empty the list
+ */
+void os_whitelistInit(void) {
+
+    os_whitelistClear();
+}
+
+/**
+ * @brief   Add a mobile node, or change its source index if already listed
+ * @param   address:    Address of the mobile node
+ * @param   source:     Source index its records are tagged with
+ * @retval  0 if successful, -EINVAL for a bad address or source, -ENOSPC if
+ *          the list is full
+ */
+int os_whitelistAdd(const bt_addr_le_t* address, uint16_t source) {
+
+    uint64_t key = os_bluetoothAddressKey(&address->a);
+    if (key == 0 || source >= WHITELIST_MAX_MOBILES) {
+
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&tableLock, K_FOREVER);
+
+    int slot = whitelist_find(key);
+    if (slot < 0) {
+
+        if (numUsed >= WHITELIST_MAX_MOBILES) {
+
+            k_mutex_unlock(&tableLock);
+            return -ENOSPC;
+        }
+
+        // Reuse the first free slot along the probe chain
+        uint16_t i = whitelist_hash(key);
+        while (table[i].state == SLOT_USED) {
+
+            i = (i + 1) & (WHITELIST_TABLE_SIZE - 1);
+        }
+        if (table[i].state == SLOT_DELETED) {
+
+            numDeleted--;
+        }
+        slot = i;
+        numUsed++;
+    }
+
+    table[slot].key = key;
+    table[slot].type = address->type;
+    table[slot].source = source;
+    table[slot].state = SLOT_USED;
+
+    k_mutex_unlock(&tableLock);
+    return 0;
+}
+
+/**
+ * @brief   Remove a mobile node
+ * @param   address:    Address of the mobile node
+ * @retval  0 if successful, -ENOENT if it was not listed
+ */
+int os_whitelistRemove(const bt_addr_t* address) {
+
+    uint64_t key = os_bluetoothAddressKey(address);
+    k_mutex_lock(&tableLock, K_FOREVER);
+
+    int slot = whitelist_find(key);
+    if (slot < 0) {
+
+        k_mutex_unlock(&tableLock);
+        return -ENOENT;
+    }
+
+    table[slot].state = SLOT_DELETED;
+    numUsed--;
+    numDeleted++;
+
+    if (numUsed + numDeleted > (WHITELIST_TABLE_SIZE * 3) / 4) {
+
+        whitelist_rehash();
+    }
+
+    k_mutex_unlock(&tableLock);
+    return 0;
+}
+
+/**
+ * @brief   Remove every mobile node
+ */
+void os_whitelistClear(void) {
+
+    k_mutex_lock(&tableLock, K_FOREVER);
+    memset(table, 0, sizeof(table));
+    numUsed = 0;
+    numDeleted = 0;
+    k_mutex_unlock(&tableLock);
+}
+
+/**
+ * @brief   Get the source index of an address
+ * @param   address:    Address to look up
+ * @retval  Source index, or -ENOENT if the address is not listed
+ */
+int os_whitelistLookup(const bt_addr_t* address) {
+
+    uint64_t key = os_bluetoothAddressKey(address);
+    k_mutex_lock(&tableLock, K_FOREVER);
+
+    int slot = whitelist_find(key);
+    int source = slot < 0 ? -ENOENT : table[slot].source;
+
+    k_mutex_unlock(&tableLock);
+    return source;
+}
+
+/**
+ * @brief   Number of mobile nodes in the list
+ * @retval  Count
+ */
+uint16_t os_whitelistCount(void) {
+
+    return numUsed;
+}
+
+/**
+ * @brief   Get the n-th mobile node in the list (in table order)
+ * @param   n:          Entry to get
+ * @param   address:    Address of the entry
+ * @param   source:     Source index of the entry
+ * @retval  0 if successful, -ENOENT if there is no n-th entry
+ */
+int os_whitelistGet(uint16_t n, bt_addr_le_t* address, uint16_t* source) {
+
+    k_mutex_lock(&tableLock, K_FOREVER);
+
+    for (uint16_t i = 0; i < WHITELIST_TABLE_SIZE; i++) {
+
+        if (table[i].state != SLOT_USED || n-- != 0) {
+
+            continue;
+        }
+
+        address->type = table[i].type;
+        for (uint8_t j = 0; j < sizeof(address->a.val); j++) {
+
+            address->a.val[j] = (table[i].key >> (8 * j)) & 0xFF;
+        }
+        *source = table[i].source;
+
+        k_mutex_unlock(&tableLock);
+        return 0;
+    }
+
+    k_mutex_unlock(&tableLock);
+    return -ENOENT;
+}
+
+/**
+ * @brief   Program the controller accept list with the whole list if it fits.
+ *          Scanning must be stopped while the controller list is changed.
+ * @retval  1 if the controller list holds every entry (scan with 
+ *          BT_LE_SCAN_OPT_FILTER_WHITELIST), 0 if it does not fit or the 
+ *          controller has no accept list, <0 on error
+ */
+int os_whitelistHwSync(void) {
+
+#ifdef CONFIG_BT_WHITELIST
+    bt_addr_le_t address;
+    uint16_t source;
+    int err;
+
+    err = bt_le_whitelist_clear();
+    if (err) {
+
+        return err;
+    }
+
+    uint16_t count = os_whitelistCount();
+    if (count == 0 || count > WHITELIST_HW_SIZE) {
+
+        return 0;
+    }
+
+    for (uint16_t n = 0; os_whitelistGet(n, &address, &source) == 0; n++) {
+
+        err = bt_le_whitelist_add(&address);
+        if (err) {
+
+            // Fall back to filtering in software
+            bt_le_whitelist_clear();
+            return err == -ENOMEM ? 0 : err;
+        }
+    }
+
+    return 1;
+#else
+    return 0;
+#endif  // CONFIG_BT_WHITELIST
+}